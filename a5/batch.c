@@ -0,0 +1,319 @@
+#define _DEFAULT_SOURCE // open_memstream, clock_gettime
+#include "batch.h"
+#include "sim.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum job_status { JOB_PASS, JOB_FAIL, JOB_FAULT, JOB_TIMEOUT, JOB_ERROR };
+
+static const char* status_names[] = {"PASS", "FAIL", "FAULT", "TIMEOUT",
+                                     "ERROR"};
+
+struct batch_job {
+  int                     line; // in the manifest
+  char*                   elf_name;
+  char*                   stdin_name;    // NULL: no input
+  char*                   expected_name; // NULL: do not check output
+  int                     argc;          // program args, argv[0] is "--"
+  char**                  argv;
+  const struct elf_image* image;
+  // results
+  int      status;
+  long int insns;
+  double   seconds;
+};
+
+// Jobs are split between the workers up front. A worker takes jobs from the
+// back of its own deque and, once that is empty, steals from the front of
+// the others', so a few slow jobs do not hold up the whole batch.
+struct deque {
+  pthread_mutex_t lock;
+  int*            jobs;
+  int             head;
+  int             tail;
+};
+
+struct batch {
+  struct batch_job* jobs;
+  int               num_jobs;
+  struct deque*     deques;
+  int               num_threads;
+  long int          max_insns;
+};
+
+struct worker {
+  pthread_t     thread;
+  struct batch* batch;
+  int           index;
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char* read_file(const char* file_name, size_t* size) {
+  FILE* file = fopen(file_name, "rb");
+  if (file == NULL)
+    return NULL;
+  char*  data = NULL;
+  size_t used = 0;
+  size_t max  = 0;
+  while (1) {
+    if (used == max) {
+      max  = max ? 2 * max : 4096;
+      data = realloc(data, max);
+      if (data == NULL)
+        break;
+    }
+    size_t got = fread(data + used, 1, max - used, file);
+    if (got == 0)
+      break;
+    used += got;
+  }
+  fclose(file);
+  *size = used;
+  return data;
+}
+
+static void run_job(struct batch_job* job, long int max_insns) {
+  FILE* in = fopen(job->stdin_name ? job->stdin_name : "/dev/null", "r");
+  if (in == NULL) {
+    job->status = JOB_ERROR;
+    return;
+  }
+  char*  output;
+  size_t output_size;
+  FILE*  out = open_memstream(&output, &output_size);
+  if (out == NULL) {
+    fclose(in);
+    job->status = JOB_ERROR;
+    return;
+  }
+
+  struct sim* sim = sim_create();
+  if (job->argc > 0)
+    sim_set_args(sim, job->argc, job->argv);
+  sim_load_image(sim, job->image);
+  sim_set_io(sim, in, out);
+  double start  = now();
+  int    result = sim_run_program(sim, max_insns);
+  job->seconds  = now() - start;
+  job->insns    = sim_insns(sim);
+  sim_delete(sim);
+  fclose(in);
+  fclose(out);
+
+  if (result == SIM_FAULT) {
+    job->status = JOB_FAULT;
+  } else if (result == SIM_STOPPED) {
+    job->status = JOB_TIMEOUT;
+  } else if (result != SIM_EXITED) {
+    job->status = JOB_ERROR; // ebreak, or replayed input diverged
+  } else if (job->expected_name) {
+    size_t expected_size;
+    char*  expected = read_file(job->expected_name, &expected_size);
+    if (expected == NULL)
+      job->status = JOB_ERROR;
+    else if (expected_size != output_size ||
+             memcmp(expected, output, output_size) != 0)
+      job->status = JOB_FAIL;
+    else
+      job->status = JOB_PASS;
+    free(expected);
+  } else {
+    job->status = JOB_PASS;
+  }
+  free(output);
+}
+
+static int take_job(struct deque* deque, int from_back) {
+  int job = -1;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head < deque->tail)
+    job = from_back ? deque->jobs[--deque->tail] : deque->jobs[deque->head++];
+  pthread_mutex_unlock(&deque->lock);
+  return job;
+}
+
+static void* worker_main(void* arg) {
+  struct worker* worker = arg;
+  struct batch*  batch  = worker->batch;
+  while (1) {
+    int job = take_job(&batch->deques[worker->index], 1);
+    for (int i = 1; job < 0 && i < batch->num_threads; ++i)
+      job = take_job(&batch->deques[(worker->index + i) % batch->num_threads],
+                     0);
+    if (job < 0)
+      return NULL; // no job is added later, so everything is taken
+    run_job(&batch->jobs[job], batch->max_insns);
+  }
+}
+
+// Split a manifest line into whitespace separated words, in place
+static int split_words(char* line, char** words, int max_words) {
+  int num_words = 0;
+  for (char* word = strtok(line, " \t\r\n"); word && num_words < max_words;
+       word       = strtok(NULL, " \t\r\n"))
+    words[num_words++] = word;
+  return num_words;
+}
+
+static int read_manifest(const char* manifest_name, struct batch* batch) {
+  FILE* manifest = fopen(manifest_name, "r");
+  if (manifest == NULL) {
+    perror("Error opening manifest");
+    return -1;
+  }
+  int  max_jobs = 0;
+  char line[4096];
+  for (int line_number = 1; fgets(line, sizeof(line), manifest);
+       ++line_number) {
+    char* words[256];
+    int   num_words = split_words(line, words, 256);
+    if (num_words == 0 || words[0][0] == '#')
+      continue;
+    if (num_words < 3) {
+      fprintf(stderr, "%s:%d: expected 'riscv-elf stdin expected [args]'\n",
+              manifest_name, line_number);
+      fclose(manifest);
+      return -1;
+    }
+    if (batch->num_jobs == max_jobs) {
+      max_jobs    = max_jobs ? 2 * max_jobs : 64;
+      batch->jobs = realloc(batch->jobs, max_jobs * sizeof(struct batch_job));
+      if (batch->jobs == NULL) {
+        fprintf(stderr, "Error allocating batch jobs\n");
+        exit(-1);
+      }
+    }
+    struct batch_job* job = &batch->jobs[batch->num_jobs++];
+    memset(job, 0, sizeof(*job));
+    job->line          = line_number;
+    job->elf_name      = strdup(words[0]);
+    job->stdin_name    = strcmp(words[1], "-") ? strdup(words[1]) : NULL;
+    job->expected_name = strcmp(words[2], "-") ? strdup(words[2]) : NULL;
+    if (num_words > 3) {
+      job->argc    = num_words - 2;
+      job->argv    = malloc(job->argc * sizeof(char*));
+      job->argv[0] = strdup("--");
+      for (int i = 1; i < job->argc; ++i)
+        job->argv[i] = strdup(words[i + 2]);
+    }
+  }
+  fclose(manifest);
+  return 0;
+}
+
+// Parse each distinct ELF file once. Returns the images to free afterwards.
+static struct elf_image** load_images(struct batch* batch, int* num_images) {
+  struct elf_image** images = calloc(batch->num_jobs, sizeof(*images));
+  *num_images               = 0;
+  for (int i = 0; i < batch->num_jobs; ++i) {
+    struct batch_job* job = &batch->jobs[i];
+    for (int j = 0; j < i && job->image == NULL; ++j) {
+      if (!strcmp(batch->jobs[j].elf_name, job->elf_name))
+        job->image = batch->jobs[j].image;
+    }
+    if (job->image == NULL) {
+      struct elf_image* image = elf_image_read(job->elf_name, stderr);
+      if (image == NULL) {
+        job->status = JOB_ERROR;
+        continue;
+      }
+      images[(*num_images)++] = image;
+      job->image              = image;
+    }
+  }
+  return images;
+}
+
+int batch_run(const char* manifest_name, int num_threads, long int max_insns,
+              FILE* out) {
+  if (num_threads <= 0)
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads <= 0)
+    num_threads = 1;
+  struct batch batch = {.num_threads = num_threads, .max_insns = max_insns};
+  if (read_manifest(manifest_name, &batch))
+    return -1;
+  int                num_images;
+  struct elf_image** images = load_images(&batch, &num_images);
+
+  // deal the runnable jobs out in contiguous blocks
+  batch.deques = calloc(num_threads, sizeof(struct deque));
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_mutex_init(&batch.deques[i].lock, NULL);
+    batch.deques[i].jobs = malloc((batch.num_jobs + 1) * sizeof(int));
+  }
+  int runnable = 0;
+  for (int i = 0; i < batch.num_jobs; ++i) {
+    if (batch.jobs[i].image) {
+      struct deque* deque =
+          &batch.deques[(long)runnable++ * num_threads / batch.num_jobs];
+      deque->jobs[deque->tail++] = i;
+    }
+  }
+
+  double         start   = now();
+  struct worker* workers = calloc(num_threads, sizeof(struct worker));
+  for (int i = 0; i < num_threads; ++i) {
+    workers[i].batch = &batch;
+    workers[i].index = i;
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+      fprintf(stderr, "Error starting batch worker %d\n", i);
+      exit(-1);
+    }
+  }
+  for (int i = 0; i < num_threads; ++i)
+    pthread_join(workers[i].thread, NULL);
+  double wall_time = now() - start;
+
+  int      failed      = 0;
+  long int total_insns = 0;
+  fprintf(out, "%5s  %-7s  %14s  %10s  %s\n", "line", "result",
+          "instructions", "MIPS", "program");
+  for (int i = 0; i < batch.num_jobs; ++i) {
+    struct batch_job* job  = &batch.jobs[i];
+    double            mips = job->seconds > 0 ? job->insns / job->seconds / 1e6
+                                              : 0.0;
+    fprintf(out, "%5d  %-7s  %14ld  %10.2f  %s", job->line,
+            status_names[job->status], job->insns, mips, job->elf_name);
+    for (int j = 1; j < job->argc; ++j)
+      fprintf(out, " %s", job->argv[j]);
+    fprintf(out, "\n");
+    failed += job->status != JOB_PASS;
+    total_insns += job->insns;
+  }
+  fprintf(out,
+          "%d jobs, %d passed, %d failed in %.3f s on %d threads "
+          "(%ld instructions, %.2f MIPS overall)\n",
+          batch.num_jobs, batch.num_jobs - failed, failed, wall_time,
+          num_threads, total_insns, total_insns / wall_time / 1e6);
+
+  for (int i = 0; i < num_images; ++i)
+    elf_image_delete(images[i]);
+  free(images);
+  for (int i = 0; i < batch.num_jobs; ++i) {
+    struct batch_job* job = &batch.jobs[i];
+    free(job->elf_name);
+    free(job->stdin_name);
+    free(job->expected_name);
+    for (int j = 0; j < job->argc; ++j)
+      free(job->argv[j]);
+    free(job->argv);
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_mutex_destroy(&batch.deques[i].lock);
+    free(batch.deques[i].jobs);
+  }
+  free(batch.deques);
+  free(batch.jobs);
+  free(workers);
+  return failed;
+}
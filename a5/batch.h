@@ -0,0 +1,23 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stdio.h>
+
+// Run every job listed in the manifest on num_threads worker threads
+// (<= 0: one per host CPU) and print a summary to out. A manifest has one
+// job per line:
+//
+//   riscv-elf  stdin-file  expected-output-file  [prog-args...]
+//
+// where '-' means no input / no output check, and prog-args are passed in
+// argv like 'sim riscv-elf -- prog-args' does. Blank lines and lines
+// starting with '#' are skipped. Every job gets its own memory, while jobs
+// running the same ELF file share one parsed copy of it. A job is stopped
+// after max_insns instructions (<= 0: no limit).
+//
+// Returns the number of jobs that did not pass, or -1 if the manifest could
+// not be read.
+int batch_run(const char* manifest_name, int num_threads, long int max_insns,
+              FILE* out);
+
+#endif
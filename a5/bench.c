@@ -0,0 +1,544 @@
+// Benchmark harness for the simulator, run by 'make bench':
+//
+//   simbench [-n runs] [-b baseline] [-w baseline] [-t percent] riscv-elf...
+//
+// Times the given programs and a few longer synthetic workloads, which are
+// assembled here, as each of them is runs times. A run repeats the program
+// (going back to a snapshot taken after loading it) until it has taken at
+// least MIN_RUN_TIME, and gives the MIPS of that. The median and the p90 (90%
+// of the runs were at least this fast) of the runs are reported.
+//
+// -w writes the medians to a baseline file, and -b compares against one: a
+// median more than percent (default 5) below the baseline is reported as a
+// regression, and makes the exit code 1. Baselines are only comparable on
+// the same host.
+
+#define _DEFAULT_SOURCE // clock_gettime
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_RUNS      100
+#define MIN_RUN_TIME  0.05 // seconds
+#define MAX_CODE      256  // words in a synthetic workload
+#define CODE_ADDR     0x10000
+#define DATA_ADDR     0x100000
+#define MAX_BASELINES 256
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// A tiny assembler for the synthetic workloads. Branch targets are word
+// indices in the code; forward ones are emitted empty and resolved once the
+// target is reached.
+
+enum reg {
+  ZERO, RA, SP, GP, TP, T0, T1, T2, S0, S1, A0, A1, A2, A3, A4, A5,
+  A6, A7, S2, S3, S4, S5, S6, S7, S8, S9, S10, S11, T3, T4, T5, T6
+};
+
+enum branch { BEQ = 0, BNE = 1, BLT = 4, BGE = 5 };
+
+struct code {
+  uint32_t words[MAX_CODE];
+  int      size;
+};
+
+static void emit(struct code* code, uint32_t word) {
+  if (code->size == MAX_CODE) {
+    fprintf(stderr, "simbench: workload too large\n");
+    exit(2);
+  }
+  code->words[code->size++] = word;
+}
+
+static uint32_t b_offset(uint32_t offset) {
+  return (((offset >> 12) & 1) << 31) | (((offset >> 5) & 0x3f) << 25) |
+         (((offset >> 1) & 0xf) << 8) | (((offset >> 11) & 1) << 7);
+}
+
+static uint32_t j_offset(uint32_t offset) {
+  return (((offset >> 20) & 1) << 31) | (((offset >> 1) & 0x3ff) << 21) |
+         (((offset >> 11) & 1) << 20) | (((offset >> 12) & 0xff) << 12);
+}
+
+static void op(struct code* code, uint32_t funct7, uint32_t funct3,
+               uint32_t rd, uint32_t rs1, uint32_t rs2) {
+  emit(code, (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) |
+                 (rd << 7) | 0b0110011);
+}
+
+static void add(struct code* code, int rd, int rs1, int rs2) {
+  op(code, 0, 0b000, rd, rs1, rs2);
+}
+
+static void sub(struct code* code, int rd, int rs1, int rs2) {
+  op(code, 0b0100000, 0b000, rd, rs1, rs2);
+}
+
+static void xor(struct code* code, int rd, int rs1, int rs2) {
+  op(code, 0, 0b100, rd, rs1, rs2);
+}
+
+static void mul(struct code* code, int rd, int rs1, int rs2) {
+  op(code, 0b0000001, 0b000, rd, rs1, rs2);
+}
+
+static void addi(struct code* code, uint32_t rd, uint32_t rs1, uint32_t imm) {
+  emit(code, ((imm & 0xfff) << 20) | (rs1 << 15) | (rd << 7) | 0b0010011);
+}
+
+static void li(struct code* code, int rd, int32_t value) {
+  int32_t low = (int32_t)((uint32_t)value << 20) >> 20;
+  if ((uint32_t)value - low) {
+    emit(code, ((uint32_t)value - low) | (rd << 7) | 0b0110111); // lui
+    if (low)
+      addi(code, rd, rd, low);
+  } else {
+    addi(code, rd, ZERO, low);
+  }
+}
+
+// lw is funct3 0b010, lbu 0b100
+static void load(struct code* code, uint32_t funct3, uint32_t rd,
+                 uint32_t offset, uint32_t rs1) {
+  emit(code, ((offset & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) |
+                 (rd << 7) | 0b0000011);
+}
+
+// sw is funct3 0b010, sb 0b000
+static void store(struct code* code, uint32_t funct3, uint32_t rs2,
+                  uint32_t offset, uint32_t rs1) {
+  emit(code, (((offset >> 5) & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) |
+                 (funct3 << 12) | ((offset & 0x1f) << 7) | 0b0100011);
+}
+
+static void branch(struct code* code, enum branch kind, uint32_t rs1,
+                   uint32_t rs2, int target) {
+  emit(code, b_offset((target - code->size) * 4) | (rs2 << 20) | (rs1 << 15) |
+                 ((uint32_t)kind << 12) | 0b1100011);
+}
+
+static void jump(struct code* code, int target) {
+  emit(code, j_offset((target - code->size) * 4) | 0b1101111);
+}
+
+// a branch to be resolved later, returns where it is
+static int branch_forward(struct code* code, enum branch kind, int rs1,
+                          int rs2) {
+  branch(code, kind, rs1, rs2, code->size);
+  return code->size - 1;
+}
+
+// make the branch at index at go to the next instruction
+static void resolve(struct code* code, int at) {
+  code->words[at] |= b_offset((code->size - at) * 4);
+}
+
+static void exit_program(struct code* code) {
+  li(code, A7, 93);
+  emit(code, 0b1110011); // ecall
+}
+
+// The synthetic workloads. Each runs some 10 million instructions, with its
+// data at DATA_ADDR.
+
+// copy 64 KB a word at a time, 100 times
+static void assemble_memcpy(struct code* code) {
+  li(code, S0, 100);
+  int outer = code->size;
+  li(code, A0, DATA_ADDR);
+  li(code, A1, DATA_ADDR + 0x10000);
+  li(code, A2, 0x10000 / 4);
+  int loop = code->size;
+  load(code, 0b010, T0, 0, A0);
+  store(code, 0b010, T0, 0, A1);
+  addi(code, A0, A0, 4);
+  addi(code, A1, A1, 4);
+  addi(code, A2, A2, -1);
+  branch(code, BNE, A2, ZERO, loop);
+  addi(code, S0, S0, -1);
+  branch(code, BNE, S0, ZERO, outer);
+  exit_program(code);
+}
+
+// fill 1024 words with pseudo random numbers and insertion sort them, 8
+// times
+static void assemble_sort(struct code* code) {
+  li(code, S0, 8);
+  li(code, T1, 12345);
+  li(code, T2, 1103515245);
+  li(code, S2, 1024 * 4);
+  int outer = code->size;
+  li(code, A0, DATA_ADDR);
+  li(code, A1, 1024);
+  int fill = code->size;
+  mul(code, T1, T1, T2);
+  addi(code, T1, T1, 1234);
+  store(code, 0b010, T1, 0, A0);
+  addi(code, A0, A0, 4);
+  addi(code, A1, A1, -1);
+  branch(code, BNE, A1, ZERO, fill);
+
+  li(code, A0, DATA_ADDR);
+  li(code, S1, 4); // offset of the element to insert
+  int insert = code->size;
+  add(code, T0, A0, S1);
+  load(code, 0b010, A2, 0, T0); // the element
+  int shift   = code->size;
+  int at_base = branch_forward(code, BEQ, T0, A0);
+  load(code, 0b010, T3, -4, T0);
+  int in_place = branch_forward(code, BGE, A2, T3);
+  store(code, 0b010, T3, 0, T0);
+  addi(code, T0, T0, -4);
+  jump(code, shift);
+  resolve(code, at_base);
+  resolve(code, in_place);
+  store(code, 0b010, A2, 0, T0);
+  addi(code, S1, S1, 4);
+  branch(code, BNE, S1, S2, insert);
+
+  addi(code, S0, S0, -1);
+  branch(code, BNE, S0, ZERO, outer);
+  exit_program(code);
+}
+
+// the primes below 256K with a byte per number, 4 times
+static void assemble_sieve(struct code* code) {
+  li(code, S0, 4);
+  li(code, S2, 256 * 1024);
+  li(code, A0, DATA_ADDR);
+  int outer = code->size;
+  add(code, A1, A0, ZERO);
+  add(code, A2, S2, ZERO);
+  li(code, T0, 1);
+  int clear = code->size;
+  store(code, 0b000, T0, 0, A1);
+  addi(code, A1, A1, 1);
+  addi(code, A2, A2, -1);
+  branch(code, BNE, A2, ZERO, clear);
+
+  li(code, S1, 2);
+  int next = code->size;
+  mul(code, T1, S1, S1);
+  int done = branch_forward(code, BGE, T1, S2);
+  add(code, T2, A0, S1);
+  load(code, 0b100, T3, 0, T2);
+  int composite = branch_forward(code, BEQ, T3, ZERO);
+  int cross_out = code->size;
+  add(code, T2, A0, T1);
+  store(code, 0b000, ZERO, 0, T2);
+  add(code, T1, T1, S1);
+  branch(code, BLT, T1, S2, cross_out);
+  resolve(code, composite);
+  addi(code, S1, S1, 1);
+  jump(code, next);
+  resolve(code, done);
+
+  addi(code, S0, S0, -1);
+  branch(code, BNE, S0, ZERO, outer);
+  exit_program(code);
+}
+
+// multiply two 64x64 word matrices, 5 times
+#define MATRIX_A DATA_ADDR
+#define MATRIX_B (DATA_ADDR + 0x4000)
+#define MATRIX_C (DATA_ADDR + 0x8000)
+
+static void assemble_matrix(struct code* code) {
+  li(code, S0, 5);
+  int outer = code->size;
+  li(code, S1, MATRIX_A); // row of A
+  li(code, S3, MATRIX_C); // element of C
+  li(code, S5, MATRIX_B + 256);   // end of the columns
+  li(code, S6, MATRIX_A + 0x4000); // end of the rows
+  int row = code->size;
+  li(code, S2, MATRIX_B); // column of B
+  int column = code->size;
+  li(code, T0, 0); // sum
+  add(code, T1, S1, ZERO);
+  add(code, T2, S2, ZERO);
+  addi(code, T6, S1, 256);
+  int dot = code->size;
+  load(code, 0b010, T3, 0, T1);
+  load(code, 0b010, T4, 0, T2);
+  mul(code, T3, T3, T4);
+  add(code, T0, T0, T3);
+  addi(code, T1, T1, 4);
+  addi(code, T2, T2, 256);
+  branch(code, BNE, T1, T6, dot);
+  store(code, 0b010, T0, 0, S3);
+  addi(code, S3, S3, 4);
+  addi(code, S2, S2, 4);
+  branch(code, BNE, S2, S5, column);
+  addi(code, S1, S1, 256);
+  branch(code, BNE, S1, S6, row);
+  addi(code, S0, S0, -1);
+  branch(code, BNE, S0, ZERO, outer);
+  exit_program(code);
+}
+
+static void init_matrix(struct memory* mem) {
+  for (int i = 0; i < 64 * 64; i++) {
+    memory_wr_w(mem, MATRIX_A + i * 4, i % 61);
+    memory_wr_w(mem, MATRIX_B + i * 4, i % 59 - 29);
+  }
+}
+
+// A bytecode interpreter, dispatching with a chain of compares. Each
+// bytecode is an opcode and an operand byte.
+enum bytecode { OP_ADD, OP_XOR, OP_SUB, OP_LOOP, OP_HALT };
+
+static void assemble_interpreter(struct code* code) {
+  li(code, S1, DATA_ADDR); // the bytecode
+  add(code, S2, S1, ZERO); // its pc
+  li(code, A0, 0);         // accumulator
+  li(code, A1, 200000);    // loop counter
+  int dispatch = code->size;
+  load(code, 0b100, T0, 0, S2);
+  load(code, 0b100, T1, 1, S2);
+  addi(code, S2, S2, 2);
+  int to_add = branch_forward(code, BEQ, T0, ZERO);
+  addi(code, T2, T0, -OP_XOR);
+  int to_xor = branch_forward(code, BEQ, T2, ZERO);
+  addi(code, T2, T0, -OP_SUB);
+  int to_sub = branch_forward(code, BEQ, T2, ZERO);
+  addi(code, T2, T0, -OP_LOOP);
+  int to_loop = branch_forward(code, BEQ, T2, ZERO);
+  exit_program(code);
+  resolve(code, to_add);
+  add(code, A0, A0, T1);
+  jump(code, dispatch);
+  resolve(code, to_xor);
+  xor(code, A0, A0, T1);
+  jump(code, dispatch);
+  resolve(code, to_sub);
+  sub(code, A0, A0, T1);
+  jump(code, dispatch);
+  resolve(code, to_loop); // to bytecode operand while the counter lasts
+  addi(code, A1, A1, -1);
+  branch(code, BEQ, A1, ZERO, dispatch);
+  add(code, T1, T1, T1);
+  add(code, S2, S1, T1);
+  jump(code, dispatch);
+}
+
+static void init_interpreter(struct memory* mem) {
+  static const uint8_t bytecode[] = {OP_ADD, 3,  OP_XOR, 0x55, OP_SUB,  1,
+                                     OP_ADD, 7,  OP_XOR, 0x0f, OP_LOOP, 0,
+                                     OP_HALT, 0};
+  memory_wr_block(mem, DATA_ADDR, bytecode, sizeof(bytecode));
+}
+
+struct workload {
+  const char* name;
+  void (*assemble)(struct code* code);
+  void (*init)(struct memory* mem); // NULL: no data
+};
+
+static const struct workload workloads[] = {
+    {"memcpy", assemble_memcpy, NULL},
+    {"sort", assemble_sort, NULL},
+    {"sieve", assemble_sieve, NULL},
+    {"matrix", assemble_matrix, init_matrix},
+    {"interpreter", assemble_interpreter, init_interpreter},
+};
+
+static void load_workload(struct sim* sim, const struct workload* workload) {
+  struct code code = {.size = 0};
+  workload->assemble(&code);
+  struct memory* mem = sim_memory(sim);
+  memory_wr_block(mem, CODE_ADDR, code.words, code.size * 4);
+  memory_set_perm(mem, CODE_ADDR, code.size * 4,
+                  MEMORY_PERM_R | MEMORY_PERM_X);
+  if (workload->init)
+    workload->init(mem);
+  sim_set_pc(sim, CODE_ADDR);
+}
+
+// Timing
+
+struct result {
+  const char* name;
+  long int    insns; // in one run of the program
+  double      median;
+  double      p90;
+};
+
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+// time the program loaded in sim, which is left at the snapshot
+static int measure(struct sim* sim, int runs, struct result* result) {
+  double mips[MAX_RUNS];
+  sim_snapshot(sim);
+  for (int i = 0; i < runs; i++) {
+    long int insns   = 0;
+    double   seconds = 0;
+    while (seconds < MIN_RUN_TIME) {
+      sim_restore(sim);
+      long int before = sim_insns(sim);
+      double   start  = now();
+      int      status = sim_run_program(sim, 0);
+      seconds += now() - start;
+      if (status != SIM_EXITED) {
+        fprintf(stderr, "simbench: %s did not exit normally\n",
+                result->name);
+        return -1;
+      }
+      result->insns = sim_insns(sim) - before;
+      insns += result->insns;
+    }
+    mips[i] = insns / seconds / 1e6;
+  }
+  qsort(mips, runs, sizeof(double), compare_doubles);
+  result->median = mips[runs / 2];
+  result->p90    = mips[runs / 10];
+  return 0;
+}
+
+// Baselines, a line with a name and its median MIPS for each program
+
+struct baseline {
+  char   name[256];
+  double median;
+};
+
+static int read_baselines(const char* file_name, struct baseline* baselines) {
+  FILE* file = fopen(file_name, "r");
+  if (!file)
+    return 0;
+  int num_baselines = 0;
+  while (num_baselines < MAX_BASELINES &&
+         fscanf(file, "%255s %lf", baselines[num_baselines].name,
+                &baselines[num_baselines].median) == 2)
+    num_baselines++;
+  fclose(file);
+  return num_baselines;
+}
+
+static const struct baseline* find_baseline(const struct baseline* baselines,
+                                            int num_baselines,
+                                            const char* name) {
+  for (int i = 0; i < num_baselines; i++) {
+    if (!strcmp(baselines[i].name, name))
+      return &baselines[i];
+  }
+  return NULL;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: simbench [-n runs] [-b baseline] [-w baseline] "
+                  "[-t percent] riscv-elf...\n");
+  exit(2);
+}
+
+int main(int argc, char* argv[]) {
+  int         runs          = 5;
+  double      tolerance     = 5;
+  const char* baseline_name = NULL;
+  const char* write_name    = NULL;
+  int         first_program = 1;
+  for (; first_program < argc && argv[first_program][0] == '-';
+       first_program++) {
+    const char* option = argv[first_program];
+    if (first_program + 1 == argc)
+      usage();
+    const char* value = argv[++first_program];
+    if (!strcmp(option, "-n"))
+      runs = atoi(value);
+    else if (!strcmp(option, "-b"))
+      baseline_name = value;
+    else if (!strcmp(option, "-w"))
+      write_name = value;
+    else if (!strcmp(option, "-t"))
+      tolerance = atof(value);
+    else
+      usage();
+  }
+  if (runs < 1 || runs > MAX_RUNS)
+    usage();
+
+  struct baseline baselines[MAX_BASELINES];
+  int             num_baselines =
+      baseline_name ? read_baselines(baseline_name, baselines) : 0;
+  if (baseline_name && num_baselines == 0)
+    fprintf(stderr, "simbench: no baseline in %s, make one with -w\n",
+            baseline_name);
+
+  int            num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+  int            num_results   = argc - first_program + num_workloads;
+  struct result* results       = calloc(num_results, sizeof(struct result));
+  FILE*          null          = fopen("/dev/null", "r+");
+  if (!results || !null) {
+    fprintf(stderr, "simbench: out of memory or no /dev/null\n");
+    return 2;
+  }
+
+  printf("%-20s %12s %10s %10s %10s %8s\n", "program", "instructions",
+         "median", "p90", "baseline", "change");
+  int regressions = 0;
+  for (int i = 0; i < num_results; i++) {
+    struct result* result = &results[i];
+    struct sim*    sim    = sim_create();
+    sim_set_io(sim, null, null);
+    if (i < argc - first_program) {
+      const char* name  = argv[first_program + i];
+      const char* slash = strrchr(name, '/');
+      result->name      = slash ? slash + 1 : name;
+      if (sim_load_elf(sim, name)) {
+        sim_delete(sim);
+        return 2;
+      }
+    } else {
+      const struct workload* workload =
+          &workloads[i - (argc - first_program)];
+      result->name = workload->name;
+      load_workload(sim, workload);
+    }
+    if (measure(sim, runs, result)) {
+      sim_delete(sim);
+      return 2;
+    }
+    sim_delete(sim);
+
+    printf("%-20s %12ld %10.1f %10.1f", result->name, result->insns,
+           result->median, result->p90);
+    const struct baseline* baseline =
+        find_baseline(baselines, num_baselines, result->name);
+    if (baseline) {
+      double change = (result->median / baseline->median - 1) * 100;
+      int    slower = change < -tolerance;
+      printf(" %10.1f %+7.1f%%%s", baseline->median, change,
+             slower ? "  REGRESSION" : "");
+      regressions += slower;
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+
+  if (write_name) {
+    FILE* file = fopen(write_name, "w");
+    if (!file) {
+      perror(write_name);
+      return 2;
+    }
+    for (int i = 0; i < num_results; i++)
+      fprintf(file, "%s %.1f\n", results[i].name, results[i].median);
+    fclose(file);
+  }
+  if (regressions)
+    printf("%d program(s) more than %.0f%% slower than the baseline\n",
+           regressions, tolerance);
+  fclose(null);
+  free(results);
+  return regressions ? 1 : 0;
+}
@@ -0,0 +1,112 @@
+// Self checks of the simulator, run by 'make check'. Each check runs a few
+// hand-encoded instructions on a fresh guest and compares the result.
+// Prints the failed checks, and exits with 1 if there were any.
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define CODE_ADDR 0x10000
+#define DATA_ADDR 0x100000
+
+static uint32_t i_type(uint32_t imm, uint32_t rs1, uint32_t funct3, uint32_t rd,
+                       uint32_t opcode) {
+  return ((imm & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) |
+         opcode;
+}
+
+static uint32_t s_type(uint32_t imm, uint32_t rs2, uint32_t rs1,
+                       uint32_t funct3, uint32_t opcode) {
+  return (((imm >> 5) & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) |
+         (funct3 << 12) | ((imm & 0x1f) << 7) | opcode;
+}
+
+#define ECALL 0b1110011
+
+// a new guest with code, and a0 = DATA_ADDR and data there. a7 = 93 is set
+// up, so an ecall exits
+static struct sim* load(const uint32_t* code, int size, const void* data,
+                        int data_size) {
+  struct sim*    sim = sim_create();
+  struct memory* mem = sim_memory(sim);
+  memory_wr_block(mem, CODE_ADDR, code, size * 4);
+  memory_set_perm(mem, CODE_ADDR, size * 4, MEMORY_PERM_R | MEMORY_PERM_X);
+  memory_wr_block(mem, DATA_ADDR, data, data_size);
+  sim_set_pc(sim, CODE_ADDR);
+  sim_set_reg(sim, 10, DATA_ADDR);
+  sim_set_reg(sim, 17, 93);
+  return sim;
+}
+
+// load and run code until it exits
+static struct sim* run(const uint32_t* code, int size, const void* data,
+                       int data_size) {
+  struct sim* sim = load(code, size, data, data_size);
+  sim_run_program(sim, 1000);
+  return sim;
+}
+
+// fld and fsd of a double whose low word has bit 31 set, which must not be
+// sign extended into the high word
+static int check_fld_fsd(void) {
+  double   value = 1.1; // 0x3ff199999999999a
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint32_t code[] = {
+      i_type(0, 10, 0b011, 1, 0b0000111),  // fld f1, 0(a0)
+      s_type(8, 1, 10, 0b011, 0b0100111),  // fsd f1, 8(a0)
+      ECALL,
+  };
+  struct sim* sim    = run(code, 3, &value, sizeof(value));
+  uint64_t    loaded = sim_state(sim)->fregs[1];
+  uint64_t    stored;
+  memory_rd_block(sim_memory(sim), DATA_ADDR + 8, &stored, sizeof(stored));
+  sim_delete(sim);
+  if (loaded != bits || stored != bits) {
+    printf("fld/fsd: stored %016llx, loaded %016llx and stored back %016llx\n",
+           (unsigned long long)bits, (unsigned long long)loaded,
+           (unsigned long long)stored);
+    return 1;
+  }
+  return 0;
+}
+
+// vmerge.vvm with vd the same as vs1, whose elements must be read before vd
+// is written
+static int check_vmerge_alias(void) {
+  static const uint8_t v1[]       = {0x10, 0x11, 0x12, 0x13};
+  static const uint8_t v2[]       = {0x20, 0x21, 0x22, 0x23};
+  static const uint8_t expected[] = {0x10, 0x21, 0x12, 0x23};
+  // vmerge.vvm v1, v2, v1, v0
+  uint32_t code[] = {
+      (0b010111u << 26) | (2 << 20) | (1 << 15) | (1 << 7) | 0b1010111,
+      ECALL,
+  };
+  struct sim*       sim   = load(code, 2, NULL, 0);
+  struct cpu_state* state = sim_state(sim);
+  state->vtype            = 0; // e8, m1
+  state->vl               = 4;
+  state->vregs[0]         = 0b0101;
+  memcpy(&state->vregs[1 * SIMULATE_VLENB], v1, sizeof(v1));
+  memcpy(&state->vregs[2 * SIMULATE_VLENB], v2, sizeof(v2));
+  sim_run_program(sim, 1000);
+  uint8_t got[4];
+  memcpy(got, &state->vregs[1 * SIMULATE_VLENB], sizeof(got));
+  sim_delete(sim);
+  if (memcmp(got, expected, sizeof(got))) {
+    printf("vmerge.vvm v1, v2, v1, v0: got %02x %02x %02x %02x, expected "
+           "10 21 12 23\n",
+           got[0], got[1], got[2], got[3]);
+    return 1;
+  }
+  return 0;
+}
+
+int main(void) {
+  int failed = 0;
+  failed += check_fld_fsd();
+  failed += check_vmerge_alias();
+  printf("%d check(s) failed\n", failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,247 @@
+#include "checkpoint.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// File layout (host byte order):
+//   header | page record* | end marker
+// A page record is its address, permissions, encoding and the number of
+// 32-bit words that follow. Run-length encoded pages are a sequence of
+// tokens: a token with the top bit set stands for that many zero words,
+// otherwise it is followed by that many literal words.
+
+#define CHECKPOINT_MAGIC "RVCP"
+#define CHECKPOINT_VERSION 5
+#define PAGE_WORDS (MEMORY_PAGE_SIZE / 4)
+#define ENCODING_RAW 0
+#define ENCODING_RLE 1
+#define ENCODING_END 0xffffffff
+#define ZERO_RUN 0x80000000
+
+struct checkpoint_header {
+  char     magic[4];
+  uint32_t version;
+  uint32_t page_size;
+  uint32_t pc;
+  int64_t  insns;
+  uint64_t stall_cycles;
+  uint32_t registers[32];
+  uint64_t fregs[32];
+  uint32_t fcsr;
+  uint32_t vlen;
+  uint32_t vl;
+  uint32_t vtype;
+  uint8_t  vregs[32 * SIMULATE_VLENB];
+};
+
+struct page_record {
+  uint32_t page_addr;
+  uint32_t perm;
+  uint32_t encoding;
+  uint32_t num_words;
+};
+
+struct save_ctx {
+  FILE*     file;
+  uint32_t* buffer; // room for the worst case encoding of one page
+  int       error;
+};
+
+// Encode a page into buffer, returns number of words used
+static uint32_t rle_encode(const uint32_t* page, uint32_t* buffer) {
+  uint32_t out = 0;
+  uint32_t i   = 0;
+  while (i < PAGE_WORDS) {
+    uint32_t start = i;
+    if (page[i] == 0) {
+      while (i < PAGE_WORDS && page[i] == 0)
+        i++;
+      buffer[out++] = ZERO_RUN | (i - start);
+    } else {
+      // a single zero word inside literals is cheaper kept as a literal
+      while (i < PAGE_WORDS &&
+             (page[i] != 0 || (i + 1 < PAGE_WORDS && page[i + 1] != 0)))
+        i++;
+      buffer[out++] = i - start;
+      memcpy(&buffer[out], &page[start], (i - start) * 4);
+      out += i - start;
+    }
+  }
+  return out;
+}
+
+static int rle_decode(const uint32_t* buffer, uint32_t num_words,
+                      uint32_t* page) {
+  uint32_t in  = 0;
+  uint32_t pos = 0;
+  while (in < num_words) {
+    uint32_t token = buffer[in++];
+    uint32_t count = token & ~ZERO_RUN;
+    if (pos + count > PAGE_WORDS)
+      return -1;
+    if (token & ZERO_RUN) {
+      memset(&page[pos], 0, count * 4);
+    } else {
+      if (in + count > num_words)
+        return -1;
+      memcpy(&page[pos], &buffer[in], count * 4);
+      in += count;
+    }
+    pos += count;
+  }
+  return 0;
+}
+
+static void save_page(void* arg, unsigned int page_addr, int* data,
+                      int perm) {
+  struct save_ctx* ctx  = arg;
+  const uint32_t*  page = (const uint32_t*)data;
+  if (ctx->error)
+    return;
+
+  // skip pages that were touched but never hold anything
+  uint32_t i = 0;
+  while (i < PAGE_WORDS && page[i] == 0)
+    i++;
+  if (i == PAGE_WORDS && perm == MEMORY_PERM_DEFAULT)
+    return;
+
+  struct page_record record = {.page_addr = page_addr, .perm = perm};
+  const uint32_t*    words  = page;
+  uint32_t           rle    = rle_encode(page, ctx->buffer);
+  if (rle < PAGE_WORDS) {
+    record.encoding  = ENCODING_RLE;
+    record.num_words = rle;
+    words            = ctx->buffer;
+  } else {
+    record.encoding  = ENCODING_RAW;
+    record.num_words = PAGE_WORDS;
+  }
+  if (fwrite(&record, sizeof(record), 1, ctx->file) != 1 ||
+      fwrite(words, 4, record.num_words, ctx->file) != record.num_words)
+    ctx->error = 1;
+}
+
+int checkpoint_save(const char* file_name, struct memory* mem,
+                    const struct cpu_state* state) {
+  FILE* file = fopen(file_name, "wb");
+  if (!file) {
+    perror("Error opening checkpoint file");
+    return -1;
+  }
+
+  struct checkpoint_header header = {.magic        = CHECKPOINT_MAGIC,
+                                     .version      = CHECKPOINT_VERSION,
+                                     .page_size    = MEMORY_PAGE_SIZE,
+                                     .pc           = state->pc,
+                                     .insns        = state->insns,
+                                     .stall_cycles = state->stall_cycles,
+                                     .fcsr         = state->fcsr,
+                                     .vlen         = SIMULATE_VLEN,
+                                     .vl           = state->vl,
+                                     .vtype        = state->vtype};
+  memcpy(header.registers, state->registers, sizeof(header.registers));
+  memcpy(header.fregs, state->fregs, sizeof(header.fregs));
+  memcpy(header.vregs, state->vregs, sizeof(header.vregs));
+
+  struct save_ctx ctx = {.file   = file,
+                         .buffer = malloc(2 * MEMORY_PAGE_SIZE),
+                         .error  = 0};
+  if (!ctx.buffer) {
+    fprintf(stderr, "Error allocating checkpoint buffer\n");
+    fclose(file);
+    return -1;
+  }
+  if (fwrite(&header, sizeof(header), 1, file) != 1)
+    ctx.error = 1;
+  memory_for_each_page(mem, save_page, &ctx);
+  struct page_record end = {.encoding = ENCODING_END};
+  if (fwrite(&end, sizeof(end), 1, file) != 1)
+    ctx.error = 1;
+  free(ctx.buffer);
+  if (fclose(file) != 0)
+    ctx.error = 1;
+  if (ctx.error) {
+    fprintf(stderr, "Error writing checkpoint to %s\n", file_name);
+    return -1;
+  }
+  return 0;
+}
+
+int checkpoint_load(const char* file_name, struct memory* mem,
+                    struct cpu_state* state) {
+  FILE* file = fopen(file_name, "rb");
+  if (!file) {
+    perror("Error opening checkpoint file");
+    return -1;
+  }
+
+  struct checkpoint_header header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, CHECKPOINT_MAGIC, 4) != 0 ||
+      header.version != CHECKPOINT_VERSION) {
+    fprintf(stderr, "%s is not a valid checkpoint file.\n", file_name);
+    fclose(file);
+    return -1;
+  }
+  if (header.page_size != MEMORY_PAGE_SIZE) {
+    fprintf(stderr, "Checkpoint page size %u does not match simulator (%u)\n",
+            header.page_size, MEMORY_PAGE_SIZE);
+    fclose(file);
+    return -1;
+  }
+  if (header.vlen != SIMULATE_VLEN) {
+    fprintf(stderr, "Checkpoint VLEN %u does not match simulator (%u)\n",
+            header.vlen, SIMULATE_VLEN);
+    fclose(file);
+    return -1;
+  }
+
+  uint32_t* buffer = malloc(2 * MEMORY_PAGE_SIZE);
+  if (!buffer) {
+    fprintf(stderr, "Error allocating checkpoint buffer\n");
+    fclose(file);
+    return -1;
+  }
+  int status = -1;
+  while (1) {
+    struct page_record record;
+    if (fread(&record, sizeof(record), 1, file) != 1)
+      break;
+    if (record.encoding == ENCODING_END) {
+      status = 0;
+      break;
+    }
+    if (record.num_words > 2 * PAGE_WORDS ||
+        record.page_addr % MEMORY_PAGE_SIZE != 0 ||
+        fread(buffer, 4, record.num_words, file) != record.num_words)
+      break;
+    uint32_t* page = (uint32_t*)memory_page(mem, record.page_addr);
+    if (record.encoding == ENCODING_RAW && record.num_words == PAGE_WORDS) {
+      memcpy(page, buffer, MEMORY_PAGE_SIZE);
+    } else if (record.encoding != ENCODING_RLE ||
+               rle_decode(buffer, record.num_words, page) != 0) {
+      break;
+    }
+    memory_set_perm(mem, record.page_addr, MEMORY_PAGE_SIZE, record.perm);
+  }
+  free(buffer);
+  fclose(file);
+  if (status) {
+    fprintf(stderr, "Checkpoint file %s is corrupt.\n", file_name);
+    return -1;
+  }
+
+  memcpy(state->registers, header.registers, sizeof(state->registers));
+  memcpy(state->fregs, header.fregs, sizeof(state->fregs));
+  memcpy(state->vregs, header.vregs, sizeof(state->vregs));
+  state->fcsr         = header.fcsr;
+  state->vl           = header.vl;
+  state->vtype        = header.vtype;
+  state->pc           = header.pc;
+  state->insns        = header.insns;
+  state->stall_cycles = header.stall_cycles;
+  return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include "memory.h"
+#include "simulate.h"
+
+// Save the complete simulator state (registers, pc, instruction count and
+// every non-zero memory page) to file_name. Pages are run-length encoded
+// when that makes them smaller. Returns 0 on success.
+int checkpoint_save(const char* file_name, struct memory* mem,
+                    const struct cpu_state* state);
+
+// Restore state saved by checkpoint_save into a freshly created memory.
+// Returns 0 on success.
+int checkpoint_load(const char* file_name, struct memory* mem,
+                    struct cpu_state* state);
+
+#endif
@@ -0,0 +1,216 @@
+#include "compressed.h"
+#include "tools.h"
+
+// Base opcodes the compressed instructions expand to
+#define OP_LOAD 0b0000011
+#define OP_LOAD_FP 0b0000111
+#define OP_IMM 0b0010011
+#define OP_STORE 0b0100011
+#define OP_STORE_FP 0b0100111
+#define OP 0b0110011
+#define OP_LUI 0b0110111
+#define OP_BRANCH 0b1100011
+#define OP_JALR 0b1100111
+#define OP_JAL 0b1101111
+#define EBREAK 0x00100073
+
+static uint32_t r_type(uint32_t funct7, uint32_t rs2, uint32_t rs1,
+                       uint32_t funct3, uint32_t rd) {
+  return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | OP;
+}
+
+static uint32_t i_type(uint32_t imm, uint32_t rs1, uint32_t funct3,
+                       uint32_t rd, uint32_t opcode) {
+  return (imm & 0xfff) << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+
+static uint32_t s_type(uint32_t imm, uint32_t rs2, uint32_t rs1,
+                       uint32_t funct3, uint32_t opcode) {
+  return ((imm >> 5) & 0x7f) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 |
+         (imm & 0x1f) << 7 | opcode;
+}
+
+static uint32_t b_type(uint32_t imm, uint32_t rs2, uint32_t rs1,
+                       uint32_t funct3) {
+  return ((imm >> 12) & 1) << 31 | ((imm >> 5) & 0x3f) << 25 | rs2 << 20 |
+         rs1 << 15 | funct3 << 12 | ((imm >> 1) & 0xf) << 8 |
+         ((imm >> 11) & 1) << 7 | OP_BRANCH;
+}
+
+static uint32_t j_type(uint32_t imm, uint32_t rd) {
+  return ((imm >> 20) & 1) << 31 | ((imm >> 1) & 0x3ff) << 21 |
+         ((imm >> 11) & 1) << 20 | ((imm >> 12) & 0xff) << 12 | rd << 7 |
+         OP_JAL;
+}
+
+uint32_t compressed_expand(uint16_t instruction) {
+  uint32_t c      = instruction;
+  uint32_t funct3 = extractBits(c, 15, 13);
+  uint32_t rd     = extractBits(c, 11, 7); // also rs1
+  uint32_t rs2    = extractBits(c, 6, 2);
+  uint32_t rd_p   = extractBits(c, 4, 2) + 8; // rd' and rs2'
+  uint32_t rs1_p  = extractBits(c, 9, 7) + 8; // rs1' and rd'
+  // the 6 bit immediate of C.ADDI, C.LI, C.ANDI, ...
+  int32_t imm6 = sign_extend32(extractBits(c, 12, 12) << 5 |
+                                   extractBits(c, 6, 2),
+                               6);
+
+  switch (extractBits(c, 1, 0)) {
+    case 0b00: {
+      // offsets of C.LW/C.SW (and C.FLW/C.FSW), C.FLD/C.FSD
+      uint32_t word_offset = extractBits(c, 12, 10) << 3 |
+                             extractBits(c, 6, 6) << 2 |
+                             extractBits(c, 5, 5) << 6;
+      uint32_t double_offset =
+          extractBits(c, 12, 10) << 3 | extractBits(c, 6, 5) << 6;
+      switch (funct3) {
+        case 0b000: { // C.ADDI4SPN
+          uint32_t imm = extractBits(c, 12, 11) << 4 |
+                         extractBits(c, 10, 7) << 6 |
+                         extractBits(c, 6, 6) << 2 | extractBits(c, 5, 5) << 3;
+          if (imm == 0)
+            return 0;
+          return i_type(imm, 2, 0b000, rd_p, OP_IMM);
+        }
+        case 0b001: // C.FLD
+          return i_type(double_offset, rs1_p, 0b011, rd_p, OP_LOAD_FP);
+        case 0b010: // C.LW
+          return i_type(word_offset, rs1_p, 0b010, rd_p, OP_LOAD);
+        case 0b011: // C.FLW
+          return i_type(word_offset, rs1_p, 0b010, rd_p, OP_LOAD_FP);
+        case 0b101: // C.FSD
+          return s_type(double_offset, rd_p, rs1_p, 0b011, OP_STORE_FP);
+        case 0b110: // C.SW
+          return s_type(word_offset, rd_p, rs1_p, 0b010, OP_STORE);
+        case 0b111: // C.FSW
+          return s_type(word_offset, rd_p, rs1_p, 0b010, OP_STORE_FP);
+      }
+      return 0;
+    }
+
+    case 0b01:
+      switch (funct3) {
+        case 0b000: // C.ADDI, C.NOP
+          return i_type(imm6, rd, 0b000, rd, OP_IMM);
+        case 0b001:   // C.JAL
+        case 0b101: { // C.J
+          int32_t imm =
+              sign_extend32(extractBits(c, 12, 12) << 11 |
+                                extractBits(c, 11, 11) << 4 |
+                                extractBits(c, 10, 9) << 8 |
+                                extractBits(c, 8, 8) << 10 |
+                                extractBits(c, 7, 7) << 6 |
+                                extractBits(c, 6, 6) << 7 |
+                                extractBits(c, 5, 3) << 1 |
+                                extractBits(c, 2, 2) << 5,
+                            12);
+          return j_type(imm, funct3 == 0b001 ? 1 : 0);
+        }
+        case 0b010: // C.LI
+          return i_type(imm6, 0, 0b000, rd, OP_IMM);
+        case 0b011:
+          if (rd == 2) { // C.ADDI16SP
+            int32_t imm = sign_extend32(extractBits(c, 12, 12) << 9 |
+                                            extractBits(c, 6, 6) << 4 |
+                                            extractBits(c, 5, 5) << 6 |
+                                            extractBits(c, 4, 3) << 7 |
+                                            extractBits(c, 2, 2) << 5,
+                                        10);
+            if (imm == 0)
+              return 0;
+            return i_type(imm, 2, 0b000, 2, OP_IMM);
+          }
+          if (imm6 == 0) // C.LUI
+            return 0;
+          return ((uint32_t)imm6 & 0xfffff) << 12 | rd << 7 | OP_LUI;
+        case 0b100: {
+          uint32_t shamt = extractBits(c, 6, 2);
+          switch (extractBits(c, 11, 10)) {
+            case 0b00: // C.SRLI
+              if (extractBits(c, 12, 12))
+                return 0;
+              return i_type(shamt, rs1_p, 0b101, rs1_p, OP_IMM);
+            case 0b01: // C.SRAI
+              if (extractBits(c, 12, 12))
+                return 0;
+              return i_type(0x400 | shamt, rs1_p, 0b101, rs1_p, OP_IMM);
+            case 0b10: // C.ANDI
+              return i_type(imm6, rs1_p, 0b111, rs1_p, OP_IMM);
+          }
+          if (extractBits(c, 12, 12)) // C.SUBW, C.ADDW are RV64 only
+            return 0;
+          switch (extractBits(c, 6, 5)) {
+            case 0b00: // C.SUB
+              return r_type(0b0100000, rd_p, rs1_p, 0b000, rs1_p);
+            case 0b01: // C.XOR
+              return r_type(0, rd_p, rs1_p, 0b100, rs1_p);
+            case 0b10: // C.OR
+              return r_type(0, rd_p, rs1_p, 0b110, rs1_p);
+          }
+          return r_type(0, rd_p, rs1_p, 0b111, rs1_p); // C.AND
+        }
+        case 0b110:   // C.BEQZ
+        case 0b111: { // C.BNEZ
+          int32_t imm = sign_extend32(extractBits(c, 12, 12) << 8 |
+                                          extractBits(c, 11, 10) << 3 |
+                                          extractBits(c, 6, 5) << 6 |
+                                          extractBits(c, 4, 3) << 1 |
+                                          extractBits(c, 2, 2) << 5,
+                                      9);
+          return b_type(imm, 0, rs1_p, funct3 == 0b110 ? 0b000 : 0b001);
+        }
+      }
+      return 0;
+
+    case 0b10: {
+      // offsets of the stack pointer relative loads and stores
+      uint32_t lwsp_offset = extractBits(c, 12, 12) << 5 |
+                             extractBits(c, 6, 4) << 2 |
+                             extractBits(c, 3, 2) << 6;
+      uint32_t ldsp_offset = extractBits(c, 12, 12) << 5 |
+                             extractBits(c, 6, 5) << 3 |
+                             extractBits(c, 4, 2) << 6;
+      uint32_t swsp_offset =
+          extractBits(c, 12, 9) << 2 | extractBits(c, 8, 7) << 6;
+      uint32_t sdsp_offset =
+          extractBits(c, 12, 10) << 3 | extractBits(c, 9, 7) << 6;
+      switch (funct3) {
+        case 0b000: // C.SLLI
+          if (extractBits(c, 12, 12))
+            return 0;
+          return i_type(rs2, rd, 0b001, rd, OP_IMM);
+        case 0b001: // C.FLDSP
+          return i_type(ldsp_offset, 2, 0b011, rd, OP_LOAD_FP);
+        case 0b010: // C.LWSP
+          if (rd == 0)
+            return 0;
+          return i_type(lwsp_offset, 2, 0b010, rd, OP_LOAD);
+        case 0b011: // C.FLWSP
+          return i_type(lwsp_offset, 2, 0b010, rd, OP_LOAD_FP);
+        case 0b100:
+          if (extractBits(c, 12, 12) == 0) {
+            if (rs2 == 0) { // C.JR
+              if (rd == 0)
+                return 0;
+              return i_type(0, rd, 0b000, 0, OP_JALR);
+            }
+            return r_type(0, rs2, 0, 0b000, rd); // C.MV
+          }
+          if (rs2 == 0) {
+            if (rd == 0) // C.EBREAK
+              return EBREAK;
+            return i_type(0, rd, 0b000, 1, OP_JALR); // C.JALR
+          }
+          return r_type(0, rs2, rd, 0b000, rd); // C.ADD
+        case 0b101: // C.FSDSP
+          return s_type(sdsp_offset, rs2, 2, 0b011, OP_STORE_FP);
+        case 0b110: // C.SWSP
+          return s_type(swsp_offset, rs2, 2, 0b010, OP_STORE);
+        case 0b111: // C.FSWSP
+          return s_type(swsp_offset, rs2, 2, 0b010, OP_STORE_FP);
+      }
+      return 0;
+    }
+  }
+  return 0; // not a compressed instruction
+}
@@ -0,0 +1,17 @@
+#ifndef __COMPRESSED_H__
+#define __COMPRESSED_H__
+
+#include <stdint.h>
+
+// RV32C: an instruction whose two lowest bits are not both set is 16 bits
+// long, and stands for one 32-bit instruction. The simulator and the
+// disassembler expand it and handle the result like any other instruction.
+static inline int instruction_length(uint32_t instruction) {
+  return (instruction & 3) == 3 ? 4 : 2;
+}
+
+// the 32-bit instruction a 16-bit one stands for, 0 if it is illegal or
+// reserved (0 is not a valid instruction either)
+uint32_t compressed_expand(uint16_t instruction);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef __DECODE_H__
+#define __DECODE_H__
+
+#include "tools.h"
+
+#include <stdint.h>
+
+// Instruction decoding shared by the simulator and the disassembler. The
+// instructions are described in instructions.txt, from which gen_decode
+// makes enum insn (decode_table.h) and the tables (decode_table.c).
+
+// how the operands of an instruction are laid out, which is what the
+// disassembler needs to show it
+enum decode_format {
+  FORMAT_NONE,   // no operands
+  FORMAT_R,      // rd, rs1, rs2
+  FORMAT_I,      // rd, rs1, imm
+  FORMAT_SHIFT,  // rd, rs1, shamt
+  FORMAT_UNARY,  // rd, rs1
+  FORMAT_LOAD,   // rd, imm(rs1), loads and jalr
+  FORMAT_S,      // rs2, imm(rs1)
+  FORMAT_B,      // rs1, rs2, target
+  FORMAT_U,      // rd, imm
+  FORMAT_J,      // rd, target
+  FORMAT_LR,     // rd, (rs1)
+  FORMAT_AMO,    // rd, rs2, (rs1)
+  FORMAT_CSR,    // rd, csr, rs1 or uimm
+  FORMAT_FLOAT,  // a group, decoded further by fpu.c
+  FORMAT_VECTOR, // a group, decoded further by vector.c
+};
+
+#include "decode_table.h"
+
+struct decode_info {
+  const char* name;
+  uint32_t    mask;   // an instruction is this one if the bits in mask
+  uint32_t    match;  // equal those in match
+  uint8_t     format; // enum decode_format
+};
+
+// indexed by enum insn. INSN_UNKNOWN has mask 0, so it matches anything
+extern const struct decode_info decode_info[INSN_COUNT];
+
+// For each value of decode_key the offset in decode_chains of the
+// instructions that may have it, in the order of instructions.txt and ended
+// by INSN_UNKNOWN
+#define DECODE_KEYS (1 << 15)
+extern const uint16_t decode_keys[DECODE_KEYS];
+extern const uint8_t  decode_chains[];
+
+// the opcode without its two low bits, funct3 and funct7
+static inline uint32_t decode_key(uint32_t instruction) {
+  return ((instruction >> 2) & 0x1f) | ((instruction >> 7) & 0xe0) |
+         ((instruction >> 17) & 0x7f00);
+}
+
+// a 32-bit instruction (compressed ones must be expanded first)
+static inline enum insn decode(uint32_t instruction) {
+  const uint8_t* candidate =
+      decode_chains + decode_keys[decode_key(instruction)];
+  while ((instruction & decode_info[*candidate].mask) !=
+         decode_info[*candidate].match)
+    candidate++;
+  return *candidate;
+}
+
+#endif
@@ -1,269 +1,746 @@
 #include "disassemble.h"
+#include "compressed.h"
+#include "decode.h"
 #include "tools.h"
+#include "vector.h"
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-// sign_extend32 & extractBits in "tools.h"
+// RV32F and RV32D. The rounding mode is left out, as objdump does for the
+// dynamic one.
+static void disassemble_float(uint32_t instruction, char* result,
+                              size_t buf_size) {
+  uint32_t    opcode = extractBits(instruction, 6, 0);
+  uint32_t    rd     = insn_rd(instruction);
+  uint32_t    funct3 = insn_funct3(instruction);
+  uint32_t    rs1    = insn_rs1(instruction);
+  uint32_t    rs2    = insn_rs2(instruction);
+  uint32_t    fmt    = extractBits(instruction, 26, 25);
+  uint32_t    funct5 = extractBits(instruction, 31, 27);
+  char        f      = fmt ? 'd' : 's';
+  const char* name   = NULL;
 
-void disassemble(uint32_t addr, uint32_t instruction, char* result,
-                 size_t buf_size, struct symbols* symbols) {
-
-  (void)addr;    // remove warning
-  (void)symbols; // remove warning
+  if (opcode == 0b0000111 && (funct3 == 0b010 || funct3 == 0b011)) {
+    int32_t i_imm = insn_i_imm(instruction);
+    snprintf(result, buf_size, "fl%c f%d, %d(x%d)", funct3 == 0b010 ? 'w' : 'd',
+             rd, i_imm, rs1);
+    return;
+  }
+  if (opcode == 0b0100111 && (funct3 == 0b010 || funct3 == 0b011)) {
+    int32_t s_imm = insn_s_imm(instruction);
+    snprintf(result, buf_size, "fs%c f%d, %d(x%d)", funct3 == 0b010 ? 'w' : 'd',
+             rs2, s_imm, rs1);
+    return;
+  }
+  if (fmt > 1) {
+    snprintf(result, buf_size, "unknown floating point");
+    return;
+  }
+  if ((opcode & 0b1110011) == 0b1000011) {
+    static const char* fused[] = {"fmadd", "fmsub", "fnmsub", "fnmadd"};
+    snprintf(result, buf_size, "%s.%c f%d, f%d, f%d, f%d",
+             fused[(opcode >> 2) & 3], f, rd, rs1, rs2, funct5);
+    return;
+  }
+  if (opcode != 0b1010011) {
+    snprintf(result, buf_size, "unknown floating point");
+    return;
+  }
 
-  uint32_t opcode, rd, funct3, rs1, rs2, funct7, funct12;
-  int32_t  i_imm, s_imm, u_imm, jal_imm, b_imm;
-
-  opcode  = extractBits(instruction, 6, 0);
-  rd      = extractBits(instruction, 11, 7);
-  funct3  = extractBits(instruction, 14, 12);
-  rs1     = extractBits(instruction, 19, 15);
-  rs2     = extractBits(instruction, 24, 20);
-  funct7  = extractBits(instruction, 31, 25);
-  funct12 = extractBits(instruction, 31, 20);
-
-  // Immediate fields
-  i_imm = extractBits(instruction, 31, 20);
-  i_imm = sign_extend32(i_imm, 12);
-
-  s_imm = (extractBits(instruction, 11, 7) |
-           (extractBits(instruction, 31, 25) << 5));
-  s_imm = sign_extend32(s_imm, 12);
-
-  u_imm = extractBits(instruction, 31, 12);
-  u_imm = sign_extend32(u_imm, 20);
-
-  jal_imm = (extractBits(instruction, 19, 12) << 12) |
-            (extractBits(instruction, 20, 20) << 11) |
-            (extractBits(instruction, 30, 21) << 1) |
-            (extractBits(instruction, 31, 31) << 20);
-  jal_imm = sign_extend32(jal_imm, 21);
-
-  b_imm = (extractBits(instruction, 31, 31) << 12) |
-          (extractBits(instruction, 7, 7) << 11) |
-          (extractBits(instruction, 30, 25) << 5) |
-          (extractBits(instruction, 11, 8) << 1);
-  b_imm = sign_extend32(b_imm, 13);
-
-  // check for R-type
-  if (opcode == 0b0110011) {
-    // ADD
-    if (funct3 == 0b000 && funct7 == 0b0000000) {
-      snprintf(result, buf_size, "add x%d, x%d, x%d", rd, rs1, rs2);
-    }
-    // SUB
-    else if (funct3 == 0b000 && funct7 == 0b0100000) {
-      snprintf(result, buf_size, "sub x%d, x%d, x%d", rd, rs1, rs2);
-    }
-    // SLL
-    else if (funct3 == 0b001 && funct7 == 0b0000000) {
-      snprintf(result, buf_size, "sll x%d, x%d, x%d", rd, rs1, rs2);
-    }
-    // SLT
-    else if (funct3 == 0b010 && funct7 == 0b0000000) {
-      snprintf(result, buf_size, "slt x%d, x%d, x%d", rd, rs1, rs2);
-    }
-    // SLTU
-    else if (funct3 == 0b011 && funct7 == 0b0000000) {
-      snprintf(result, buf_size, "sltu x%d, x%d, x%d", rd, rs1, rs2);
-    }
-    // XOR
-    else if (funct3 == 0b100 && funct7 == 0b0000000) {
-      snprintf(result, buf_size, "xor x%d, x%d, x%d", rd, rs1, rs2);
-    }
-    // SRL
-    else if (funct3 == 0b101 && funct7 == 0b0000000) {
-      snprintf(result, buf_size, "srl x%d, x%d, x%d", rd, rs1, rs2);
-    }
-    // SRA
-    else if (funct3 == 0b101 && funct7 == 0b0100000) {
-      snprintf(result, buf_size, "sra x%d, x%d, x%d", rd, rs1, rs2);
-    }
-    // OR
-    else if (funct3 == 0b110 && funct7 == 0b0000000) {
-      snprintf(result, buf_size, "or x%d, x%d, x%d", rd, rs1, rs2);
-    }
-    // AND
-    else if (funct3 == 0b111 && funct7 == 0b0000000) {
-      snprintf(result, buf_size, "and x%d, x%d, x%d", rd, rs1, rs2);
-    }
-    // RV32M extension
-    else if (funct7 == 0b0000001) {
-      // MUL
-      if (funct3 == 0b000) {
-        snprintf(result, buf_size, "mul x%d, x%d, x%d", rd, rs1, rs2);
+  switch (funct5) {
+    case 0b00000:
+      name = "fadd";
+      break;
+    case 0b00001:
+      name = "fsub";
+      break;
+    case 0b00010:
+      name = "fmul";
+      break;
+    case 0b00011:
+      name = "fdiv";
+      break;
+    case 0b00100:
+      name = funct3 == 0b000   ? "fsgnj"
+             : funct3 == 0b001 ? "fsgnjn"
+             : funct3 == 0b010 ? "fsgnjx"
+                               : NULL;
+      break;
+    case 0b00101:
+      name = funct3 == 0b000 ? "fmin" : funct3 == 0b001 ? "fmax" : NULL;
+      break;
+    case 0b01011:
+      snprintf(result, buf_size, "fsqrt.%c f%d, f%d", f, rd, rs1);
+      return;
+    case 0b01000:
+      snprintf(result, buf_size, "fcvt.%c.%c f%d, f%d", f, fmt ? 's' : 'd',
+               rd, rs1);
+      return;
+    case 0b10100: {
+      const char* compare = funct3 == 0b010   ? "feq"
+                            : funct3 == 0b001 ? "flt"
+                            : funct3 == 0b000 ? "fle"
+                                              : NULL;
+      if (compare) {
+        snprintf(result, buf_size, "%s.%c x%d, f%d, f%d", compare, f, rd, rs1,
+                 rs2);
+        return;
       }
-      // MULH
-      else if (funct3 == 0b001) {
-        snprintf(result, buf_size, "mulh x%d, x%d, x%d", rd, rs1, rs2);
-      }
-      // MULHSU
-      else if (funct3 == 0b010) {
-        snprintf(result, buf_size, "mulhsu x%d, x%d, x%d", rd, rs1, rs2);
-      }
-      // MULHU
-      else if (funct3 == 0b011) {
-        snprintf(result, buf_size, "mulhu x%d, x%d, x%d", rd, rs1, rs2);
-      }
-      // DIV
-      else if (funct3 == 0b100) {
-        snprintf(result, buf_size, "div x%d, x%d, x%d", rd, rs1, rs2);
-      }
-      // DIVU
-      else if (funct3 == 0b101) {
-        snprintf(result, buf_size, "divu x%d, x%d, x%d", rd, rs1, rs2);
+      break;
+    }
+    case 0b11000:
+      snprintf(result, buf_size, "fcvt.w%s.%c x%d, f%d", rs2 ? "u" : "", f, rd,
+               rs1);
+      return;
+    case 0b11010:
+      snprintf(result, buf_size, "fcvt.%c.w%s f%d, x%d", f, rs2 ? "u" : "", rd,
+               rs1);
+      return;
+    case 0b11100:
+      if (funct3 == 0b000 && fmt == 0) {
+        snprintf(result, buf_size, "fmv.x.w x%d, f%d", rd, rs1);
+        return;
       }
-      // REM
-      else if (funct3 == 0b110) {
-        snprintf(result, buf_size, "rem x%d, x%d, x%d", rd, rs1, rs2);
+      if (funct3 == 0b001) {
+        snprintf(result, buf_size, "fclass.%c x%d, f%d", f, rd, rs1);
+        return;
       }
-      // REMU
-      else if (funct3 == 0b111) {
-        snprintf(result, buf_size, "remu x%d, x%d, x%d", rd, rs1, rs2);
-      } else {
-        snprintf(result, buf_size, "unknown RV32M R-type");
+      break;
+    case 0b11110:
+      if (fmt == 0) {
+        snprintf(result, buf_size, "fmv.w.x f%d, x%d", rd, rs1);
+        return;
       }
+      break;
+  }
+  if (name == NULL) {
+    snprintf(result, buf_size, "unknown floating point");
+  } else {
+    snprintf(result, buf_size, "%s.%c f%d, f%d, f%d", name, f, rd, rs1, rs2);
+  }
+}
+
+// element width of a vector load or store
+static int width_bits(uint32_t width) {
+  return width == 0b000 ? 8 : 8 << (width - 0b100);
+}
+
+// RVV, the subset in vector.h
+static void disassemble_vector(uint32_t instruction, char* result,
+                               size_t buf_size) {
+  uint32_t    opcode = extractBits(instruction, 6, 0);
+  uint32_t    vd     = insn_rd(instruction);
+  uint32_t    funct3 = insn_funct3(instruction);
+  uint32_t    vs1    = insn_rs1(instruction);
+  uint32_t    vs2    = insn_rs2(instruction);
+  uint32_t    vm     = extractBits(instruction, 25, 25);
+  uint32_t    funct6 = extractBits(instruction, 31, 26);
+  const char* mask   = vm ? "" : ", v0.t";
+
+  if (opcode != 0b1010111) { // loads and stores
+    uint32_t mop  = extractBits(instruction, 27, 26);
+    int      eew  = width_bits(funct3);
+    char     kind = opcode == 0b0000111 ? 'l' : 's';
+    if (extractBits(instruction, 31, 28) != 0 || eew > 32)
+      snprintf(result, buf_size, "unknown vector memory");
+    else if (mop == 0b00 && vs2 == 0)
+      snprintf(result, buf_size, "v%ce%d.v v%d, (x%d)%s", kind, eew, vd, vs1,
+               mask);
+    else if (mop == 0b10)
+      snprintf(result, buf_size, "v%cse%d.v v%d, (x%d), x%d%s", kind, eew, vd,
+               vs1, vs2, mask);
+    else
+      snprintf(result, buf_size, "unknown vector memory");
+    return;
+  }
+
+  if (funct3 == 0b111) { // vsetvli, vsetivli, vsetvl
+    uint32_t vtype;
+    char     avl[16];
+    if ((instruction >> 31) == 0) {
+      vtype = extractBits(instruction, 30, 20);
+      snprintf(avl, sizeof(avl), "x%d", vs1);
+    } else if ((instruction >> 30) == 0b11) {
+      vtype = extractBits(instruction, 29, 20);
+      snprintf(avl, sizeof(avl), "%d", vs1);
     } else {
-      snprintf(result, buf_size,
-               "unknown R-type: (opcode=0xx%d, funct3=%d, funct7=%d)", opcode,
-               funct3, funct7);
+      snprintf(result, buf_size, "vsetvl x%d, x%d, x%d", vd, vs1, vs2);
+      return;
     }
+    uint32_t vlmul = VECTOR_VLMUL(vtype);
+    char     lmul[8];
+    if (vlmul < 4)
+      snprintf(lmul, sizeof(lmul), "m%d", 1 << vlmul);
+    else
+      snprintf(lmul, sizeof(lmul), "mf%d", 1 << (8 - vlmul));
+    snprintf(result, buf_size, "vset%svli x%d, %s, e%d, %s, %s, %s",
+             (instruction >> 30) == 0b11 ? "i" : "", vd, avl,
+             8 << VECTOR_VSEW(vtype), lmul, vtype & VECTOR_VTA ? "ta" : "tu",
+             vtype & VECTOR_VMA ? "ma" : "mu");
+    return;
   }
 
-  // check for I-type
-  // JALR
-  else if (opcode == 0b1100111) {
-    snprintf(result, buf_size, "jalr x%d, %d(x%d)", rd, i_imm, rs1);
-  } else if (opcode == 0b0000011) {
-    // LB
-    if (funct3 == 0b000) {
-      snprintf(result, buf_size, "lb x%d, %d(x%d)", rd, i_imm, rs1);
-      // LH
-    } else if (funct3 == 0b001) {
-      snprintf(result, buf_size, "lh x%d, %d(x%d)", rd, i_imm, rs1);
-      // LW
-    } else if (funct3 == 0b010) {
-      snprintf(result, buf_size, "lw x%d, %d(x%d)", rd, i_imm, rs1);
-      // LBU
-    } else if (funct3 == 0b100) {
-      snprintf(result, buf_size, "lbu x%d, %d(x%d)", rd, i_imm, rs1);
-      // LHU
-    } else if (funct3 == 0b101) {
-      snprintf(result, buf_size, "lhu x%d, %d(x%d)", rd, i_imm, rs1);
-    } else {
-      snprintf(result, buf_size, "unknown I-type (load)");
+  // OPMVV and OPMVX
+  if (funct3 == 0b010 || funct3 == 0b110) {
+    static const char* reductions[] = {"vredsum",  "vredand", "vredor",
+                                       "vredxor",  "vredminu", "vredmin",
+                                       "vredmaxu", "vredmax"};
+    if (funct6 == 0b010000 && funct3 == 0b010 && vs1 == 0)
+      snprintf(result, buf_size, "vmv.x.s x%d, v%d", vd, vs2);
+    else if (funct6 == 0b010000 && funct3 == 0b110 && vs2 == 0)
+      snprintf(result, buf_size, "vmv.s.x v%d, x%d", vd, vs1);
+    else if (funct6 <= 0b000111 && funct3 == 0b010)
+      snprintf(result, buf_size, "%s.vs v%d, v%d, v%d%s", reductions[funct6],
+               vd, vs2, vs1, mask);
+    else if (funct6 == 0b100101)
+      snprintf(result, buf_size, "vmul.v%c v%d, v%d, %c%d%s",
+               funct3 == 0b010 ? 'v' : 'x', vd, vs2,
+               funct3 == 0b010 ? 'v' : 'x', vs1, mask);
+    else if (funct6 == 0b101101)
+      snprintf(result, buf_size, "vmacc.v%c v%d, %c%d, v%d%s",
+               funct3 == 0b010 ? 'v' : 'x', vd, funct3 == 0b010 ? 'v' : 'x',
+               vs1, vs2, mask);
+    else
+      snprintf(result, buf_size, "unknown vector");
+    return;
+  }
+
+  // OPIVV, OPIVI, OPIVX
+  const char* name = NULL;
+  switch (funct6) {
+    case 0b000000:
+      name = "vadd";
+      break;
+    case 0b000010:
+      name = "vsub";
+      break;
+    case 0b000011:
+      name = "vrsub";
+      break;
+    case 0b001001:
+      name = "vand";
+      break;
+    case 0b001010:
+      name = "vor";
+      break;
+    case 0b001011:
+      name = "vxor";
+      break;
+  }
+  char operand[16];
+  char form = funct3 == 0b000 ? 'v' : funct3 == 0b011 ? 'i' : 'x';
+  if (funct3 == 0b011)
+    snprintf(operand, sizeof(operand), "%d", sign_extend32(vs1, 5));
+  else
+    snprintf(operand, sizeof(operand), "%c%d", form == 'v' ? 'v' : 'x', vs1);
+  if (funct6 == 0b010111 && vm)
+    snprintf(result, buf_size, "vmv.v.%c v%d, %s", form, vd, operand);
+  else if (funct6 == 0b010111)
+    snprintf(result, buf_size, "vmerge.v%cm v%d, v%d, %s, v0", form, vd, vs2,
+             operand);
+  else if (name && (funct3 == 0b000 || funct3 == 0b011 || funct3 == 0b100))
+    snprintf(result, buf_size, "%s.v%c v%d, v%d, %s%s", name, form, vd, vs2,
+             operand, mask);
+  else
+    snprintf(result, buf_size, "unknown vector");
+}
+
+// Zicsr, with the CSRs the simulator knows by name
+static void disassemble_csr(uint32_t instruction, char* result,
+                            size_t buf_size) {
+  static const char* names[] = {"csrrw", "csrrs", "csrrc"};
+  uint32_t           rd      = insn_rd(instruction);
+  uint32_t           funct3  = insn_funct3(instruction);
+  uint32_t           rs1     = insn_rs1(instruction);
+  uint32_t           csr     = extractBits(instruction, 31, 20);
+  char               csr_name[16];
+  switch (csr) {
+    case 0x001:
+      snprintf(csr_name, sizeof(csr_name), "fflags");
+      break;
+    case 0x002:
+      snprintf(csr_name, sizeof(csr_name), "frm");
+      break;
+    case 0x003:
+      snprintf(csr_name, sizeof(csr_name), "fcsr");
+      break;
+    case 0xc00:
+      snprintf(csr_name, sizeof(csr_name), "cycle");
+      break;
+    case 0xc01:
+      snprintf(csr_name, sizeof(csr_name), "time");
+      break;
+    case 0xc02:
+      snprintf(csr_name, sizeof(csr_name), "instret");
+      break;
+    case 0xc80:
+      snprintf(csr_name, sizeof(csr_name), "cycleh");
+      break;
+    case 0xc81:
+      snprintf(csr_name, sizeof(csr_name), "timeh");
+      break;
+    case 0xc82:
+      snprintf(csr_name, sizeof(csr_name), "instreth");
+      break;
+    default:
+      snprintf(csr_name, sizeof(csr_name), "0x%x", csr);
+  }
+  if (funct3 & 0b100)
+    snprintf(result, buf_size, "%si x%d, %s, %d", names[(funct3 & 3) - 1], rd,
+             csr_name, rs1);
+  else
+    snprintf(result, buf_size, "%s x%d, %s, x%d", names[(funct3 & 3) - 1], rd,
+             csr_name, rs1);
+}
+
+void disassemble(uint32_t addr, uint32_t instruction, char* result,
+                 size_t buf_size, struct symbols* symbols) {
+
+  (void)symbols; // remove warning
+
+  // compressed instructions are shown as the instruction they expand to
+  if (instruction_length(instruction) == 2)
+    instruction = compressed_expand(instruction);
+
+  const struct decode_info* info = &decode_info[decode(instruction)];
+  const char*               name = info->name;
+  uint32_t                  rd   = insn_rd(instruction);
+  uint32_t                  rs1  = insn_rs1(instruction);
+  uint32_t                  rs2  = insn_rs2(instruction);
+
+  switch (info->format) {
+    case FORMAT_NONE:
+      snprintf(result, buf_size, "%s", name);
+      break;
+    case FORMAT_R:
+      snprintf(result, buf_size, "%s x%d, x%d, x%d", name, rd, rs1, rs2);
+      break;
+    case FORMAT_I:
+      snprintf(result, buf_size, "%s x%d, x%d, %d", name, rd, rs1,
+               insn_i_imm(instruction));
+      break;
+    case FORMAT_SHIFT:
+      snprintf(result, buf_size, "%s x%d, x%d, %d", name, rd, rs1, rs2);
+      break;
+    case FORMAT_UNARY:
+      snprintf(result, buf_size, "%s x%d, x%d", name, rd, rs1);
+      break;
+    case FORMAT_LOAD:
+      snprintf(result, buf_size, "%s x%d, %d(x%d)", name, rd,
+               insn_i_imm(instruction), rs1);
+      break;
+    case FORMAT_S:
+      snprintf(result, buf_size, "%s x%d, %d(x%d)", name, rs2,
+               insn_s_imm(instruction), rs1);
+      break;
+    case FORMAT_B:
+      snprintf(result, buf_size, "%s x%d, x%d, %x", name, rs1, rs2,
+               addr + insn_b_imm(instruction));
+      break;
+    case FORMAT_U:
+      snprintf(result, buf_size, "%s x%d, %d", name, rd,
+               insn_u_imm(instruction) >> 12);
+      break;
+    case FORMAT_J:
+      snprintf(result, buf_size, "%s x%d, %x", name, rd,
+               addr + insn_j_imm(instruction));
+      break;
+    case FORMAT_LR:
+      snprintf(result, buf_size, "%s x%d, (x%d)", name, rd, rs1);
+      break;
+    case FORMAT_AMO:
+      snprintf(result, buf_size, "%s x%d, x%d, (x%d)", name, rd, rs2, rs1);
+      break;
+    case FORMAT_CSR:
+      disassemble_csr(instruction, result, buf_size);
+      break;
+    case FORMAT_FLOAT:
+      disassemble_float(instruction, result, buf_size);
+      break;
+    case FORMAT_VECTOR:
+      disassemble_vector(instruction, result, buf_size);
+      break;
+  }
+}
+
+// Output helpers for disassemble_block, which formats by hand rather than
+// with snprintf to keep up with large images. Each returns the end of what
+// it wrote.
+
+static const char lower_hex[] = "0123456789abcdef";
+static const char upper_hex[] = "0123456789ABCDEF";
+
+static char* put_str(char* out, const char* text) {
+  while (*text)
+    *out++ = *text++;
+  return out;
+}
+
+// text, but at most DISASSEMBLE_NAME_MAX characters of it
+static char* put_name(char* out, const char* text) {
+  for (int i = 0; text[i] && i < DISASSEMBLE_NAME_MAX; i++)
+    *out++ = text[i];
+  return out;
+}
+
+static char* put_dec(char* out, int32_t value) {
+  char     digits[10];
+  int      count     = 0;
+  uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+  if (value < 0)
+    *out++ = '-';
+  do {
+    digits[count++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  while (count)
+    *out++ = digits[--count];
+  return out;
+}
+
+// value in hex with at least width digits, padded with pad
+static char* put_hex(char* out, uint32_t value, int width, char pad,
+                     const char* hex_digits) {
+  char digits[8];
+  int  count = 0;
+  do {
+    digits[count++] = hex_digits[value & 0xf];
+    value >>= 4;
+  } while (value);
+  for (int i = count; i < width; i++)
+    *out++ = pad;
+  while (count)
+    *out++ = digits[--count];
+  return out;
+}
+
+static char* put_reg(char* out, const char* separator, uint32_t reg) {
+  out    = put_str(out, separator);
+  *out++ = 'x';
+  return put_dec(out, reg);
+}
+
+// a branch or jump target, with the label it is at or in
+static char* put_target(char* out, uint32_t target,
+                        const struct symbol_label* labels, int num_labels) {
+  out = put_hex(out, target, 1, '0', lower_hex);
+  // the last label at or before target
+  int low = 0, high = num_labels;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (labels[middle].value <= target)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (low == 0)
+    return out;
+  const struct symbol_label* label  = &labels[low - 1];
+  uint32_t                   offset = target - label->value;
+  if (offset != 0 && offset >= label->size)
+    return out;
+  out = put_str(out, " <");
+  out = put_name(out, label->name);
+  if (offset) {
+    out = put_str(out, "+0x");
+    out = put_hex(out, offset, 1, '0', lower_hex);
+  }
+  return put_str(out, ">");
+}
+
+// the text disassemble would give, with symbolic targets
+static char* put_instruction(char* out, uint32_t addr, uint32_t instruction,
+                             const struct symbol_label* labels,
+                             int num_labels) {
+  uint32_t expanded = instruction;
+  if (instruction_length(instruction) == 2)
+    expanded = compressed_expand(instruction);
+
+  const struct decode_info* info = &decode_info[decode(expanded)];
+  uint32_t                  rd   = insn_rd(expanded);
+  uint32_t                  rs1  = insn_rs1(expanded);
+  uint32_t                  rs2  = insn_rs2(expanded);
+
+  switch (info->format) {
+    case FORMAT_CSR:
+    case FORMAT_FLOAT:
+    case FORMAT_VECTOR: {
+      char result[DISASSEMBLE_LINE_MAX / 4];
+      disassemble(addr, instruction, result, sizeof(result), NULL);
+      return put_str(out, result);
     }
-  } else if (opcode == 0b0010011) {
-    // ADDI
-    if (funct3 == 0b000) {
-      snprintf(result, buf_size, "addi x%d, x%d, %d", rd, rs1, i_imm);
-      // SLTI
-    } else if (funct3 == 0b010) {
-      snprintf(result, buf_size, "slti x%d, x%d, %d", rd, rs1, i_imm);
-      // SLTIU
-    } else if (funct3 == 0b011) {
-      snprintf(result, buf_size, "sltiu x%d, x%d, %d", rd, rs1, i_imm);
-      // XORI
-    } else if (funct3 == 0b100) {
-      snprintf(result, buf_size, "xori x%d, x%d, %d", rd, rs1, i_imm);
-      // ORI
-    } else if (funct3 == 0b110) {
-      snprintf(result, buf_size, "ori x%d, x%d, %d", rd, rs1, i_imm);
-      // ANDI
-    } else if (funct3 == 0b111) {
-      snprintf(result, buf_size, "andi x%d, x%d, %d", rd, rs1, i_imm);
-    } else if (funct3 == 0b001) {
-      // SLLI
-      if (funct7 == 0b0000000) {
-        uint32_t shamt = extractBits(instruction, 24, 20);
-        snprintf(result, buf_size, "slli x%d, x%d, %u", rd, rs1, shamt);
-      } else {
-        snprintf(result, buf_size, "unknown I-type (shift left)");
-      }
-    } else if (funct3 == 0b101) {
-      // SRLI
-      if (funct7 == 0b0000000) {
-        uint32_t shamt = extractBits(instruction, 24, 20);
-        snprintf(result, buf_size, "srli x%d, x%d, %d", rd, rs1, shamt);
-      }
-      // SRAI
-      else if (funct7 == 0b0100000) {
-        uint32_t shamt = extractBits(instruction, 24, 20);
-        snprintf(result, buf_size, "srai x%d, x%d, %d", rd, rs1, shamt);
-      } else {
-        snprintf(result, buf_size, "unknown I-type (right shift)");
+    default:
+      break;
+  }
+
+  out = put_str(out, info->name);
+  switch (info->format) {
+    case FORMAT_R:
+      out = put_reg(out, " ", rd);
+      out = put_reg(out, ", ", rs1);
+      out = put_reg(out, ", ", rs2);
+      break;
+    case FORMAT_I:
+      out = put_reg(out, " ", rd);
+      out = put_reg(out, ", ", rs1);
+      out = put_str(out, ", ");
+      out = put_dec(out, insn_i_imm(expanded));
+      break;
+    case FORMAT_SHIFT:
+      out = put_reg(out, " ", rd);
+      out = put_reg(out, ", ", rs1);
+      out = put_str(out, ", ");
+      out = put_dec(out, rs2);
+      break;
+    case FORMAT_UNARY:
+      out = put_reg(out, " ", rd);
+      out = put_reg(out, ", ", rs1);
+      break;
+    case FORMAT_LOAD:
+      out = put_reg(out, " ", rd);
+      out = put_str(out, ", ");
+      out = put_dec(out, insn_i_imm(expanded));
+      out = put_reg(out, "(", rs1);
+      *out++ = ')';
+      break;
+    case FORMAT_S:
+      out = put_reg(out, " ", rs2);
+      out = put_str(out, ", ");
+      out = put_dec(out, insn_s_imm(expanded));
+      out = put_reg(out, "(", rs1);
+      *out++ = ')';
+      break;
+    case FORMAT_B:
+      out = put_reg(out, " ", rs1);
+      out = put_reg(out, ", ", rs2);
+      out = put_str(out, ", ");
+      out = put_target(out, addr + insn_b_imm(expanded), labels, num_labels);
+      break;
+    case FORMAT_U:
+      out = put_reg(out, " ", rd);
+      out = put_str(out, ", ");
+      out = put_dec(out, insn_u_imm(expanded) >> 12);
+      break;
+    case FORMAT_J:
+      out = put_reg(out, " ", rd);
+      out = put_str(out, ", ");
+      out = put_target(out, addr + insn_j_imm(expanded), labels, num_labels);
+      break;
+    case FORMAT_LR:
+      out = put_reg(out, " ", rd);
+      out = put_reg(out, ", (", rs1);
+      *out++ = ')';
+      break;
+    case FORMAT_AMO:
+      out = put_reg(out, " ", rd);
+      out = put_reg(out, ", ", rs2);
+      out = put_reg(out, ", (", rs1);
+      *out++ = ')';
+      break;
+  }
+  return out;
+}
+
+size_t disassemble_block(uint32_t addr, const unsigned char* code,
+                         size_t size, const struct symbol_label* labels,
+                         int num_labels, char* out, size_t out_size,
+                         size_t* used) {
+  char*  start = out;
+  size_t done  = 0;
+  // the first label at or after addr
+  int next_label = 0, high = num_labels;
+  while (next_label < high) {
+    int middle = (next_label + high) / 2;
+    if (labels[middle].value < addr)
+      next_label = middle + 1;
+    else
+      high = middle;
+  }
+
+  while (done < size &&
+         (size_t)(out - start) + DISASSEMBLE_LINE_MAX <= out_size) {
+    uint32_t here        = addr + done;
+    uint32_t instruction = code[done];
+    if (done + 1 < size)
+      instruction |= code[done + 1] << 8;
+    int length = instruction_length(instruction);
+    // a 32-bit instruction cut off at the end is shown with zeroes
+    for (int i = 2; length == 4 && i < 4 && done + i < size; i++)
+      instruction |= (uint32_t)code[done + i] << (8 * i);
+
+    while (next_label < num_labels && labels[next_label].value <= here) {
+      if (labels[next_label].value == here) {
+        out = put_str(out, "\n");
+        out = put_hex(out, here, 8, '0', lower_hex);
+        out = put_str(out, " <");
+        out = put_name(out, labels[next_label].name);
+        out = put_str(out, ">:\n");
       }
+      next_label++;
+    }
+
+    out = put_hex(out, here, 8, ' ', lower_hex);
+    if (length == 2) {
+      out = put_str(out, " :     ");
+      out = put_hex(out, instruction, 4, '0', upper_hex);
     } else {
-      snprintf(result, buf_size, "unknown I-type ");
+      out = put_str(out, " : ");
+      out = put_hex(out, instruction, 8, '0', upper_hex);
     }
+    out    = put_str(out, "       ");
+    out    = put_instruction(out, here, instruction, labels, num_labels);
+    *out++ = '\n';
+    done += length;
   }
+  *used = done < size ? done : size;
+  return out - start;
+}
 
-  // check for S-type
-  else if (opcode == 0b0100011) {
-    // SB
-    if (funct3 == 0b000) {
-      snprintf(result, buf_size, "sb x%d, %d(x%d)", rs2, s_imm, rs1);
-      // SH
-    } else if (funct3 == 0b001) {
-      snprintf(result, buf_size, "sh x%d, %d(x%d)", rs2, s_imm, rs1);
-      // SW
-    } else if (funct3 == 0b010) {
-      snprintf(result, buf_size, "sw x%d, %d(x%d)", rs2, s_imm, rs1);
-    } else {
-      snprintf(result, buf_size, "unknown S-type");
+// disassemble_to_fd splits the code into chunks of about this many bytes,
+// and disassembles and writes up to ROUND_CHUNKS of them at a time
+#define CHUNK_SIZE   (64 * 1024)
+#define ROUND_CHUNKS 64
+
+struct chunk {
+  size_t start; // offset in the code
+  size_t size;
+  char*  text;  // NULL if out of memory
+  size_t length;
+};
+
+struct disassembly {
+  uint32_t                   addr;
+  const unsigned char*       code;
+  const struct symbol_label* labels;
+  int                        num_labels;
+  struct chunk*              chunks;
+  int                        num_chunks;
+  pthread_mutex_t            lock;
+  int                        next_chunk;
+};
+
+static void disassemble_chunk(struct disassembly* disassembly,
+                              struct chunk*       chunk) {
+  size_t capacity = chunk->size * 16 + DISASSEMBLE_LINE_MAX;
+  size_t done     = 0;
+  chunk->text     = malloc(capacity);
+  chunk->length   = 0;
+  while (chunk->text && done < chunk->size) {
+    if (capacity - chunk->length < DISASSEMBLE_LINE_MAX) {
+      char* text = realloc(chunk->text, capacity *= 2);
+      if (!text)
+        free(chunk->text);
+      chunk->text = text;
+      continue;
     }
+    size_t used;
+    chunk->length += disassemble_block(
+        disassembly->addr + chunk->start + done,
+        disassembly->code + chunk->start + done, chunk->size - done,
+        disassembly->labels, disassembly->num_labels,
+        chunk->text + chunk->length, capacity - chunk->length, &used);
+    done += used;
   }
+}
 
-  // check for U-type
-  // LUI
-  else if (opcode == 0b0110111) {
-    snprintf(result, buf_size, "lui x%d, %d", rd, u_imm);
-    // AUIPC
-  } else if (opcode == 0b0010111) {
-    snprintf(result, buf_size, "auipc x%d, %d", rd, u_imm);
+static void* disassembly_worker(void* arg) {
+  struct disassembly* disassembly = arg;
+  while (1) {
+    pthread_mutex_lock(&disassembly->lock);
+    int chunk = disassembly->next_chunk++;
+    pthread_mutex_unlock(&disassembly->lock);
+    if (chunk >= disassembly->num_chunks)
+      return NULL;
+    disassemble_chunk(disassembly, &disassembly->chunks[chunk]);
   }
+}
 
-  // check for J-type
-  // JAL
-  else if (opcode == 0b1101111) {
-    uint32_t target = addr + jal_imm;
-    snprintf(result, buf_size, "jal x%d, %x", rd, target);
+// write all of the chunks' text, in order
+static int write_chunks(int fd, struct chunk* chunks, int num_chunks) {
+  struct iovec iov[ROUND_CHUNKS];
+  for (int i = 0; i < num_chunks; i++) {
+    iov[i].iov_base = chunks[i].text;
+    iov[i].iov_len  = chunks[i].length;
+  }
+  struct iovec* next = iov;
+  while (num_chunks > 0) {
+    ssize_t written = writev(fd, next, num_chunks);
+    if (written < 0)
+      return -1;
+    while (num_chunks > 0 && (size_t)written >= next->iov_len) {
+      written -= next->iov_len;
+      next++;
+      num_chunks--;
+    }
+    if (num_chunks > 0) {
+      next->iov_base = (char*)next->iov_base + written;
+      next->iov_len -= written;
+    }
   }
+  return 0;
+}
 
-  // check for B-type
-  else if (opcode == 0b1100011) {
-    uint32_t branch_tar = addr + b_imm;
-    if (funct3 == 0b000) {
-      // BEQ
-      snprintf(result, buf_size, "beq x%d, x%d, %x", rs1, rs2, branch_tar);
-    } else if (funct3 == 0b001) {
-      // BNE
-      snprintf(result, buf_size, "bne x%d, x%d, %x", rs1, rs2, branch_tar);
-    } else if (funct3 == 0b100) {
-      // BLT
-      snprintf(result, buf_size, "blt x%d, x%d, %x", rs1, rs2, branch_tar);
-    } else if (funct3 == 0b101) {
-      // BGE
-      snprintf(result, buf_size, "bge x%d, x%d, %x", rs1, rs2, branch_tar);
-    } else if (funct3 == 0b110) {
-      // BLTU
-      snprintf(result, buf_size, "bltu x%d, x%d, %x", rs1, rs2, branch_tar);
-    } else if (funct3 == 0b111) {
-      // BGEU
-      snprintf(result, buf_size, "bgeu x%d, x%d, %x", rs1, rs2, branch_tar);
-    } else {
-      snprintf(result, buf_size, "unknown B-type");
+int disassemble_to_fd(int fd, uint32_t addr, const unsigned char* code,
+                      size_t size, const struct symbol_label* labels,
+                      int num_labels, int num_threads) {
+  if (num_threads <= 0)
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads <= 0)
+    num_threads = 1;
+  if (num_threads > ROUND_CHUNKS)
+    num_threads = ROUND_CHUNKS;
+  struct chunk       chunks[ROUND_CHUNKS];
+  pthread_t          threads[ROUND_CHUNKS];
+  struct disassembly disassembly = {.addr       = addr,
+                                    .code       = code,
+                                    .labels     = labels,
+                                    .num_labels = num_labels,
+                                    .chunks     = chunks};
+  pthread_mutex_init(&disassembly.lock, NULL);
+
+  // A chunk must begin on an instruction, which with RV32C is only known by
+  // going through the lengths of the ones before it
+  size_t offset = 0;
+  int    failed = 0;
+  while (!failed && offset < size) {
+    int num_chunks = 0;
+    for (; num_chunks < ROUND_CHUNKS && offset < size; num_chunks++) {
+      size_t end = offset;
+      while (end < size && end - offset < CHUNK_SIZE)
+        end += instruction_length(code[end]);
+      if (end > size)
+        end = size;
+      chunks[num_chunks].start = offset;
+      chunks[num_chunks].size  = end - offset;
+      offset                   = end;
     }
 
-    // system calls
-    // ecall
-  } else if (opcode == 0b1110011 && funct3 == 0b000 &&
-             funct12 == 0b000000000000) {
-    snprintf(result, buf_size, "ecall");
-  } else {
-    snprintf(result, buf_size, "unknown");
+    disassembly.num_chunks = num_chunks;
+    disassembly.next_chunk = 0;
+    int num_started        = 0;
+    for (; num_started < num_threads - 1 && num_started < num_chunks - 1;
+         num_started++) {
+      if (pthread_create(&threads[num_started], NULL, disassembly_worker,
+                         &disassembly))
+        break;
+    }
+    disassembly_worker(&disassembly);
+    for (int i = 0; i < num_started; i++)
+      pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < num_chunks; i++)
+      failed |= chunks[i].text == NULL;
+    if (!failed)
+      failed = write_chunks(fd, chunks, num_chunks);
+    for (int i = 0; i < num_chunks; i++)
+      free(chunks[i].text);
   }
+  pthread_mutex_destroy(&disassembly.lock);
+  return failed ? -1 : 0;
 }
@@ -3,5 +3,32 @@
 #include <stdint.h>
 
 struct symbols;
+struct symbol_label;
+// a compressed (16-bit) instruction is taken from the low half and shown as
+// the 32-bit instruction it stands for
 void disassemble(uint32_t addr, uint32_t instruction, char* result,
-                 size_t buf_size, struct symbols* symbols);
\ No newline at end of file
+                 size_t buf_size, struct symbols* symbols);
+// room disassemble_block needs for a line, and the longest symbol name it
+// shows in full
+#define DISASSEMBLE_LINE_MAX 1024
+#define DISASSEMBLE_NAME_MAX 400
+
+// Disassemble the size bytes of code found at addr into out, one line per
+// instruction with its address and encoding, as 'sim -d' shows them. labels
+// (see symbols_labels) are shown on a line of their own before the code they
+// name, and after branch and jump targets. Stops when the code is done or
+// out_size has less than DISASSEMBLE_LINE_MAX bytes left, which it must have
+// to begin with. Returns the number of bytes written, and the number of code
+// bytes done in *used.
+size_t disassemble_block(uint32_t addr, const unsigned char* code,
+                         size_t size, const struct symbol_label* labels,
+                         int num_labels, char* out, size_t out_size,
+                         size_t* used);
+
+// Disassemble as disassemble_block does and write the result to the file
+// descriptor fd. Large code is split into chunks that num_threads threads (0:
+// one per CPU) disassemble at the same time, and which are written in order
+// with writev. Returns 0, or -1 if out of memory or writing failed.
+int disassemble_to_fd(int fd, uint32_t addr, const unsigned char* code,
+                      size_t size, const struct symbol_label* labels,
+                      int num_labels, int num_threads);
@@ -0,0 +1,114 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS, fmemopen
+#include "forkserver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int read_all(int fd, void* buffer, size_t size) {
+  char* p = buffer;
+  while (size > 0) {
+    ssize_t got = read(fd, p, size);
+    if (got <= 0)
+      return -1;
+    p += got;
+    size -= got;
+  }
+  return 0;
+}
+
+static int write_all(int fd, const void* buffer, size_t size) {
+  const char* p = buffer;
+  while (size > 0) {
+    ssize_t done = write(fd, p, size);
+    if (done <= 0)
+      return -1;
+    p += done;
+    size -= done;
+  }
+  return 0;
+}
+
+// Runs in the forked child, which never returns to main
+static void child_run(struct sim* sim, char* input, uint32_t size,
+                      long int max_insns, struct forkserver_reply* reply) {
+  FILE* in = size ? fmemopen(input, size, "r") : fopen("/dev/null", "r");
+  if (in == NULL)
+    _exit(1);
+  sim_set_io(sim, in, stdout);
+  int         result = sim_run_program(sim, max_insns);
+  struct Stat stat   = sim_stat(sim);
+  fflush(stdout);
+  reply->result    = result;
+  reply->exit_code = stat.exit_code;
+  reply->insns     = stat.insns;
+  _exit(0);
+}
+
+int forkserver_run(struct sim* sim, long int max_insns) {
+  // the child leaves its reply here rather than in a pipe, so a child that
+  // dies on the host cannot leave the server waiting for it
+  struct forkserver_reply* shared =
+      mmap(NULL, sizeof(struct forkserver_reply), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    perror("Error allocating fork server reply");
+    return -1;
+  }
+  uint32_t hello = FORKSERVER_HELLO;
+  if (write_all(FORKSERVER_STATUS_FD, &hello, sizeof(hello))) {
+    perror("Error writing to fork server status fd");
+    munmap(shared, sizeof(struct forkserver_reply));
+    return -1;
+  }
+
+  char*    input    = NULL;
+  uint32_t max_size = 0;
+  int      status   = 0;
+  while (1) {
+    uint32_t size;
+    if (read_all(FORKSERVER_CTL_FD, &size, sizeof(size)))
+      break; // driver is done
+    if (size > max_size) {
+      free(input);
+      max_size = size;
+      input    = malloc(size);
+      if (input == NULL) {
+        fprintf(stderr, "Error allocating fork server input\n");
+        status = -1;
+        break;
+      }
+    }
+    if (read_all(FORKSERVER_CTL_FD, input, size)) {
+      fprintf(stderr, "Fork server input ended early\n");
+      status = -1;
+      break;
+    }
+
+    *shared = (struct forkserver_reply){.result = -1};
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("Error forking guest");
+      status = -1;
+      break;
+    }
+    if (pid == 0)
+      child_run(sim, input, size, max_insns, shared);
+    int child_status;
+    if (waitpid(pid, &child_status, 0) < 0 || !WIFEXITED(child_status) ||
+        WEXITSTATUS(child_status) != 0)
+      shared->result = -1;
+    struct forkserver_reply reply = *shared;
+    if (write_all(FORKSERVER_STATUS_FD, &reply, sizeof(reply))) {
+      perror("Error writing to fork server status fd");
+      status = -1;
+      break;
+    }
+  }
+  free(input);
+  munmap(shared, sizeof(struct forkserver_reply));
+  return status;
+}
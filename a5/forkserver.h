@@ -0,0 +1,35 @@
+#ifndef __FORKSERVER_H__
+#define __FORKSERVER_H__
+
+#include "sim.h"
+
+#include <stdint.h>
+
+// Fork server: the guest is loaded once and stopped at its entry point, and
+// every run is a fork() of that process, so the child starts with all guest
+// pages shared copy-on-write instead of loading the ELF file again.
+//
+// The driver talks to the server over two file descriptors it sets up before
+// starting 'sim riscv-elf -F N' (values in host byte order):
+//
+//   status fd:  uint32 FORKSERVER_HELLO once the guest is loaded
+//   control fd: uint32 size, then size bytes used as the guest's stdin
+//   status fd:  struct forkserver_reply once that run has finished
+//
+// and so on for every run, until the driver closes the control fd.
+#define FORKSERVER_CTL_FD 198
+#define FORKSERVER_STATUS_FD 199
+#define FORKSERVER_HELLO 0x53465652 // "RVFS"
+
+struct forkserver_reply {
+  int32_t result;    // enum sim_result, or -1 if the child died
+  int32_t exit_code; // struct Stat of the run
+  int64_t insns;
+};
+
+// Serve runs of the loaded guest, each stopped after max_insns instructions
+// (<= 0: no limit). Guest output goes to the guest's stdout. Returns 0 when
+// the driver closes the control fd, -1 on errors.
+int forkserver_run(struct sim* sim, long int max_insns);
+
+#endif
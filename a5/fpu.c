@@ -0,0 +1,460 @@
+#include "fpu.h"
+#include "tools.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#else
+#include <fenv.h>
+#endif
+
+// fflags
+#define NX 1  // inexact
+#define UF 2  // underflow
+#define OF 4  // overflow
+#define DZ 8  // divide by zero
+#define NV 16 // invalid
+
+// rounding modes, in the rm field and in frm
+#define RNE 0 // to nearest, ties to even
+#define RTZ 1 // towards zero
+#define RDN 2 // down
+#define RUP 3 // up
+#define RMM 4 // to nearest, ties away from zero
+#define DYN 7 // rm only: use frm
+
+#define CANONICAL_NAN_S 0x7fc00000u
+#define CANONICAL_NAN_D 0x7ff8000000000000ull
+#define NAN_BOX 0xffffffff00000000ull
+#define SIGN_S 0x80000000u
+#define SIGN_D 0x8000000000000000ull
+
+// Rounding and exception flags. The guest's rounding mode is installed on
+// the host for the duration of one operation, with the host's flags
+// cleared, and whatever the operation raised is returned as fflags. RMM
+// has no host equivalent and rounds as RNE; the two only differ on exact
+// ties. fpu.o is built with -frounding-math so the compiler does not
+// move arithmetic across the mode switches.
+#if defined(__SSE2__)
+// MXCSR: flags in bits 0-5, rounding control in bits 13-14
+static const uint32_t host_rounding[5] = {0x0000, 0x6000, 0x2000, 0x4000, 0};
+
+static inline uint32_t host_begin(int rm) {
+  uint32_t saved = _mm_getcsr();
+  _mm_setcsr((saved & ~0x603fu) | host_rounding[rm]);
+  return saved;
+}
+
+static inline uint32_t host_end(uint32_t saved) {
+  uint32_t raised = _mm_getcsr();
+  _mm_setcsr(saved);
+  return (raised & 0x01) << 4 | // invalid
+         (raised & 0x04) << 1 | // divide by zero
+         (raised & 0x08) >> 1 | // overflow
+         (raised & 0x10) >> 3 | // underflow
+         (raised & 0x20) >> 5;  // precision
+}
+#else
+static const int host_rounding[5] = {FE_TONEAREST, FE_TOWARDZERO,
+                                     FE_DOWNWARD, FE_UPWARD, FE_TONEAREST};
+
+static inline uint32_t host_begin(int rm) {
+  uint32_t saved = fegetround();
+  feclearexcept(FE_ALL_EXCEPT);
+  fesetround(host_rounding[rm]);
+  return saved;
+}
+
+static inline uint32_t host_end(uint32_t saved) {
+  int raised = fetestexcept(FE_ALL_EXCEPT);
+  fesetround(saved);
+  return (raised & FE_INVALID ? NV : 0) | (raised & FE_DIVBYZERO ? DZ : 0) |
+         (raised & FE_OVERFLOW ? OF : 0) | (raised & FE_UNDERFLOW ? UF : 0) |
+         (raised & FE_INEXACT ? NX : 0);
+}
+#endif
+
+// the rounding mode an instruction uses, -1 if it is reserved
+static int rounding_mode(const struct cpu_state* state, uint32_t rm) {
+  if (rm == DYN)
+    rm = state->fcsr >> FPU_FRM_SHIFT;
+  return rm <= RMM ? (int)rm : -1;
+}
+
+// Register access. A single read from a register that does not hold a
+// NaN-boxed value is the canonical NaN. Arithmetic results are written
+// with NaNs made canonical, as RISC-V does not propagate NaN payloads;
+// moves and sign injection write the bits unchanged.
+static uint32_t get_s_bits(const struct cpu_state* state, uint32_t reg) {
+  uint64_t bits = state->fregs[reg];
+  return (bits & NAN_BOX) == NAN_BOX ? (uint32_t)bits : CANONICAL_NAN_S;
+}
+
+static float get_s(const struct cpu_state* state, uint32_t reg) {
+  uint32_t bits = get_s_bits(state, reg);
+  float    value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static void set_s_bits(struct cpu_state* state, uint32_t reg, uint32_t bits) {
+  state->fregs[reg] = NAN_BOX | bits;
+}
+
+static void set_s(struct cpu_state* state, uint32_t reg, float value) {
+  uint32_t bits = CANONICAL_NAN_S;
+  if (!isnan(value))
+    memcpy(&bits, &value, sizeof(bits));
+  set_s_bits(state, reg, bits);
+}
+
+static double get_d(const struct cpu_state* state, uint32_t reg) {
+  double value;
+  memcpy(&value, &state->fregs[reg], sizeof(value));
+  return value;
+}
+
+static void set_d(struct cpu_state* state, uint32_t reg, double value) {
+  uint64_t bits = CANONICAL_NAN_D;
+  if (!isnan(value))
+    memcpy(&bits, &value, sizeof(bits));
+  state->fregs[reg] = bits;
+}
+
+// FCLASS of a value with the given number of fraction bits
+static uint32_t classify(uint64_t bits, int exponent_bits, int fraction_bits) {
+  int      negative = (bits >> (exponent_bits + fraction_bits)) & 1;
+  uint64_t exponent = (bits >> fraction_bits) & ((1u << exponent_bits) - 1);
+  uint64_t fraction = bits & ((1ull << fraction_bits) - 1);
+  if (exponent == (1u << exponent_bits) - 1) {
+    if (fraction == 0)
+      return negative ? 1 << 0 : 1 << 7; // infinity
+    return (fraction >> (fraction_bits - 1)) ? 1 << 9 : 1 << 8; // q/s NaN
+  }
+  if (exponent == 0) {
+    if (fraction == 0)
+      return negative ? 1 << 3 : 1 << 4; // zero
+    return negative ? 1 << 2 : 1 << 5;   // subnormal
+  }
+  return negative ? 1 << 1 : 1 << 6; // normal
+}
+
+#define CLASS_SIGNALING_NAN (1 << 8)
+
+// FMIN/FMAX on the bit patterns a and b of the values x and y: a NaN loses
+// to a number, and -0 is less than +0
+static uint64_t min_max(uint64_t a, uint64_t b, double x, double y, int max,
+                        uint64_t canonical_nan) {
+  if (isnan(x) && isnan(y))
+    return canonical_nan;
+  if (isnan(x))
+    return b;
+  if (isnan(y))
+    return a;
+  if (x == y) // also +0 and -0, where the sign bit decides
+    return max ? a & b : a | b;
+  return (x < y) != max ? a : b;
+}
+
+// FEQ, FLT, FLE. FEQ is a quiet comparison, the others raise invalid on
+// any NaN.
+static int compare(double x, double y, uint32_t funct3, int signaling,
+                   uint32_t* flags) {
+  if (isnan(x) || isnan(y)) {
+    if (signaling || funct3 != 0b010)
+      *flags |= NV;
+    return 0;
+  }
+  switch (funct3) {
+    case 0b010: // FEQ
+      return x == y;
+    case 0b001: // FLT
+      return x < y;
+  }
+  return x <= y; // FLE
+}
+
+// FCVT.W and FCVT.WU: round in the current mode and saturate, a NaN
+// converts to the largest value. Doubles hold every single exactly.
+static uint32_t to_integer(double value, int is_unsigned, int rm,
+                           uint32_t* flags) {
+  double low  = is_unsigned ? 0.0 : (double)INT32_MIN;
+  double high = is_unsigned ? (double)UINT32_MAX : (double)INT32_MAX;
+  if (isnan(value)) {
+    *flags |= NV;
+    return is_unsigned ? UINT32_MAX : INT32_MAX;
+  }
+  double rounded = rm == RMM ? round(value) : rint(value);
+  if (rounded < low) {
+    *flags |= NV;
+    return is_unsigned ? 0 : (uint32_t)INT32_MIN;
+  }
+  if (rounded > high) {
+    *flags |= NV;
+    return is_unsigned ? UINT32_MAX : INT32_MAX;
+  }
+  if (rounded != value)
+    *flags |= NX;
+  return is_unsigned ? (uint32_t)rounded : (uint32_t)(int32_t)rounded;
+}
+
+// FMADD, FMSUB, FNMSUB, FNMADD: one rounding, as the host's fma
+static int fused(struct cpu_state* state, uint32_t instruction) {
+  uint32_t opcode = extractBits(instruction, 6, 0);
+  uint32_t rd     = insn_rd(instruction);
+  uint32_t rs1    = insn_rs1(instruction);
+  uint32_t rs2    = insn_rs2(instruction);
+  uint32_t rs3    = extractBits(instruction, 31, 27);
+  uint32_t fmt    = extractBits(instruction, 26, 25);
+  int      rm     = rounding_mode(state, insn_funct3(instruction));
+  // bit 2 negates the addend, bit 3 the product
+  int negate_addend  = (opcode >> 2) & 1;
+  int negate_product = (opcode >> 3) & 1;
+  if (rm < 0 || fmt > 1)
+    return 0;
+
+  uint32_t saved = host_begin(rm);
+  if (fmt == 0) {
+    float a = get_s(state, rs1), b = get_s(state, rs2), c = get_s(state, rs3);
+    set_s(state, rd,
+          fmaf(negate_product ? -a : a, b, negate_addend ? -c : c));
+  } else {
+    double a = get_d(state, rs1), b = get_d(state, rs2), c = get_d(state, rs3);
+    set_d(state, rd, fma(negate_product ? -a : a, b, negate_addend ? -c : c));
+  }
+  state->fcsr |= host_end(saved);
+  return 1;
+}
+
+// Operations that round: add, subtract, multiply, divide, square root and
+// the conversions between formats and from integers
+static int arithmetic(struct cpu_state* state, uint32_t funct5, uint32_t fmt,
+                      uint32_t rd, uint32_t rs1, uint32_t rs2, int rm) {
+  uint32_t* registers = state->registers;
+  int       valid     = 1;
+  uint32_t  saved     = host_begin(rm);
+  if (fmt == 0) {
+    float a = get_s(state, rs1), b = get_s(state, rs2);
+    switch (funct5) {
+      case 0b00000: // FADD.S
+        set_s(state, rd, a + b);
+        break;
+      case 0b00001: // FSUB.S
+        set_s(state, rd, a - b);
+        break;
+      case 0b00010: // FMUL.S
+        set_s(state, rd, a * b);
+        break;
+      case 0b00011: // FDIV.S
+        set_s(state, rd, a / b);
+        break;
+      case 0b01011: // FSQRT.S
+        set_s(state, rd, sqrtf(a));
+        break;
+      case 0b01000: // FCVT.S.D
+        set_s(state, rd, (float)get_d(state, rs1));
+        break;
+      case 0b11010: // FCVT.S.W, FCVT.S.WU
+        set_s(state, rd,
+              rs2 ? (float)registers[rs1] : (float)(int32_t)registers[rs1]);
+        break;
+      default:
+        valid = 0;
+    }
+  } else {
+    double a = get_d(state, rs1), b = get_d(state, rs2);
+    switch (funct5) {
+      case 0b00000: // FADD.D
+        set_d(state, rd, a + b);
+        break;
+      case 0b00001: // FSUB.D
+        set_d(state, rd, a - b);
+        break;
+      case 0b00010: // FMUL.D
+        set_d(state, rd, a * b);
+        break;
+      case 0b00011: // FDIV.D
+        set_d(state, rd, a / b);
+        break;
+      case 0b01011: // FSQRT.D
+        set_d(state, rd, sqrt(a));
+        break;
+      case 0b01000: // FCVT.D.S, exact
+        set_d(state, rd, get_s(state, rs1));
+        break;
+      case 0b11010: // FCVT.D.W, FCVT.D.WU, exact
+        set_d(state, rd,
+              rs2 ? (double)registers[rs1] : (double)(int32_t)registers[rs1]);
+        break;
+      default:
+        valid = 0;
+    }
+  }
+  uint32_t flags = host_end(saved);
+  if (valid)
+    state->fcsr |= flags;
+  return valid;
+}
+
+// OP-FP: everything but the fused multiply-adds
+static int operation(struct cpu_state* state, uint32_t instruction) {
+  uint32_t* registers = state->registers;
+  uint32_t  rd        = insn_rd(instruction);
+  uint32_t  funct3    = insn_funct3(instruction);
+  uint32_t  rs1       = insn_rs1(instruction);
+  uint32_t  rs2       = insn_rs2(instruction);
+  uint32_t  fmt       = extractBits(instruction, 26, 25);
+  uint32_t  funct5    = extractBits(instruction, 31, 27);
+  uint32_t  flags     = 0;
+  if (fmt > 1)
+    return 0;
+
+  // operand bits and values, and their FCLASS, for the operations that
+  // do not round
+  uint64_t a, b;
+  double   x, y;
+  uint32_t a_class, b_class;
+  uint64_t sign, canonical_nan;
+  if (fmt == 0) {
+    a             = get_s_bits(state, rs1);
+    b             = get_s_bits(state, rs2);
+    x             = get_s(state, rs1);
+    y             = get_s(state, rs2);
+    a_class       = classify(a, 8, 23);
+    b_class       = classify(b, 8, 23);
+    sign          = SIGN_S;
+    canonical_nan = CANONICAL_NAN_S;
+  } else {
+    a             = state->fregs[rs1];
+    b             = state->fregs[rs2];
+    x             = get_d(state, rs1);
+    y             = get_d(state, rs2);
+    a_class       = classify(a, 11, 52);
+    b_class       = classify(b, 11, 52);
+    sign          = SIGN_D;
+    canonical_nan = CANONICAL_NAN_D;
+  }
+  int      signaling = (a_class | b_class) & CLASS_SIGNALING_NAN;
+  uint64_t result;
+
+  switch (funct5) {
+    case 0b00100: // FSGNJ, FSGNJN, FSGNJX
+      if (funct3 == 0b000)
+        result = (a & ~sign) | (b & sign);
+      else if (funct3 == 0b001)
+        result = (a & ~sign) | (~b & sign);
+      else if (funct3 == 0b010)
+        result = a ^ (b & sign);
+      else
+        return 0;
+      break;
+    case 0b00101: // FMIN, FMAX
+      if (funct3 > 0b001)
+        return 0;
+      result = min_max(a, b, x, y, funct3, canonical_nan);
+      if (signaling)
+        flags |= NV;
+      break;
+    case 0b10100: // FEQ, FLT, FLE
+      if (funct3 > 0b010)
+        return 0;
+      if (rd != 0)
+        registers[rd] = compare(x, y, funct3, signaling, &flags);
+      state->fcsr |= flags;
+      return 1;
+    case 0b11000: { // FCVT.W, FCVT.WU
+      int rm = rounding_mode(state, funct3);
+      if (rm < 0 || rs2 > 1)
+        return 0;
+      uint32_t saved = host_begin(rm);
+      uint32_t value = to_integer(x, rs2, rm, &flags);
+      host_end(saved);
+      if (rd != 0)
+        registers[rd] = value;
+      state->fcsr |= flags;
+      return 1;
+    }
+    case 0b11100: // FMV.X.W, FCLASS
+      if (funct3 == 0b000 && fmt == 0) {
+        // the low bits as they are, even if not NaN-boxed
+        if (rd != 0)
+          registers[rd] = (uint32_t)state->fregs[rs1];
+      } else if (funct3 == 0b001) {
+        if (rd != 0)
+          registers[rd] = a_class;
+      } else {
+        return 0;
+      }
+      return 1;
+    case 0b11110: // FMV.W.X
+      if (funct3 != 0b000 || fmt != 0)
+        return 0;
+      set_s_bits(state, rd, registers[rs1]);
+      return 1;
+    default: {
+      // FCVT.S.D and FCVT.D.S name the other format in rs2, FCVT.S.W[U]
+      // and FCVT.D.W[U] the signedness, and FSQRT has none
+      if ((funct5 == 0b01000 && rs2 != (fmt ^ 1)) ||
+          (funct5 == 0b11010 && rs2 > 1) || (funct5 == 0b01011 && rs2 != 0))
+        return 0;
+      int rm = rounding_mode(state, funct3);
+      if (rm < 0)
+        return 0;
+      return arithmetic(state, funct5, fmt, rd, rs1, rs2, rm);
+    }
+  }
+
+  if (fmt == 0)
+    set_s_bits(state, rd, result);
+  else
+    state->fregs[rd] = result;
+  state->fcsr |= flags;
+  return 1;
+}
+
+int fpu_execute(struct memory* mem, struct cpu_state* state,
+                uint32_t instruction) {
+  uint32_t opcode = extractBits(instruction, 6, 0);
+  uint32_t funct3 = insn_funct3(instruction);
+  uint32_t rs1    = insn_rs1(instruction);
+  uint32_t rd     = insn_rd(instruction); // rs2 for stores
+  int32_t  i_imm  = insn_i_imm(instruction);
+  int32_t  s_imm  = insn_s_imm(instruction);
+
+  switch (opcode) {
+    case 0b0000111: { // FLW, FLD
+      uint32_t address = state->registers[rs1] + i_imm;
+      if (funct3 == 0b010) {
+        set_s_bits(state, rd, memory_rd_w(mem, address));
+      } else if (funct3 == 0b011) {
+        uint64_t low     = (uint32_t)memory_rd_w(mem, address);
+        uint64_t high    = (uint32_t)memory_rd_w(mem, address + 4);
+        state->fregs[rd] = high << 32 | low;
+      } else {
+        return 0;
+      }
+      return 1;
+    }
+    case 0b0100111: { // FSW, FSD
+      uint32_t address = state->registers[rs1] + s_imm;
+      uint32_t rs2     = insn_rs2(instruction);
+      if (funct3 == 0b010) {
+        memory_wr_w(mem, address, (uint32_t)state->fregs[rs2]);
+      } else if (funct3 == 0b011) {
+        memory_wr_w(mem, address, (uint32_t)state->fregs[rs2]);
+        memory_wr_w(mem, address + 4, state->fregs[rs2] >> 32);
+      } else {
+        return 0;
+      }
+      return 1;
+    }
+    case 0b1010011:
+      return operation(state, instruction);
+  }
+  if ((opcode & 0b1110011) == 0b1000011)
+    return fused(state, instruction);
+  return 0;
+}
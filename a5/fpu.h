@@ -0,0 +1,23 @@
+#ifndef __FPU_H__
+#define __FPU_H__
+
+#include "memory.h"
+#include "simulate.h"
+
+#include <stdint.h>
+
+// RV32F and RV32D. Arithmetic runs on the host FPU in the guest's rounding
+// mode, and the exceptions the host raises are accrued in fcsr. Single
+// precision values are NaN-boxed in the 64-bit f registers.
+
+// fcsr fields, also reachable on their own as the fflags and frm CSRs
+#define FPU_FFLAGS_MASK 0x1f
+#define FPU_FRM_SHIFT 5
+#define FPU_FCSR_MASK 0xff
+
+// Execute one F or D instruction (not compressed). Returns 0 if it is not a
+// valid one, which leaves the state untouched.
+int fpu_execute(struct memory* mem, struct cpu_state* state,
+                uint32_t instruction);
+
+#endif
@@ -0,0 +1,330 @@
+#define _DEFAULT_SOURCE // fmemopen
+#include "fuzz.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+struct fuzz_input {
+  uint8_t* data;
+  uint32_t size;
+};
+
+struct fuzzer {
+  struct sim*        sim;
+  const char*        corpus_dir;
+  uint8_t*           trace; // coverage of the current run
+  uint8_t*           seen;  // buckets seen so far for every edge
+  int                edges; // edges seen so far
+  struct fuzz_input* corpus;
+  int                num_inputs;
+  int                max_inputs;
+  uint32_t*          crash_pcs; // one saved crash per faulting pc
+  int                num_crashes;
+  int                max_crashes;
+  int                next_id;
+  FILE*              null_in;
+  FILE*              null_out;
+  uint64_t           rng;
+};
+
+static uint32_t random_below(struct fuzzer* fuzzer, uint32_t limit) {
+  // xorshift64
+  fuzzer->rng ^= fuzzer->rng << 13;
+  fuzzer->rng ^= fuzzer->rng >> 7;
+  fuzzer->rng ^= fuzzer->rng << 17;
+  return (fuzzer->rng >> 32) % limit;
+}
+
+// Hit counts are only compared by order of magnitude, like AFL does, so a
+// loop running a few more times is not a new path
+static uint8_t count_bucket(uint8_t count) {
+  if (count <= 3)
+    return count == 3 ? 4 : count;
+  if (count <= 7)
+    return 8;
+  if (count <= 15)
+    return 16;
+  if (count <= 31)
+    return 32;
+  if (count <= 127)
+    return 64;
+  return 128;
+}
+
+// Merge the trace of the last run into seen, returns 1 if it had anything new
+static int has_new_coverage(struct fuzzer* fuzzer) {
+  const uint64_t* words  = (const uint64_t*)fuzzer->trace;
+  int             is_new = 0;
+  for (int w = 0; w < SIMULATE_COVERAGE_SIZE / 8; ++w) {
+    if (words[w] == 0)
+      continue;
+    for (int i = 8 * w; i < 8 * w + 8; ++i) {
+      if (fuzzer->trace[i] == 0)
+        continue;
+      uint8_t bucket = count_bucket(fuzzer->trace[i]);
+      if (fuzzer->seen[i] & bucket)
+        continue;
+      if (fuzzer->seen[i] == 0)
+        fuzzer->edges++;
+      fuzzer->seen[i] |= bucket;
+      is_new = 1;
+    }
+  }
+  return is_new;
+}
+
+static int run_input(struct fuzzer* fuzzer, uint8_t* data, uint32_t size) {
+  FILE* in = size ? fmemopen(data, size, "r") : fuzzer->null_in;
+  if (in == NULL)
+    return -1;
+  memset(fuzzer->trace, 0, SIMULATE_COVERAGE_SIZE);
+  sim_restore(fuzzer->sim);
+  sim_set_io(fuzzer->sim, in, fuzzer->null_out);
+  int result = sim_run_program(fuzzer->sim, FUZZ_MAX_INSNS);
+  if (in != fuzzer->null_in)
+    fclose(in);
+  return result;
+}
+
+static void save_input(struct fuzzer* fuzzer, const char* prefix,
+                       const uint8_t* data, uint32_t size) {
+  char file_name[4096];
+  snprintf(file_name, sizeof(file_name), "%s/%s-%06d", fuzzer->corpus_dir,
+           prefix, fuzzer->next_id++);
+  FILE* file = fopen(file_name, "wb");
+  if (file == NULL || fwrite(data, 1, size, file) != size)
+    fprintf(stderr, "Error writing fuzz input %s\n", file_name);
+  if (file)
+    fclose(file);
+}
+
+static void add_input(struct fuzzer* fuzzer, const uint8_t* data,
+                      uint32_t size) {
+  if (fuzzer->num_inputs == fuzzer->max_inputs) {
+    fuzzer->max_inputs = fuzzer->max_inputs ? 2 * fuzzer->max_inputs : 64;
+    fuzzer->corpus     = realloc(fuzzer->corpus, fuzzer->max_inputs *
+                                                     sizeof(struct fuzz_input));
+    if (fuzzer->corpus == NULL) {
+      fprintf(stderr, "Error allocating fuzz corpus\n");
+      exit(-1);
+    }
+  }
+  struct fuzz_input* input = &fuzzer->corpus[fuzzer->num_inputs++];
+  input->data              = malloc(size ? size : 1);
+  input->size              = size;
+  memcpy(input->data, data, size);
+}
+
+// Returns 1 if the crash is at a pc not seen before
+static int new_crash(struct fuzzer* fuzzer) {
+  uint32_t pc = sim_fault(fuzzer->sim)->pc;
+  for (int i = 0; i < fuzzer->num_crashes; ++i) {
+    if (fuzzer->crash_pcs[i] == pc)
+      return 0;
+  }
+  if (fuzzer->num_crashes == fuzzer->max_crashes) {
+    fuzzer->max_crashes = fuzzer->max_crashes ? 2 * fuzzer->max_crashes : 16;
+    fuzzer->crash_pcs   = realloc(fuzzer->crash_pcs,
+                                  fuzzer->max_crashes * sizeof(uint32_t));
+    if (fuzzer->crash_pcs == NULL) {
+      fprintf(stderr, "Error allocating fuzz crashes\n");
+      exit(-1);
+    }
+  }
+  fuzzer->crash_pcs[fuzzer->num_crashes++] = pc;
+  return 1;
+}
+
+// Run an input and keep it if it is interesting. Seeds are always kept but
+// not written back to the corpus directory.
+static void try_input(struct fuzzer* fuzzer, uint8_t* data, uint32_t size,
+                      int is_seed) {
+  int result = run_input(fuzzer, data, size);
+  if (result == SIM_FAULT && new_crash(fuzzer)) {
+    save_input(fuzzer, "crash", data, size);
+    const struct memory_fault* fault = sim_fault(fuzzer->sim);
+    fprintf(stderr, "fuzz: %s at 0x%x by instruction at 0x%x\n",
+            memory_fault_name(fault->kind), fault->addr, fault->pc);
+  }
+  if (has_new_coverage(fuzzer) || is_seed) {
+    add_input(fuzzer, data, size);
+    if (!is_seed)
+      save_input(fuzzer, "id", data, size);
+  }
+}
+
+static const uint8_t interesting_bytes[] = {0,   1,   '\n', ' ',  '0', '9',
+                                            'a', 'z', 'A',  0x7f, 0x80, 0xff};
+
+// Apply a random stack of mutations, returns the new size
+static uint32_t mutate(struct fuzzer* fuzzer, uint8_t* data, uint32_t size) {
+  int num_mutations = 1 << random_below(fuzzer, 5);
+  for (int m = 0; m < num_mutations; ++m) {
+    uint32_t choice = random_below(fuzzer, 8);
+    if (size == 0)
+      choice = 4; // only insertion makes sense
+    uint32_t pos = size ? random_below(fuzzer, size) : 0;
+    switch (choice) {
+      case 0: // flip a bit
+        data[pos] ^= 1 << random_below(fuzzer, 8);
+        break;
+      case 1: // random byte
+        data[pos] = random_below(fuzzer, 256);
+        break;
+      case 2: // interesting byte
+        data[pos] = interesting_bytes[random_below(
+            fuzzer, sizeof(interesting_bytes))];
+        break;
+      case 3: // small arithmetic
+        data[pos] += random_below(fuzzer, 33) - 16;
+        break;
+      case 4: { // insert random bytes
+        uint32_t len = 1 + random_below(fuzzer, 8);
+        if (size + len > FUZZ_MAX_INPUT)
+          break;
+        pos = random_below(fuzzer, size + 1);
+        memmove(data + pos + len, data + pos, size - pos);
+        for (uint32_t i = 0; i < len; ++i)
+          data[pos + i] = random_below(fuzzer, 256);
+        size += len;
+        break;
+      }
+      case 5: { // delete a block
+        uint32_t len = 1 + random_below(fuzzer, size - pos);
+        memmove(data + pos, data + pos + len, size - pos - len);
+        size -= len;
+        break;
+      }
+      case 6: { // duplicate a block
+        uint8_t  block[64];
+        uint32_t len = 1 + random_below(fuzzer, size - pos);
+        if (len > sizeof(block))
+          len = sizeof(block);
+        if (size + len > FUZZ_MAX_INPUT)
+          break;
+        memcpy(block, data + pos, len);
+        uint32_t to = random_below(fuzzer, size + 1);
+        memmove(data + to + len, data + to, size - to);
+        memcpy(data + to, block, len);
+        size += len;
+        break;
+      }
+      default: { // splice in the tail of another input
+        struct fuzz_input* other =
+            &fuzzer->corpus[random_below(fuzzer, fuzzer->num_inputs)];
+        if (other->size == 0)
+          break;
+        uint32_t from = random_below(fuzzer, other->size);
+        uint32_t len  = other->size - from;
+        if (pos + len > FUZZ_MAX_INPUT)
+          len = FUZZ_MAX_INPUT - pos;
+        memcpy(data + pos, other->data + from, len);
+        size = pos + len;
+        break;
+      }
+    }
+  }
+  return size;
+}
+
+static int read_seeds(struct fuzzer* fuzzer, uint8_t* buffer) {
+  if (mkdir(fuzzer->corpus_dir, 0777) && errno != EEXIST) {
+    perror("Error creating corpus directory");
+    return -1;
+  }
+  DIR* dir = opendir(fuzzer->corpus_dir);
+  if (dir == NULL) {
+    perror("Error opening corpus directory");
+    return -1;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.')
+      continue;
+    char file_name[4096];
+    snprintf(file_name, sizeof(file_name), "%s/%s", fuzzer->corpus_dir,
+             entry->d_name);
+    int id;
+    if (sscanf(entry->d_name, "id-%d", &id) == 1 ||
+        sscanf(entry->d_name, "crash-%d", &id) == 1) {
+      if (id >= fuzzer->next_id)
+        fuzzer->next_id = id + 1;
+    }
+    FILE* file = fopen(file_name, "rb");
+    if (file == NULL)
+      continue;
+    uint32_t size = fread(buffer, 1, FUZZ_MAX_INPUT, file);
+    fclose(file);
+    try_input(fuzzer, buffer, size, 1);
+  }
+  closedir(dir);
+  if (fuzzer->num_inputs == 0)
+    try_input(fuzzer, buffer, 0, 1);
+  return 0;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int fuzz_run(struct sim* sim, const char* corpus_dir, long int runs,
+             FILE* log) {
+  struct fuzzer fuzzer = {.sim        = sim,
+                          .corpus_dir = corpus_dir,
+                          .trace      = calloc(SIMULATE_COVERAGE_SIZE, 1),
+                          .seen       = calloc(SIMULATE_COVERAGE_SIZE, 1),
+                          .null_in    = fopen("/dev/null", "r"),
+                          .null_out   = fopen("/dev/null", "w"),
+                          .rng        = time(NULL) | 1};
+  uint8_t*      buffer = malloc(FUZZ_MAX_INPUT);
+  int           status = 0;
+  if (!fuzzer.trace || !fuzzer.seen || !fuzzer.null_in || !fuzzer.null_out ||
+      !buffer) {
+    fprintf(stderr, "Error setting up fuzzer\n");
+    status = -1;
+  }
+
+  sim_set_coverage(sim, fuzzer.trace);
+  sim_snapshot(sim);
+  if (status == 0)
+    status = read_seeds(&fuzzer, buffer);
+
+  double start       = now();
+  double last_report = start;
+  for (long int run = 1; status == 0 && (runs <= 0 || run <= runs); ++run) {
+    struct fuzz_input* parent =
+        &fuzzer.corpus[random_below(&fuzzer, fuzzer.num_inputs)];
+    memcpy(buffer, parent->data, parent->size);
+    uint32_t size = mutate(&fuzzer, buffer, parent->size);
+    try_input(&fuzzer, buffer, size, 0);
+
+    double current = now();
+    if (current - last_report >= 1.0 || run == runs) {
+      fprintf(log, "fuzz: %ld runs, %d inputs, %d edges, %d crashes, "
+                   "%.0f runs/s\n",
+              run, fuzzer.num_inputs, fuzzer.edges, fuzzer.num_crashes,
+              run / (current - start));
+      last_report = current;
+    }
+  }
+  sim_set_coverage(sim, NULL);
+
+  for (int i = 0; i < fuzzer.num_inputs; ++i)
+    free(fuzzer.corpus[i].data);
+  free(fuzzer.corpus);
+  free(fuzzer.crash_pcs);
+  free(fuzzer.trace);
+  free(fuzzer.seen);
+  free(buffer);
+  if (fuzzer.null_in)
+    fclose(fuzzer.null_in);
+  if (fuzzer.null_out)
+    fclose(fuzzer.null_out);
+  return status ? -1 : fuzzer.num_crashes;
+}
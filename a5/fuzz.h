@@ -0,0 +1,27 @@
+#ifndef __FUZZ_H__
+#define __FUZZ_H__
+
+#include "sim.h"
+
+#include <stdio.h>
+
+// Coverage guided fuzzing of the loaded guest, in process. Every run starts
+// from a snapshot of the guest taken at the entry point and reads its input
+// through the getchar system call (EOF exits the guest). Inputs are mutated
+// from a corpus, and kept when their run reaches edges (or edge counts) not
+// seen before.
+//
+// The corpus lives in corpus_dir: files found there are the seeds (an empty
+// input if there are none), new inputs are added as id-NNNNNN and inputs
+// that make the guest fault at a new pc as crash-NNNNNN. Runs are stopped
+// after FUZZ_MAX_INSNS instructions. Progress is reported on log.
+//
+// Returns the number of crashes found after the given number of runs
+// (<= 0: no limit), or -1 on errors.
+#define FUZZ_MAX_INPUT 4096
+#define FUZZ_MAX_INSNS 1000000
+
+int fuzz_run(struct sim* sim, const char* corpus_dir, long int runs,
+             FILE* log);
+
+#endif
@@ -0,0 +1,471 @@
+#define _DEFAULT_SOURCE // sockets
+#include "gdbstub.h"
+
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define PACKET_SIZE 0x4000
+#define EBREAK 0x00100073
+#define C_EBREAK 0x9002 // compressed, for breakpoints on 16-bit instructions
+#define SIGTRAP 5
+#define SIGSEGV 11
+
+struct breakpoint {
+  uint32_t addr;
+  int      size;        // 4, or 2 for a 16-bit instruction
+  uint32_t instruction; // the one the ebreak replaced
+};
+
+struct gdb {
+  struct sim*        sim;
+  int                fd;
+  struct breakpoint* breakpoints;
+  int                num_breakpoints;
+  int                max_breakpoints;
+  char*              packet; // last packet received, 0 terminated
+};
+
+static const char* reg_names[33] = {
+    "zero", "ra", "sp", "gp", "tp",  "t0",  "t1", "t2", "fp", "s1", "a0",
+    "a1",   "a2", "a3", "a4", "a5",  "a6",  "a7", "s2", "s3", "s4", "s5",
+    "s6",   "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6", "pc"};
+
+static int listen_on(const char* where) {
+  int fd;
+  if (strchr(where, '/')) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(where) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path too long: %s\n", where);
+      return -1;
+    }
+    strcpy(addr.sun_path, where);
+    unlink(where);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+      perror("Error opening GDB socket");
+      return -1;
+    }
+  } else {
+    struct sockaddr_in addr = {.sin_family      = AF_INET,
+                               .sin_port        = htons(atoi(where)),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int                one  = 1;
+    fd                      = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+      perror("Error opening GDB port");
+      return -1;
+    }
+  }
+  if (listen(fd, 1)) {
+    perror("Error listening for GDB");
+    close(fd);
+    return -1;
+  }
+  fprintf(stderr, "Waiting for GDB on %s\n", where);
+  int conn = accept(fd, NULL, NULL);
+  close(fd);
+  if (conn < 0)
+    perror("Error accepting GDB connection");
+  return conn;
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Parse hex digits up to the first non-hex character, *end is left there
+static uint32_t parse_hex(const char* p, const char** end) {
+  uint32_t value = 0;
+  while (hex_digit(*p) >= 0)
+    value = value << 4 | hex_digit(*p++);
+  if (end)
+    *end = p;
+  return value;
+}
+
+// registers go over the wire as little endian byte strings
+static void put_word(char* out, uint32_t word) {
+  for (int i = 0; i < 4; ++i)
+    sprintf(out + 2 * i, "%02x", (word >> (8 * i)) & 0xff);
+}
+
+static uint32_t get_word(const char* in) {
+  uint32_t word = 0;
+  for (int i = 0; i < 4; ++i)
+    word |= (uint32_t)(hex_digit(in[2 * i]) << 4 | hex_digit(in[2 * i + 1]))
+            << (8 * i);
+  return word;
+}
+
+static int send_packet(struct gdb* gdb, const char* data) {
+  size_t        len      = strlen(data);
+  unsigned char checksum = 0;
+  for (size_t i = 0; i < len; ++i)
+    checksum += data[i];
+  char* buffer = malloc(len + 5);
+  sprintf(buffer, "$%s#%02x", data, checksum);
+  ssize_t sent = write(gdb->fd, buffer, len + 4);
+  free(buffer);
+  return sent == (ssize_t)len + 4 ? 0 : -1;
+}
+
+// Read the next packet into gdb->packet and acknowledge it. Acks from GDB
+// are skipped. Returns -1 when the connection is gone.
+static int receive_packet(struct gdb* gdb) {
+  char c;
+  do {
+    if (read(gdb->fd, &c, 1) != 1)
+      return -1;
+  } while (c != '$');
+  int len = 0;
+  while (1) {
+    if (read(gdb->fd, &c, 1) != 1)
+      return -1;
+    if (c == '#')
+      break;
+    if (len < PACKET_SIZE - 1)
+      gdb->packet[len++] = c;
+  }
+  gdb->packet[len] = 0;
+  char checksum[2];
+  if (read(gdb->fd, checksum, 2) != 2 || write(gdb->fd, "+", 1) != 1)
+    return -1;
+  return 0;
+}
+
+// the breakpoint covering addr
+static struct breakpoint* find_breakpoint(struct gdb* gdb, uint32_t addr) {
+  for (int i = 0; i < gdb->num_breakpoints; ++i) {
+    struct breakpoint* bp = &gdb->breakpoints[i];
+    if (addr - bp->addr < (uint32_t)bp->size)
+      return bp;
+  }
+  return NULL;
+}
+
+static uint8_t* code_bytes(struct gdb* gdb, uint32_t addr) {
+  int* page = memory_page(sim_memory(gdb->sim), addr);
+  return (uint8_t*)page + addr % MEMORY_PAGE_SIZE;
+}
+
+static void plant(struct gdb* gdb, struct breakpoint* bp, uint32_t word) {
+  memcpy(code_bytes(gdb, bp->addr), &word, bp->size);
+}
+
+static int insert_breakpoint(struct gdb* gdb, uint32_t addr, int size) {
+  if ((addr & 1) || (size != 2 && size != 4) ||
+      addr % MEMORY_PAGE_SIZE + size > MEMORY_PAGE_SIZE)
+    return -1;
+  struct breakpoint* old = find_breakpoint(gdb, addr);
+  if (old)
+    return old->addr == addr && old->size == size ? 0 : -1;
+  if (gdb->num_breakpoints == gdb->max_breakpoints) {
+    gdb->max_breakpoints =
+        gdb->max_breakpoints ? 2 * gdb->max_breakpoints : 16;
+    gdb->breakpoints = realloc(gdb->breakpoints, gdb->max_breakpoints *
+                                                     sizeof(struct breakpoint));
+    if (gdb->breakpoints == NULL) {
+      fprintf(stderr, "Error allocating breakpoints\n");
+      exit(-1);
+    }
+  }
+  struct breakpoint* bp = &gdb->breakpoints[gdb->num_breakpoints++];
+  *bp = (struct breakpoint){.addr = addr, .size = size, .instruction = 0};
+  memcpy(&bp->instruction, code_bytes(gdb, addr), size);
+  plant(gdb, bp, size == 2 ? C_EBREAK : EBREAK);
+  return 0;
+}
+
+static void remove_breakpoint(struct gdb* gdb, uint32_t addr) {
+  struct breakpoint* bp = find_breakpoint(gdb, addr);
+  if (bp && bp->addr == addr) {
+    plant(gdb, bp, bp->instruction);
+    *bp = gdb->breakpoints[--gdb->num_breakpoints];
+  }
+}
+
+// Guest memory as GDB should see it, without our ebreaks. -1 if addr is not
+// mapped; reading must not allocate pages
+static int read_byte(struct gdb* gdb, uint32_t addr) {
+  struct breakpoint* bp = find_breakpoint(gdb, addr);
+  if (bp)
+    return (uint8_t)(bp->instruction >> (8 * (addr - bp->addr)));
+  int* page = memory_find_page(sim_memory(gdb->sim), addr);
+  if (page == NULL)
+    return -1;
+  return ((uint8_t*)page)[addr % MEMORY_PAGE_SIZE];
+}
+
+static void write_byte(struct gdb* gdb, uint32_t addr, uint8_t value) {
+  struct breakpoint* bp = find_breakpoint(gdb, addr);
+  if (bp) {
+    int shift       = 8 * (addr - bp->addr);
+    bp->instruction = (bp->instruction & ~(0xffu << shift)) | value << shift;
+  } else {
+    *code_bytes(gdb, addr) = value;
+  }
+}
+
+static int interrupted(struct gdb* gdb) {
+  char c;
+  return recv(gdb->fd, &c, 1, MSG_DONTWAIT) == 1 && c == 0x03;
+}
+
+static int run_one(struct sim* sim) {
+  int result = sim_run(sim, 1);
+  if (result == SIM_ECALL)
+    result = sim_handle_ecall(sim);
+  return result;
+}
+
+// Single step or continue. Returns why the guest stopped.
+static int resume(struct gdb* gdb, int step) {
+  struct sim*        sim = gdb->sim;
+  struct breakpoint* bp  = find_breakpoint(gdb, sim_get_pc(sim));
+  if (bp && bp->addr == sim_get_pc(sim)) {
+    // step over the breakpoint we are sitting on with the real instruction
+    struct breakpoint saved = *bp;
+    plant(gdb, &saved, saved.instruction);
+    int result = run_one(sim);
+    plant(gdb, &saved, saved.size == 2 ? C_EBREAK : EBREAK);
+    if (step || result != SIM_STOPPED)
+      return result;
+  } else if (step) {
+    return run_one(sim);
+  }
+  while (1) {
+    int result = sim_run(sim, GDB_SLICE);
+    if (result == SIM_ECALL)
+      result = sim_handle_ecall(sim);
+    if (result != SIM_STOPPED || interrupted(gdb))
+      return result;
+  }
+}
+
+static void stop_reply(struct gdb* gdb, int result, char* reply) {
+  if (result == SIM_EXITED)
+    sprintf(reply, "W%02x", sim_stat(gdb->sim).exit_code & 0xff);
+  else if (result == SIM_FAULT)
+    sprintf(reply, "S%02x", SIGSEGV);
+  else
+    sprintf(reply, "S%02x", SIGTRAP);
+}
+
+static void target_xml(char* reply, const char* annex, uint32_t offset,
+                       uint32_t length) {
+  if (strcmp(annex, "target.xml") != 0) {
+    strcpy(reply, "E00");
+    return;
+  }
+  char xml[4096];
+  int  len = sprintf(xml, "<?xml version=\"1.0\"?>"
+                          "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+                          "<target version=\"1.0\">"
+                          "<architecture>riscv:rv32</architecture>"
+                          "<feature name=\"org.gnu.gdb.riscv.cpu\">");
+  for (int i = 0; i < 33; ++i)
+    len += sprintf(xml + len, "<reg name=\"%s\" bitsize=\"32\" type=\"%s\"/>",
+                   reg_names[i], i == 32 ? "code_ptr" : "int");
+  strcpy(xml + len, "</feature></target>");
+  len += strlen(xml + len);
+  if (offset >= (uint32_t)len) {
+    strcpy(reply, "l");
+    return;
+  }
+  if (length > PACKET_SIZE - 2)
+    length = PACKET_SIZE - 2;
+  int more = offset + length < (uint32_t)len;
+  int n    = more ? (int)length : len - (int)offset;
+  reply[0] = more ? 'm' : 'l';
+  memcpy(reply + 1, xml + offset, n);
+  reply[n + 1] = 0;
+}
+
+// Handle one packet. Returns 1 to keep going, 0 to detach, -1 on kill
+static int handle_packet(struct gdb* gdb, char* reply, int* result) {
+  struct sim* sim    = gdb->sim;
+  const char* packet = gdb->packet;
+  const char* p;
+  reply[0] = 0; // empty reply: not supported
+  switch (packet[0]) {
+    case '?':
+      stop_reply(gdb, *result, reply);
+      break;
+    case 'g':
+      for (int i = 0; i < 32; ++i)
+        put_word(reply + 8 * i, sim_get_reg(sim, i));
+      put_word(reply + 8 * 32, sim_get_pc(sim));
+      break;
+    case 'G':
+      if (strlen(packet + 1) < 8 * 33) {
+        strcpy(reply, "E01");
+        break;
+      }
+      for (int i = 1; i < 32; ++i)
+        sim_set_reg(sim, i, get_word(packet + 1 + 8 * i));
+      sim_set_pc(sim, get_word(packet + 1 + 8 * 32));
+      strcpy(reply, "OK");
+      break;
+    case 'p': {
+      uint32_t reg = parse_hex(packet + 1, NULL);
+      if (reg < 32)
+        put_word(reply, sim_get_reg(sim, reg));
+      else if (reg == 32)
+        put_word(reply, sim_get_pc(sim));
+      else
+        strcpy(reply, "E01");
+      break;
+    }
+    case 'P': {
+      uint32_t reg = parse_hex(packet + 1, &p);
+      if (*p != '=' || strlen(p + 1) < 8 || reg > 32) {
+        strcpy(reply, "E01");
+        break;
+      }
+      if (reg == 32)
+        sim_set_pc(sim, get_word(p + 1));
+      else
+        sim_set_reg(sim, reg, get_word(p + 1));
+      strcpy(reply, "OK");
+      break;
+    }
+    case 'm': {
+      uint32_t addr = parse_hex(packet + 1, &p);
+      uint32_t len  = *p == ',' ? parse_hex(p + 1, NULL) : 0;
+      if (len > PACKET_SIZE / 2 - 1)
+        len = PACKET_SIZE / 2 - 1;
+      // stop at the first unmapped byte, an error if that is the first one
+      for (uint32_t i = 0; i < len; ++i) {
+        int byte = read_byte(gdb, addr + i);
+        if (byte < 0) {
+          if (i == 0)
+            strcpy(reply, "E01");
+          break;
+        }
+        sprintf(reply + 2 * i, "%02x", byte);
+      }
+      break;
+    }
+    case 'M': {
+      uint32_t addr = parse_hex(packet + 1, &p);
+      uint32_t len  = *p == ',' ? parse_hex(p + 1, &p) : 0;
+      if (*p != ':' || strlen(p + 1) < 2 * len) {
+        strcpy(reply, "E01");
+        break;
+      }
+      for (uint32_t i = 0; i < len; ++i)
+        write_byte(gdb, addr + i,
+                   hex_digit(p[1 + 2 * i]) << 4 | hex_digit(p[2 + 2 * i]));
+      strcpy(reply, "OK");
+      break;
+    }
+    case 'c':
+    case 's':
+      if (packet[1])
+        sim_set_pc(sim, parse_hex(packet + 1, NULL));
+      *result = resume(gdb, packet[0] == 's');
+      stop_reply(gdb, *result, reply);
+      if (*result == SIM_EXITED) {
+        send_packet(gdb, reply);
+        return -1;
+      }
+      break;
+    case 'Z':
+    case 'z': {
+      if (packet[1] != '0' || packet[2] != ',') // only software breakpoints
+        break;
+      uint32_t addr = parse_hex(packet + 3, &p);
+      uint32_t kind = *p == ',' ? parse_hex(p + 1, NULL) : 4;
+      if (packet[0] == 'Z') {
+        strcpy(reply, insert_breakpoint(gdb, addr, kind) ? "E01" : "OK");
+      } else {
+        remove_breakpoint(gdb, addr);
+        strcpy(reply, "OK");
+      }
+      break;
+    }
+    case 'H':
+      strcpy(reply, "OK");
+      break;
+    case 'T':
+      strcpy(reply, "OK");
+      break;
+    case 'q':
+      if (!strncmp(packet, "qSupported", 10)) {
+        sprintf(reply, "PacketSize=%x;qXfer:features:read+", PACKET_SIZE);
+      } else if (!strcmp(packet, "qAttached")) {
+        strcpy(reply, "1");
+      } else if (!strcmp(packet, "qC")) {
+        strcpy(reply, "QC1");
+      } else if (!strcmp(packet, "qfThreadInfo")) {
+        strcpy(reply, "m1");
+      } else if (!strcmp(packet, "qsThreadInfo")) {
+        strcpy(reply, "l");
+      } else if (!strncmp(packet, "qXfer:features:read:", 20)) {
+        char        annex[64];
+        const char* colon = strchr(packet + 20, ':');
+        size_t      len   = colon ? (size_t)(colon - packet - 20) : 0;
+        if (colon == NULL || len >= sizeof(annex)) {
+          strcpy(reply, "E00");
+          break;
+        }
+        memcpy(annex, packet + 20, len);
+        annex[len]      = 0;
+        uint32_t offset = parse_hex(colon + 1, &p);
+        uint32_t length = *p == ',' ? parse_hex(p + 1, NULL) : 0;
+        target_xml(reply, annex, offset, length);
+      }
+      break;
+    case 'D':
+      strcpy(reply, "OK");
+      send_packet(gdb, reply);
+      return 0;
+    case 'k':
+      return -1;
+  }
+  return send_packet(gdb, reply) ? -1 : 1;
+}
+
+int gdbstub_run(struct sim* sim, const char* where) {
+  struct gdb gdb = {.sim = sim};
+  gdb.fd         = listen_on(where);
+  if (gdb.fd < 0)
+    return -1;
+  gdb.packet  = malloc(PACKET_SIZE);
+  char* reply = malloc(PACKET_SIZE + 1);
+  if (gdb.packet == NULL || reply == NULL) {
+    fprintf(stderr, "Error allocating GDB buffers\n");
+    exit(-1);
+  }
+
+  int result = SIM_STOPPED;
+  int status = 1;
+  while (status > 0 && receive_packet(&gdb) == 0)
+    status = handle_packet(&gdb, reply, &result);
+  close(gdb.fd);
+
+  // after a detach the guest runs on by itself, without breakpoints
+  if (status == 0) {
+    while (gdb.num_breakpoints > 0)
+      remove_breakpoint(&gdb, gdb.breakpoints[0].addr);
+    result = sim_run_program(sim, 0);
+  }
+  free(gdb.breakpoints);
+  free(gdb.packet);
+  free(reply);
+  if (result == SIM_EXITED)
+    return sim_stat(sim).exit_code;
+  return -1;
+}
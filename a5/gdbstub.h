@@ -0,0 +1,23 @@
+#ifndef __GDBSTUB_H__
+#define __GDBSTUB_H__
+
+#include "sim.h"
+
+// GDB remote serial protocol server for a single hart guest. It waits for
+// one connection on 'where', either a TCP port number on localhost or the
+// path of a Unix socket:
+//
+//   sim riscv-elf -g 1234      (gdb) target remote localhost:1234
+//   sim riscv-elf -g /tmp/gs   (gdb) target remote /tmp/gs
+//
+// GDB can read and write registers and memory, single step, continue,
+// interrupt with ^C and set software breakpoints. A breakpoint is an ebreak
+// written over the instruction, so the guest runs at full speed until it
+// gets there; memory reads through GDB still show the original instruction.
+//
+// Returns the guest's exit code, or -1 if it faulted or GDB went away.
+#define GDB_SLICE 0x100000 // instructions between checks for ^C
+
+int gdbstub_run(struct sim* sim, const char* where);
+
+#endif
@@ -0,0 +1,215 @@
+// Build tool: reads instructions.txt and writes decode_table.h and
+// decode_table.c, see decode.h
+//
+//   gen_decode instructions.txt decode_table.h decode_table.c
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_INSNS 255 // the ids are uint8_t, and 0 is INSN_UNKNOWN
+#define NUM_KEYS (1 << 15)
+
+// the bits decode_key looks at, and the two low bits that are always set
+#define KEY_MASK 0xfe00707fu
+
+struct field {
+  const char* name;
+  int         end_bit;
+  int         start_bit;
+};
+
+static const struct field fields[] = {
+    {"opcode", 6, 0},   {"funct3", 14, 12},  {"funct7", 31, 25},
+    {"funct5", 31, 27}, {"funct12", 31, 20}, {"rs2", 24, 20},
+};
+
+struct insn {
+  char     name[32];
+  char     format[16];
+  uint32_t mask;
+  uint32_t match;
+};
+
+static struct insn insns[MAX_INSNS + 1];
+static int         num_insns = 1; // insns[0] is INSN_UNKNOWN
+
+static uint16_t keys[NUM_KEYS];
+static uint8_t  chains[NUM_KEYS * 2];
+static int      chains_size;
+
+static void fail(const char* file_name, int line, const char* message,
+                 const char* what) {
+  fprintf(stderr, "%s:%d: %s '%s'\n", file_name, line, message, what);
+  exit(1);
+}
+
+static int parse_value(const char* text, uint32_t* value) {
+  char* end;
+  if (text[0] == '0' && (text[1] == 'b' || text[1] == 'B'))
+    *value = strtoul(text + 2, &end, 2);
+  else
+    *value = strtoul(text, &end, 0);
+  return end != text && *end == '\0';
+}
+
+static void read_insns(const char* file_name) {
+  FILE* file = fopen(file_name, "r");
+  if (!file) {
+    perror(file_name);
+    exit(1);
+  }
+  char line[256];
+  for (int number = 1; fgets(line, sizeof(line), file); number++) {
+    char* comment = strchr(line, '#');
+    if (comment)
+      *comment = '\0';
+    char* word = strtok(line, " \t\r\n");
+    if (!word)
+      continue;
+    if (num_insns > MAX_INSNS)
+      fail(file_name, number, "too many instructions at", word);
+    struct insn* insn = &insns[num_insns];
+    snprintf(insn->name, sizeof(insn->name), "%s", word);
+    for (int i = 1; i < num_insns; i++) {
+      if (!strcmp(insns[i].name, insn->name))
+        fail(file_name, number, "duplicate instruction", word);
+    }
+    word = strtok(NULL, " \t\r\n");
+    if (!word)
+      fail(file_name, number, "no format for", insn->name);
+    snprintf(insn->format, sizeof(insn->format), "%s", word);
+    while ((word = strtok(NULL, " \t\r\n"))) {
+      char* equals = strchr(word, '=');
+      if (!equals)
+        fail(file_name, number, "expected field=value, got", word);
+      *equals = '\0';
+      const struct field* field = NULL;
+      for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (!strcmp(fields[i].name, word))
+          field = &fields[i];
+      }
+      uint32_t value;
+      if (!field)
+        fail(file_name, number, "unknown field", word);
+      if (!parse_value(equals + 1, &value))
+        fail(file_name, number, "bad value", equals + 1);
+      int      bits       = field->end_bit - field->start_bit + 1;
+      uint32_t field_mask = (uint32_t)(((uint64_t)1 << bits) - 1);
+      if (value > field_mask)
+        fail(file_name, number, "value too large", equals + 1);
+      insn->mask |= field_mask << field->start_bit;
+      insn->match |= value << field->start_bit;
+    }
+    if ((insn->mask & 0x7f) != 0x7f)
+      fail(file_name, number, "no opcode for", insn->name);
+    num_insns++;
+  }
+  fclose(file);
+}
+
+// the instruction bits a key stands for, the inverse of decode_key
+static uint32_t key_bits(uint32_t key) {
+  return ((key & 0x1f) << 2) | 3 | ((key & 0xe0) << 7) |
+         ((key & 0x7f00) << 17);
+}
+
+// the candidates of each key, with identical chains shared
+static void make_chains(void) {
+  for (uint32_t key = 0; key < NUM_KEYS; key++) {
+    uint32_t bits = key_bits(key);
+    uint8_t  chain[MAX_INSNS + 1];
+    int      length = 0;
+    for (int i = 1; i < num_insns; i++) {
+      uint32_t mask = insns[i].mask & KEY_MASK;
+      if ((bits & mask) == (insns[i].match & mask))
+        chain[length++] = i;
+    }
+    chain[length++] = 0;
+
+    int offset = 0;
+    while (offset < chains_size &&
+           (offset + length > chains_size ||
+            memcmp(chains + offset, chain, length) != 0)) {
+      offset++;
+    }
+    if (offset == chains_size) {
+      if (chains_size + length > (int)sizeof(chains)) {
+        fprintf(stderr, "gen_decode: too many candidate chains\n");
+        exit(1);
+      }
+      memcpy(chains + chains_size, chain, length);
+      chains_size += length;
+    }
+    keys[key] = offset;
+  }
+}
+
+// INSN_ and the name in upper case, with '.' and '-' as '_'
+static void print_id(FILE* out, const char* name) {
+  fprintf(out, "INSN_");
+  for (; *name; name++)
+    fputc(isalnum((unsigned char)*name) ? toupper((unsigned char)*name) : '_',
+          out);
+}
+
+static FILE* create(const char* file_name) {
+  FILE* out = fopen(file_name, "w");
+  if (!out) {
+    perror(file_name);
+    exit(1);
+  }
+  fprintf(out, "// generated by gen_decode from instructions.txt, do not "
+               "edit\n\n");
+  return out;
+}
+
+static void write_header(const char* file_name) {
+  FILE* out = create(file_name);
+  fprintf(out, "#ifndef __DECODE_TABLE_H__\n#define __DECODE_TABLE_H__\n\n");
+  fprintf(out, "enum insn {\n  INSN_UNKNOWN,\n");
+  for (int i = 1; i < num_insns; i++) {
+    fprintf(out, "  ");
+    print_id(out, insns[i].name);
+    fprintf(out, ",\n");
+  }
+  fprintf(out, "  INSN_COUNT\n};\n\n#endif\n");
+  fclose(out);
+}
+
+static void write_tables(const char* file_name) {
+  FILE* out = create(file_name);
+  fprintf(out, "#include \"decode.h\"\n\n");
+  fprintf(out, "const struct decode_info decode_info[INSN_COUNT] = {\n");
+  fprintf(out, "  [INSN_UNKNOWN] = {\"unknown\", 0, 0, FORMAT_NONE},\n");
+  for (int i = 1; i < num_insns; i++) {
+    fprintf(out, "  [");
+    print_id(out, insns[i].name);
+    fprintf(out, "] = {\"%s\", 0x%08x, 0x%08x, FORMAT_%s},\n", insns[i].name,
+            insns[i].mask, insns[i].match, insns[i].format);
+  }
+  fprintf(out, "};\n\nconst uint16_t decode_keys[DECODE_KEYS] = {");
+  for (int key = 0; key < NUM_KEYS; key++)
+    fprintf(out, "%s%d,", key % 16 ? " " : "\n  ", keys[key]);
+  fprintf(out, "\n};\n\nconst uint8_t decode_chains[] = {");
+  for (int i = 0; i < chains_size; i++)
+    fprintf(out, "%s%d,", i % 16 ? " " : "\n  ", chains[i]);
+  fprintf(out, "\n};\n");
+  fclose(out);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 4) {
+    fprintf(stderr, "usage: %s instructions.txt decode_table.h "
+                    "decode_table.c\n",
+            argv[0]);
+    return 1;
+  }
+  read_insns(argv[1]);
+  make_chains();
+  write_header(argv[2]);
+  write_tables(argv[3]);
+  return 0;
+}
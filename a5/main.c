@@ -1,11 +1,18 @@
+#include "batch.h"
+#include "compressed.h"
 #include "disassemble.h"
-#include "memory.h"
-#include "read_elf.h"
-#include "simulate.h"
+#include "forkserver.h"
+#include "fuzz.h"
+#include "gdbstub.h"
+#include "reverse.h"
+#include "sim.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+#define MAX_WATCHPOINTS 16
 
 void terminate(const char* error) {
   printf("%s\n", error);
@@ -18,6 +25,39 @@ void terminate(const char* error) {
          "to file 'log'\n");
   printf("      sim riscv-elf -s log     // simulate and log only summary to "
          "file 'log'\n");
+  printf("      sim riscv-elf -c N file  // simulate N instructions, then save "
+         "a checkpoint to 'file'\n");
+  printf("      sim riscv-elf -r file    // resume simulation from checkpoint "
+         "in 'file'\n");
+  printf("      sim riscv-elf -t N       // simulate N harts sharing memory, "
+         "one host thread each\n");
+  printf("      sim riscv-elf -C         // count cycles with a simple timing "
+         "model (cycle CSR)\n");
+  printf("      sim riscv-elf -F N       // fork server, runs of at most N "
+         "instructions on fds 198/199\n");
+  printf("      sim riscv-elf -z N dir   // fuzz N runs (0: forever) with the "
+         "input corpus in 'dir'\n");
+  printf("      sim riscv-elf -g port    // wait for GDB on localhost:port "
+         "(or a socket path)\n");
+  printf("      sim riscv-elf -i log     // record all input to the "
+         "simulated program in 'log'\n");
+  printf("      sim riscv-elf -I log     // replay input from 'log' instead of "
+         "reading stdin\n");
+  printf("      sim riscv-elf -W addr    // when the run ends, go back and "
+         "report the last write to addr\n");
+  printf("                               // (or to any byte of the range "
+         "addr+size)\n");
+  printf("      sim riscv-elf -B N       // when the run ends, go back N "
+         "instructions and show the state\n");
+  printf("      sim riscv-elf -w addr    // report every write to addr "
+         "(addr+size: a range)\n");
+  printf("      sim riscv-elf -wr addr   // report every read, -wa every "
+         "access\n");
+  printf("  sim -b manifest [-j N] [-m N]\n");
+  printf("      run each job in 'manifest' (riscv-elf stdin expected "
+         "prog-args) on N host\n");
+  printf("      threads (-j, default: all CPUs), stopping jobs after N "
+         "instructions (-m)\n");
   printf("    prog-args: arguments to the simulated program\n");
   printf("               these arguments are provided through argv. Puts '--' "
          "in argv[0]\n");
@@ -28,7 +68,7 @@ void terminate(const char* error) {
 
 // Helper function - grabs args to simulated program from command line and
 // places them in simulated memory
-int pass_args_to_program(struct memory* mem, int argc, char* argv[]) {
+int pass_args_to_program(struct sim* sim, int argc, char* argv[]) {
   int seperator_position = 1; // skip first, it is the path to the simulator
   int seperator_found    = 0;
   while (seperator_position < argc) {
@@ -39,95 +79,351 @@ int pass_args_to_program(struct memory* mem, int argc, char* argv[]) {
   }
   if (seperator_found) { // we've got args for the program!!
     // the seperator is the first arg.
-    int      first_arg  = seperator_position;
-    int      num_args   = argc - first_arg;
-    unsigned count_addr = 0x1000000;
-    unsigned argv_addr  = 0x1000004;
-    unsigned str_addr   = argv_addr + 4 * num_args;
-    memory_wr_w(mem, count_addr, num_args);
-    for (int index = 0; index < num_args; ++index) {
-      memory_wr_w(mem, argv_addr + 4 * index, str_addr);
-      char* cp = argv[first_arg + index];
-      int   c;
-      do {
-        c = *cp++;
-        memory_wr_b(mem, str_addr++, c);
-      } while (c);
-    }
+    int first_arg = seperator_position;
+    sim_set_args(sim, argc - first_arg, &argv[first_arg]);
   }
   // leave it to main to handle args before the seperator
   return seperator_position;
 }
 
-// Helper function, prints disassembly
-void disassemble_to_stdout(struct memory* mem, struct program_info* prog_info,
+// Helper function, prints disassembly. The text segment is read in one go
+// and disassembled on all CPUs
+void disassemble_to_stdout(struct memory* mem,
+                           const struct program_info* prog_info,
                            struct symbols* symbols) {
-  const int buf_size = 100;
-  char      disassembly[buf_size];
-  for (unsigned int addr = prog_info->text_start; addr < prog_info->text_end;
-       addr += 4) {
-    unsigned int instruction = memory_rd_w(mem, addr);
-    disassemble(addr, instruction, disassembly, buf_size, symbols);
-    printf("%8x : %08X       %s\n", addr, instruction, disassembly);
+  unsigned int         start = prog_info->text_start;
+  unsigned int         size  = prog_info->text_end - start;
+  unsigned char*       code  = malloc(size + 1); // + 1, size may be 0
+  struct symbol_label* labels;
+  int                  num_labels =
+      symbols_labels(symbols, start, prog_info->text_end, &labels);
+  if (!code) {
+    terminate("Out of memory for the disassembly.");
+  }
+  memory_rd_block(mem, start, code, size);
+  fflush(stdout);
+  if (disassemble_to_fd(STDOUT_FILENO, start, code, size, labels, num_labels,
+                        0))
+    perror("Error writing the disassembly");
+  free(labels);
+  free(code);
+}
+
+// Helper function, goes back to where insns instructions had executed and
+// shows pc and registers there (-B)
+void show_back(struct reverse* rev, struct sim* sim, long int insns) {
+  if (insns < 0 || reverse_goto(rev, insns) != SIM_STOPPED) {
+    fprintf(stderr, "Cannot go back to %ld instructions\n", insns);
+    return;
   }
+  unsigned int offset;
+  const char*  function =
+      symbols_function_at(sim_symbols(sim), sim_get_pc(sim), &offset);
+  fprintf(stderr, "After %ld instructions: pc 0x%x", insns, sim_get_pc(sim));
+  if (function)
+    fprintf(stderr, " (%s+0x%x)", function, offset);
+  for (int i = 0; i < 32; ++i)
+    fprintf(stderr, "%sx%-2d %08x", i % 4 ? "  " : "\n", i,
+            sim_get_reg(sim, i));
+  fprintf(stderr, "\n");
+}
+
+// Helper function, runs 'sim -b manifest [-j N] [-m N]'
+int run_batch(int argc, char* argv[]) {
+  int      num_threads = 0;
+  long int max_insns   = 0;
+  for (int i = 3; i < argc; ++i) {
+    if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+      if (num_threads < 1) {
+        terminate("Number of threads must be positive.");
+      }
+    } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+      max_insns = atol(argv[++i]);
+    } else {
+      terminate("Unknown or incomplete batch option");
+    }
+  }
+  int failed = batch_run(argv[2], num_threads, max_insns, stdout);
+  return failed == 0 ? 0 : -1;
 }
 
 int main(int argc, char* argv[]) {
-  struct memory* mem = memory_create();
-  argc               = pass_args_to_program(mem, argc, argv);
-  if (argc == 2 || argc == 3 || argc == 4) {
-    FILE* log_file  = NULL;
-    FILE* prof_file = NULL;
-    if (argc == 4 && !strcmp(argv[2], "-l")) {
-      log_file = fopen(argv[3], "w");
+  if (argc >= 3 && !strcmp(argv[1], "-b"))
+    return run_batch(argc, argv);
+  struct sim* sim = sim_create();
+  argc            = pass_args_to_program(sim, argc, argv);
+  if (argc < 2) {
+    terminate("Missing operands");
+  }
+  FILE*       log_file         = NULL;
+  FILE*       prof_file        = NULL;
+  FILE*       record_file      = NULL;
+  FILE*       replay_file      = NULL;
+  const char* summary_name     = NULL;
+  const char* checkpoint_name  = NULL;
+  const char* restore_name     = NULL;
+  long int    checkpoint_at    = 0;
+  int         disassemble_only = 0;
+  int         num_harts        = 1;
+  int         fork_server      = 0;
+  const char* corpus_dir       = NULL;
+  const char* gdb_where        = NULL;
+  long int    run_insns        = 0;
+  int         find_write       = 0;
+  uint32_t    write_addr       = 0;
+  uint32_t    write_size       = 4;
+  long int    back_insns       = 0;
+  uint32_t    watch_addr[MAX_WATCHPOINTS];
+  uint32_t    watch_size[MAX_WATCHPOINTS];
+  int         watch_kind[MAX_WATCHPOINTS];
+  int         num_watch    = 0;
+  int         count_cycles = 0;
+  for (int i = 2; i < argc; ++i) {
+    if (!strcmp(argv[i], "-d")) {
+      disassemble_only = 1;
+    } else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+      log_file = fopen(argv[++i], "w");
       if (log_file == NULL) {
         terminate("Could not open logfile, terminating.");
       }
-    }
-    if (argc == 4 && !strcmp(argv[2], "-p")) {
-      prof_file = fopen(argv[3], "w");
+    } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+      prof_file = fopen(argv[++i], "w");
       if (prof_file == NULL) {
         terminate("Could not open file for exec profile, terminating.");
       }
+    } else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+      record_file = fopen(argv[++i], "w");
+      if (record_file == NULL) {
+        terminate("Could not open input log, terminating.");
+      }
+    } else if (!strcmp(argv[i], "-I") && i + 1 < argc) {
+      replay_file = fopen(argv[++i], "r");
+      if (replay_file == NULL) {
+        terminate("Could not open input log, terminating.");
+      }
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      summary_name = argv[++i];
+    } else if (!strcmp(argv[i], "-c") && i + 2 < argc) {
+      checkpoint_at   = atol(argv[++i]);
+      checkpoint_name = argv[++i];
+      if (checkpoint_at <= 0) {
+        terminate("Checkpoint instruction count must be positive.");
+      }
+    } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+      restore_name = argv[++i];
+    } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      num_harts = atoi(argv[++i]);
+      if (num_harts < 1) {
+        terminate("Number of harts must be positive.");
+      }
+    } else if (!strcmp(argv[i], "-C")) {
+      count_cycles = 1;
+    } else if (!strcmp(argv[i], "-F") && i + 1 < argc) {
+      fork_server = 1;
+      run_insns   = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "-g") && i + 1 < argc) {
+      gdb_where = argv[++i];
+    } else if ((!strcmp(argv[i], "-w") || !strcmp(argv[i], "-wr") ||
+                !strcmp(argv[i], "-wa")) &&
+               i + 1 < argc) {
+      if (num_watch == MAX_WATCHPOINTS) {
+        terminate("Too many watchpoints.");
+      }
+      int   kind = argv[i][2] == 'r'   ? MEMORY_WATCH_READ
+                   : argv[i][2] == 'a' ? MEMORY_WATCH_ACCESS
+                                       : MEMORY_WATCH_WRITE;
+      char* end;
+      watch_addr[num_watch] = strtoul(argv[++i], &end, 0);
+      watch_size[num_watch] = *end == '+' ? strtoul(end + 1, NULL, 0) : 4;
+      watch_kind[num_watch] = kind;
+      num_watch++;
+    } else if (!strcmp(argv[i], "-W") && i + 1 < argc) {
+      char* end;
+      find_write = 1;
+      write_addr = strtoul(argv[++i], &end, 0);
+      write_size = *end == '+' ? strtoul(end + 1, NULL, 0) : 4;
+      if (write_size == 0) {
+        terminate("-W size must be positive.");
+      }
+      if (write_addr + write_size - 1 < write_addr) {
+        terminate("-W range wraps past the end of memory.");
+      }
+    } else if (!strcmp(argv[i], "-B") && i + 1 < argc) {
+      back_insns = atol(argv[++i]);
+      if (back_insns <= 0) {
+        terminate("-B needs a positive instruction count.");
+      }
+    } else if (!strcmp(argv[i], "-z") && i + 2 < argc) {
+      run_insns  = atol(argv[++i]);
+      corpus_dir = argv[++i];
+    } else {
+      terminate("Unknown or incomplete sim-option");
+    }
+  }
+
+  sim_set_log(sim, log_file);
+  if (sim_load_elf(sim, argv[1]))
+    exit(-1);
+  if (disassemble_only) {
+    // disassemble text segment to stdout
+    disassemble_to_stdout(sim_memory(sim), sim_program_info(sim),
+                          sim_symbols(sim));
+    exit(0);
+  }
+  if (fork_server) {
+    if (num_harts > 1 || checkpoint_name || restore_name) {
+      terminate("The fork server only supports a single hart.");
+    }
+    return forkserver_run(sim, run_insns);
+  }
+  if (corpus_dir) {
+    if (num_harts > 1 || checkpoint_name || restore_name) {
+      terminate("The fuzzer only supports a single hart.");
+    }
+    int crashes = fuzz_run(sim, corpus_dir, run_insns, stderr);
+    return crashes == 0 ? 0 : -1;
+  }
+  if (gdb_where) {
+    if (num_harts > 1 || checkpoint_name) {
+      terminate("GDB only supports a single hart and no checkpoint.");
     }
-    struct program_info prog_info;
-    int                 status = read_elf(mem, &prog_info, argv[1], log_file);
-    if (status)
-      exit(status);
-    struct symbols* symbols = symbols_read_from_elf(argv[1]);
-    if (symbols == NULL) {
+    if (restore_name && sim_checkpoint_load(sim, restore_name))
       exit(-1);
+    return gdbstub_run(sim, gdb_where);
+  }
+  if (num_harts > 1 && (checkpoint_name || restore_name)) {
+    terminate("Checkpoints only support a single hart.");
+  }
+  if (num_harts > 1 && (record_file || replay_file)) {
+    terminate("Input logs only support a single hart.");
+  }
+  if (num_watch && num_harts > 1) {
+    terminate("Watchpoints only support a single hart.");
+  }
+  if ((find_write || back_insns) && (num_harts > 1 || checkpoint_name)) {
+    terminate("-W and -B only support a single hart and no checkpoint.");
+  }
+  if (restore_name && sim_checkpoint_load(sim, restore_name))
+    exit(-1);
+  if (record_file && sim_record_input(sim, record_file)) {
+    terminate("Could not write input log, terminating.");
+  }
+  if (replay_file && sim_replay_input(sim, replay_file)) {
+    terminate("Not a valid input log, terminating.");
+  }
+  for (int i = 0; i < num_watch; ++i) {
+    if (sim_watch(sim, watch_addr[i], watch_size[i], watch_kind[i], stderr) <
+        0) {
+      terminate("Invalid watchpoint range.");
     }
-    if (argc == 3 && !strcmp(argv[2], "-d")) {
-      // disassemble text segment to stdout
-      disassemble_to_stdout(mem, &prog_info, symbols);
-      exit(0);
+  }
+
+  if (count_cycles)
+    sim_set_cycle_costs(sim, &simulate_default_costs);
+
+  long int start_insns  = sim_insns(sim);
+  uint64_t start_cycles = sim_cycles(sim);
+  long int budget      = 0;
+  if (checkpoint_at) {
+    budget = checkpoint_at - start_insns;
+    if (budget <= 0) {
+      terminate("Checkpoint must be later than the restored state.");
     }
-    int         start_addr = prog_info.start;
-    clock_t     before     = clock();
-    struct Stat stats      = simulate(mem, start_addr, log_file, symbols);
-    long int    num_insns  = stats.insns;
-    clock_t     after      = clock();
-    int         ticks      = after - before;
-    double      mips = (1.0 * num_insns * CLOCKS_PER_SEC) / ticks / 1000000;
-    if (argc == 4 && !strcmp(argv[2], "-s")) {
-      log_file = fopen(argv[3], "w");
-      if (log_file == NULL) {
-        terminate("Could not open logfile, terminating.");
-      }
+  }
+  clock_t         before = clock();
+  int             result;
+  long int        num_insns;
+  struct reverse* rev = NULL;
+  if (find_write || back_insns) {
+    rev       = reverse_create(sim, stdin, stdout, REVERSE_LATENCY);
+    result    = reverse_run(rev, budget);
+    num_insns = sim_insns(sim) - start_insns;
+  } else if (num_harts > 1) {
+    long int hart_insns[num_harts];
+    result    = sim_run_harts(sim, num_harts, hart_insns);
+    num_insns = 0;
+    for (int i = 0; i < num_harts; ++i)
+      num_insns += hart_insns[i];
+  } else {
+    result    = sim_run_program(sim, budget);
+    num_insns = sim_insns(sim) - start_insns;
+  }
+  clock_t after = clock();
+  int     ticks = after - before;
+  double  mips  = (1.0 * num_insns * CLOCKS_PER_SEC) / ticks / 1000000;
+  if (result == SIM_FAULT) {
+    const struct memory_fault* fault = sim_fault(sim);
+    fprintf(stderr, "%s at 0x%x by instruction at 0x%x, after %ld "
+                    "instructions\n",
+            memory_fault_name(fault->kind), fault->addr, fault->pc,
+            sim_insns(sim));
+  }
+  if (result == SIM_BREAK) {
+    fprintf(stderr, "ebreak at 0x%x, after %ld instructions\n",
+            sim_get_pc(sim), sim_insns(sim));
+  }
+  if (rev) {
+    // both leave the guest where the run ended, for the summary below
+    long int end = sim_insns(sim);
+    if (find_write) {
+      long int at = reverse_last_write(rev, write_addr, write_size);
+      if (at < 0)
+        fprintf(stderr, "No write to 0x%x found\n", write_addr);
+      else
+        fprintf(stderr, "Last write to 0x%x by instruction at 0x%x, after "
+                        "%ld instructions\n",
+                write_addr, sim_get_pc(sim), at);
+      reverse_goto(rev, end);
     }
-    if (log_file) {
-      fprintf(log_file,
-              "\nSimulated %ld instructions in %d host ticks (%f MIPS)\n",
-              num_insns, ticks, mips);
-      fclose(log_file);
-    } else {
-      printf("\nSimulated %ld instructions in %d host ticks (%f MIPS)\n",
-             num_insns, ticks, mips);
+    if (back_insns) {
+      show_back(rev, sim, end - back_insns);
+      reverse_goto(rev, end);
+    }
+    reverse_delete(rev);
+  }
+  int failed = result == SIM_FAULT || result == SIM_DIVERGED ||
+               result == SIM_BREAK;
+  if (checkpoint_name && !failed) {
+    if (result == SIM_EXITED) {
+      fprintf(stderr, "Program exited after %ld instructions, before the "
+                      "checkpoint was reached.\n",
+              sim_insns(sim));
+      exit(-1);
     }
-    memory_delete(mem);
+    if (sim_checkpoint_save(sim, checkpoint_name))
+      exit(-1);
+    fprintf(stderr, "Saved checkpoint after %ld instructions to %s\n",
+            sim_insns(sim), checkpoint_name);
+  }
+  if (summary_name) {
+    log_file = fopen(summary_name, "w");
+    if (log_file == NULL) {
+      terminate("Could not open logfile, terminating.");
+    }
+  }
+  if (log_file) {
+    fprintf(log_file,
+            "\nSimulated %ld instructions in %d host ticks (%f MIPS)\n",
+            num_insns, ticks, mips);
   } else {
-    terminate("Missing operands");
-    memory_delete(mem);
+    printf("\nSimulated %ld instructions in %d host ticks (%f MIPS)\n",
+           num_insns, ticks, mips);
+  }
+  // each hart counts its own cycles, only report a single one
+  if (count_cycles && num_harts == 1) {
+    uint64_t cycles = sim_cycles(sim) - start_cycles;
+    fprintf(log_file ? log_file : stdout, "%lu cycles, CPI %.2f\n",
+            (unsigned long)cycles, (double)cycles / num_insns);
   }
-}
\ No newline at end of file
+  if (log_file)
+    fclose(log_file);
+  if (prof_file)
+    fclose(prof_file);
+  if (record_file)
+    fclose(record_file);
+  if (replay_file)
+    fclose(replay_file);
+  sim_delete(sim);
+  return failed ? -1 : 0;
+}
@@ -1,89 +1,617 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
 #include "memory.h"
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Guest pages come from a process wide pool. Fresh pages are carved out of
+// large slabs from mmap, which the OS hands us already zeroed. Pages given
+// back by memory_delete() go on a free list and are cleared when reused, so
+// batches of short runs in one process do not go back to the OS.
+#define SLAB_SIZE 0x200000
+
+static struct {
+  pthread_mutex_t lock;
+  char*           slab_next; // next never used page in the current slab
+  char*           slab_end;
+  void*           free_list; // recycled pages, linked through their first word
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static int* pool_get_page(void) {
+  pthread_mutex_lock(&pool.lock);
+  if (pool.free_list) {
+    void* page     = pool.free_list;
+    pool.free_list = *(void**)page;
+    pthread_mutex_unlock(&pool.lock);
+    memset(page, 0, MEMORY_PAGE_SIZE);
+    return page;
+  }
+  if (pool.slab_next == pool.slab_end) {
+    char* slab = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+      printf("Out of memory for simulated pages\n");
+      exit(-1);
+    }
+    pool.slab_next = slab;
+    pool.slab_end  = slab + SLAB_SIZE;
+  }
+  int* page = (int*)pool.slab_next;
+  pool.slab_next += MEMORY_PAGE_SIZE;
+  pthread_mutex_unlock(&pool.lock);
+  return page;
+}
+
+static void pool_put_page(int* page) {
+  pthread_mutex_lock(&pool.lock);
+  *(void**)page  = pool.free_list;
+  pool.free_list = page;
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// Two level page table. The first level is always present and small; second
+// level tables and the pages themselves are only allocated when touched, so
+// a sparse guest (code at the bottom, args at 0x1000000, stack at the top)
+// only pays for the few regions it actually uses.
+//
+// Harts on different threads share one memory. Allocation takes the memory's
+// lock, and a new page is published by storing its perms last, so the lock
+// free lookups below that see the perms also see the page.
+#define L1_BITS 10
+#define L2_BITS (32 - L1_BITS - MEMORY_PAGE_BITS)
+#define L2_MASK ((1 << L2_BITS) - 1)
+#define PAGE_WORDS (MEMORY_PAGE_SIZE / 4)
+
+struct page_table {
+  int*    pages[1 << L2_BITS];
+  uint8_t perms[1 << L2_BITS]; // MEMORY_PERM_* of each allocated page
+  // snapshot state, see memory_snapshot()
+  int*    saved[1 << L2_BITS]; // NULL: page did not exist, restore to zero
+  uint8_t saved_perms[1 << L2_BITS];
+  uint8_t dirty[1 << L2_BITS]; // on the dirty list
+  // journal state, see memory_mark()
+  uint32_t journal_epoch[1 << L2_BITS]; // epoch the page was last journaled
+  uint8_t  watch[1 << L2_BITS]; // MEMORY_WATCH_* of watchpoints on the page
+  uint8_t  changed[1 << L2_BITS]; // see memory_track_dirty()
+};
+
+struct watchpoint {
+  uint32_t addr;
+  uint32_t size;
+  int      kind; // MEMORY_WATCH_*, 0 once removed
+};
+
+// Contents of a page before its first write after a mark
+struct journal_entry {
+  uint32_t page_number;
+  int      perm;
+  int*     data;
+};
 
 struct memory {
-  int* pages[0x10000];
+  struct page_table*    tables[1 << L1_BITS];
+  pthread_mutex_t       lock;     // serializes page allocation
+  uint32_t*             used;     // numbers of the allocated pages
+  int                   num_used; // so teardown only visits pages in use
+  int                   max_used;
+  int                   tracking; // a snapshot exists, record dirty pages
+  uint32_t*             dirty;    // numbers of pages changed since the snapshot
+  int                   num_dirty;
+  int                   max_dirty;
+  int                   journaling; // a mark exists, journal first writes
+  uint32_t              epoch;      // bumped by every mark and rewind
+  struct journal_entry* journal;    // oldest first
+  int                   num_journal;
+  int                   max_journal;
+  int*                  mark_start; // first journal entry of each live mark
+  int                   num_marks;
+  int                   max_marks;
+  int                   first_mark; // number of the oldest live mark
+  struct watchpoint*    watchpoints;
+  int                   num_watchpoints;
+  int                   max_watchpoints;
+  memory_watch_fn       watch_fn;
+  void*                 watch_arg;
+  int                   tracking_changes; // memory_track_dirty() was called
+  uint32_t*             changed;          // pages written since the last clear
+  int                   num_changed;
+  int                   max_changed;
 };
 
+// Writable pages that have not been written since the snapshot (or mark, or
+// memory_clear_dirty) hold this instead of MEMORY_PERM_W. Stores then miss
+// the fast path in access_page(), which puts the page on the dirty lists or
+// in the journal the first time, so tracking costs nothing for reads or for
+// pages already dirty.
+#define PERM_CLEAN 8
+
+// Likewise pages with watchpoints hold these instead of MEMORY_PERM_R/W, so
+// the watched kinds of access take the slow path and get reported there,
+// while other pages run at full speed.
+#define PERM_WATCH_R 16
+#define PERM_WATCH_W 32
+
+// Does anything need to see the first store to a page?
+static int writes_tracked(struct memory* mem) {
+  return mem->tracking || mem->journaling || mem->tracking_changes;
+}
+
+static int unwatched_perm(int perm) {
+  if (perm & PERM_WATCH_R)
+    perm = (perm & ~PERM_WATCH_R) | MEMORY_PERM_R;
+  if (perm & PERM_WATCH_W)
+    perm = (perm & ~PERM_WATCH_W) | MEMORY_PERM_W;
+  return perm;
+}
+
+static int public_perm(int perm) {
+  perm = unwatched_perm(perm);
+  return perm & PERM_CLEAN ? (perm & ~PERM_CLEAN) | MEMORY_PERM_W : perm;
+}
+
+static int clean_perm(int perm) {
+  int writable = MEMORY_PERM_W | PERM_WATCH_W;
+  return perm & writable ? (perm & ~writable) | PERM_CLEAN : perm;
+}
+
+// Hide R and W according to the watchpoints on the page. A clean page needs
+// nothing for W, stores miss the fast path already.
+static int watch_perm(struct page_table* table, int index, int perm) {
+  int watch = table->watch[index];
+  if ((watch & MEMORY_WATCH_READ) && (perm & MEMORY_PERM_R))
+    perm = (perm & ~MEMORY_PERM_R) | PERM_WATCH_R;
+  if ((watch & MEMORY_WATCH_WRITE) && (perm & MEMORY_PERM_W))
+    perm = (perm & ~MEMORY_PERM_W) | PERM_WATCH_W;
+  return perm;
+}
+
+static void append_page_number(uint32_t** list, int* num, int* max,
+                               uint32_t page_number) {
+  if (*num == *max) {
+    *max  = *max ? 2 * *max : 64;
+    *list = realloc(*list, *max * sizeof(uint32_t));
+    if (*list == NULL) {
+      printf("Out of memory for simulated page list\n");
+      exit(-1);
+    }
+  }
+  (*list)[(*num)++] = page_number;
+}
+
+// Faults are reported to the thread running the faulting hart
+static _Thread_local jmp_buf*             fault_handler;
+static _Thread_local struct memory_fault* fault_info;
+
 struct memory* memory_create() {
-  return calloc(sizeof(struct memory), 1);
+  struct memory* mem = calloc(sizeof(struct memory), 1);
+  if (mem)
+    pthread_mutex_init(&mem->lock, NULL);
+  return mem;
 }
 
 void memory_delete(struct memory* mem) {
-  for (int j = 0; j < 0x10000; ++j) {
-    if (mem->pages[j])
-      free(mem->pages[j]);
+  for (int j = 0; j < mem->num_used; ++j) {
+    uint32_t           page_number = mem->used[j];
+    struct page_table* table       = mem->tables[page_number >> L2_BITS];
+    pool_put_page(table->pages[page_number & L2_MASK]);
+    if (table->saved[page_number & L2_MASK])
+      pool_put_page(table->saved[page_number & L2_MASK]);
   }
+  for (int j = 0; j < (1 << L1_BITS); ++j)
+    free(mem->tables[j]);
+  for (int j = 0; j < mem->num_journal; ++j)
+    pool_put_page(mem->journal[j].data);
+  free(mem->journal);
+  free(mem->mark_start);
+  free(mem->watchpoints);
+  free(mem->used);
+  free(mem->dirty);
+  free(mem->changed);
+  pthread_mutex_destroy(&mem->lock);
   free(mem);
 }
 
+void memory_set_fault_handler(struct memory* mem, jmp_buf* handler,
+                              struct memory_fault* fault) {
+  (void)mem;
+  fault_handler = handler;
+  fault_info    = fault;
+}
+
+const char* memory_fault_name(int kind) {
+  switch (kind) {
+    case MEMORY_FAULT_FETCH_MISALIGNED:
+      return "Unaligned instruction fetch";
+    case MEMORY_FAULT_FETCH_ACCESS:
+      return "Instruction fetch from non-executable page";
+    case MEMORY_FAULT_LOAD_MISALIGNED:
+      return "Unaligned read";
+    case MEMORY_FAULT_LOAD_ACCESS:
+      return "Read from non-readable page";
+    case MEMORY_FAULT_STORE_MISALIGNED:
+      return "Unaligned write";
+    case MEMORY_FAULT_STORE_ACCESS:
+      return "Write to read-only page";
+  }
+  return "No fault";
+}
+
+static void raise_fault(int kind, int addr) {
+  if (fault_handler) {
+    fault_info->kind = kind;
+    fault_info->addr = addr;
+    longjmp(*fault_handler, 1);
+  }
+  printf("%s at %x\n", memory_fault_name(kind), addr);
+  exit(-1);
+}
+
+static int* new_page(struct memory* mem, uint32_t page_number) {
+  pthread_mutex_lock(&mem->lock);
+  struct page_table* table = mem->tables[page_number >> L2_BITS];
+  if (table == NULL) {
+    table = calloc(sizeof(struct page_table), 1);
+    if (table == NULL) {
+      printf("Out of memory for simulated page table\n");
+      exit(-1);
+    }
+    __atomic_store_n(&mem->tables[page_number >> L2_BITS], table,
+                     __ATOMIC_RELEASE);
+  }
+  int* page = table->pages[page_number & L2_MASK];
+  if (page == NULL) { // another hart may have beaten us to it
+    append_page_number(&mem->used, &mem->num_used, &mem->max_used,
+                       page_number);
+    page                                = pool_get_page();
+    table->pages[page_number & L2_MASK] = page;
+    int perm = writes_tracked(mem) ? clean_perm(MEMORY_PERM_DEFAULT)
+                                   : MEMORY_PERM_DEFAULT;
+    __atomic_store_n(&table->perms[page_number & L2_MASK], perm,
+                     __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&mem->lock);
+  return page;
+}
+
+// Lock free lookups for the fast paths. A page that is not allocated yet has
+// no perms.
+static inline struct page_table* lookup_table(struct memory* mem,
+                                              uint32_t       page_number) {
+  return __atomic_load_n(&mem->tables[page_number >> L2_BITS],
+                         __ATOMIC_ACQUIRE);
+}
+
+static inline int lookup_perm(struct page_table* table, uint32_t page_number) {
+  return __atomic_load_n(&table->perms[page_number & L2_MASK],
+                         __ATOMIC_ACQUIRE);
+}
+
 int* get_page(struct memory* mem, int addr) {
-  int page_number = (addr >> 16) & 0x0ffff;
-  if (mem->pages[page_number] == NULL) {
-    mem->pages[page_number] = calloc(65536, 1);
+  uint32_t           page_number = (uint32_t)addr >> MEMORY_PAGE_BITS;
+  struct page_table* table       = lookup_table(mem, page_number);
+  if (table && lookup_perm(table, page_number))
+    return table->pages[page_number & L2_MASK];
+  return new_page(mem, page_number);
+}
+
+// Set the page's memory_track_dirty() bit. Called with the lock held.
+static void note_changed(struct memory* mem, struct page_table* table,
+                         uint32_t page_number) {
+  int index = page_number & L2_MASK;
+  if (mem->tracking_changes && !table->changed[index]) {
+    table->changed[index] = 1;
+    append_page_number(&mem->changed, &mem->num_changed, &mem->max_changed,
+                       page_number);
   }
-  return mem->pages[page_number];
 }
 
-void memory_wr_w(struct memory* mem, int addr, int data) {
-  if (addr & 0x3) {
-    printf("Unaligned word write to %x\n", addr);
-    exit(-1);
+// Put a page on the dirty lists, save its old contents in the journal and
+// make it plain writable again. Called with the lock held.
+static void mark_dirty(struct memory* mem, struct page_table* table,
+                       uint32_t page_number) {
+  int index = page_number & L2_MASK;
+  note_changed(mem, table, page_number);
+  if (mem->tracking && !table->dirty[index]) {
+    table->dirty[index] = 1;
+    append_page_number(&mem->dirty, &mem->num_dirty, &mem->max_dirty,
+                       page_number);
+  }
+  if (mem->journaling && table->journal_epoch[index] != mem->epoch) {
+    table->journal_epoch[index] = mem->epoch;
+    if (mem->num_journal == mem->max_journal) {
+      mem->max_journal = mem->max_journal ? 2 * mem->max_journal : 64;
+      mem->journal =
+          realloc(mem->journal, mem->max_journal * sizeof(*mem->journal));
+      if (mem->journal == NULL) {
+        printf("Out of memory for simulated page journal\n");
+        exit(-1);
+      }
+    }
+    struct journal_entry* entry = &mem->journal[mem->num_journal++];
+    entry->page_number          = page_number;
+    entry->perm                 = public_perm(table->perms[index]);
+    entry->data                 = pool_get_page();
+    memcpy(entry->data, table->pages[index], MEMORY_PAGE_SIZE);
   }
-  int* page                  = get_page(mem, addr);
-  page[(addr >> 2) & 0x3fff] = data;
+  __atomic_store_n(&table->perms[index],
+                   watch_perm(table, index, public_perm(table->perms[index])),
+                   __ATOMIC_RELEASE);
 }
 
-void memory_wr_h(struct memory* mem, int addr, int data) {
-  if (addr & 0x1) {
-    printf("Unaligned halfword write to %x\n", addr);
-    exit(-1);
+// Call the watch handler for each watchpoint of the given kind overlapping
+// [addr, addr + size)
+static void report_watch(struct memory* mem, uint32_t addr, int size, int kind,
+                         uint32_t old_value, uint32_t new_value) {
+  if (mem->watch_fn == NULL)
+    return;
+  if (size < 4)
+    new_value &= (1u << (8 * size)) - 1;
+  struct memory_watch_hit hit = {.kind      = kind,
+                                 .addr      = addr,
+                                 .size      = size,
+                                 .old_value = old_value,
+                                 .new_value = new_value};
+  for (int j = 0; j < mem->num_watchpoints; ++j) {
+    struct watchpoint* watchpoint = &mem->watchpoints[j];
+    if ((watchpoint->kind & kind) &&
+        addr <= watchpoint->addr + (watchpoint->size - 1) &&
+        watchpoint->addr <= addr + (size - 1)) {
+      hit.watchpoint = j;
+      mem->watch_fn(mem->watch_arg, &hit);
+    }
   }
-  int* page  = get_page(mem, addr);
-  int  index = (addr >> 2) & 0x3fff;
-  if ((addr & 2) == 0)
-    page[index] = (page[index] & 0xffff0000) | (data & 0x0000ffff);
-  else
-    page[index] = (page[index] & 0x0000ffff) | ((unsigned)data << 16);
+}
+
+// the first (up to) 4 bytes at addr
+static uint32_t page_value(int* page, uint32_t addr, int size) {
+  uint32_t value = 0;
+  memcpy(&value, (char*)page + (addr & (MEMORY_PAGE_SIZE - 1)),
+         size < 4 ? size : 4);
+  return value;
+}
+
+// Look up the page holding addr for an access needing the given permission.
+// Pages not yet touched are allocated with default permissions. Plain loads
+// and stores of size bytes on watched pages are reported, value is the data
+// a store is about to write. Stores are reported before the page is written,
+// atomics (read and write at once) by their callers.
+static inline int* access_page(struct memory* mem, int addr, int perm,
+                               int fault_kind, int size, uint32_t value) {
+  uint32_t           page_number = (uint32_t)addr >> MEMORY_PAGE_BITS;
+  struct page_table* table       = lookup_table(mem, page_number);
+  if (table && (lookup_perm(table, page_number) & perm) == perm)
+    return table->pages[page_number & L2_MASK];
+  int* page      = get_page(mem, addr);
+  table          = lookup_table(mem, page_number);
+  int  page_perm = lookup_perm(table, page_number);
+  if ((perm & MEMORY_PERM_W) && (page_perm & PERM_CLEAN)) {
+    pthread_mutex_lock(&mem->lock);
+    mark_dirty(mem, table, page_number);
+    pthread_mutex_unlock(&mem->lock);
+    page_perm = lookup_perm(table, page_number);
+  }
+  if ((public_perm(page_perm) & perm) != perm)
+    raise_fault(fault_kind, addr);
+  if ((page_perm & PERM_WATCH_R) && perm == MEMORY_PERM_R) {
+    uint32_t old_value = page_value(page, addr, size);
+    report_watch(mem, addr, size, MEMORY_WATCH_READ, old_value, old_value);
+  }
+  if ((page_perm & PERM_WATCH_W) && perm == MEMORY_PERM_W)
+    report_watch(mem, addr, size, MEMORY_WATCH_WRITE,
+                 page_value(page, addr, size), value);
+  return page;
+}
+
+int* memory_page(struct memory* mem, int addr) {
+  return get_page(mem, addr);
+}
+
+int* memory_find_page(struct memory* mem, unsigned int addr) {
+  uint32_t           page_number = addr >> MEMORY_PAGE_BITS;
+  struct page_table* table       = lookup_table(mem, page_number);
+  return table ? table->pages[page_number & L2_MASK] : NULL;
+}
+
+void memory_set_perm(struct memory* mem, unsigned int addr, unsigned int size,
+                     int perm) {
+  if (size == 0)
+    return;
+  uint32_t first = addr >> MEMORY_PAGE_BITS;
+  uint32_t last  = (addr + size - 1) >> MEMORY_PAGE_BITS;
+  for (uint32_t page_number = first; page_number <= last; ++page_number) {
+    get_page(mem, page_number << MEMORY_PAGE_BITS);
+    struct page_table* table = mem->tables[page_number >> L2_BITS];
+    if (writes_tracked(mem)) {
+      // a restore has to bring the old permissions back
+      pthread_mutex_lock(&mem->lock);
+      mark_dirty(mem, table, page_number);
+      pthread_mutex_unlock(&mem->lock);
+    }
+    __atomic_store_n(&table->perms[page_number & L2_MASK],
+                     watch_perm(table, page_number & L2_MASK, perm),
+                     __ATOMIC_RELEASE);
+  }
+}
+
+int memory_get_perm(struct memory* mem, unsigned int addr) {
+  uint32_t           page_number = addr >> MEMORY_PAGE_BITS;
+  struct page_table* table       = mem->tables[page_number >> L2_BITS];
+  if (table && table->pages[page_number & L2_MASK])
+    return public_perm(table->perms[page_number & L2_MASK]);
+  return MEMORY_PERM_DEFAULT;
+}
+
+static int compare_page_numbers(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+void memory_for_each_page(struct memory* mem, memory_page_fn fn, void* arg) {
+  qsort(mem->used, mem->num_used, sizeof(uint32_t), compare_page_numbers);
+  for (int j = 0; j < mem->num_used; ++j) {
+    uint32_t           page_number = mem->used[j];
+    struct page_table* table       = mem->tables[page_number >> L2_BITS];
+    fn(arg, page_number << MEMORY_PAGE_BITS,
+       table->pages[page_number & L2_MASK],
+       public_perm(table->perms[page_number & L2_MASK]));
+  }
+}
+
+void memory_snapshot(struct memory* mem) {
+  pthread_mutex_lock(&mem->lock);
+  for (int j = 0; j < mem->num_used; ++j) {
+    uint32_t           page_number = mem->used[j];
+    struct page_table* table       = mem->tables[page_number >> L2_BITS];
+    int                index       = page_number & L2_MASK;
+    if (table->saved[index] == NULL)
+      table->saved[index] = pool_get_page();
+    memcpy(table->saved[index], table->pages[index], MEMORY_PAGE_SIZE);
+    int perm                  = public_perm(table->perms[index]);
+    table->saved_perms[index] = perm;
+    table->dirty[index]       = 0;
+    __atomic_store_n(&table->perms[index],
+                     watch_perm(table, index, clean_perm(perm)),
+                     __ATOMIC_RELEASE);
+  }
+  mem->num_dirty = 0;
+  mem->tracking  = 1;
+  pthread_mutex_unlock(&mem->lock);
+}
+
+int memory_restore(struct memory* mem) {
+  pthread_mutex_lock(&mem->lock);
+  int restored = mem->num_dirty;
+  for (int j = 0; j < mem->num_dirty; ++j) {
+    uint32_t           page_number = mem->dirty[j];
+    struct page_table* table       = mem->tables[page_number >> L2_BITS];
+    int                index       = page_number & L2_MASK;
+    int                perm        = MEMORY_PERM_DEFAULT;
+    if (table->saved[index]) {
+      memcpy(table->pages[index], table->saved[index], MEMORY_PAGE_SIZE);
+      perm = table->saved_perms[index];
+    } else {
+      memset(table->pages[index], 0, MEMORY_PAGE_SIZE);
+    }
+    table->dirty[index] = 0;
+    note_changed(mem, table, page_number);
+    __atomic_store_n(&table->perms[index],
+                     watch_perm(table, index, clean_perm(perm)),
+                     __ATOMIC_RELEASE);
+  }
+  mem->num_dirty = 0;
+  pthread_mutex_unlock(&mem->lock);
+  return restored;
+}
+
+void memory_wr_w(struct memory* mem, int addr, int data) {
+  if (addr & 0x3)
+    raise_fault(MEMORY_FAULT_STORE_MISALIGNED, addr);
+  int* page = access_page(mem, addr, MEMORY_PERM_W, MEMORY_FAULT_STORE_ACCESS,
+                          4, data);
+  page[(addr >> 2) & (PAGE_WORDS - 1)] = data;
+}
+
+// Sub-word stores write the bytes in place rather than read-modify-write the
+// whole word, so harts storing to neighbouring bytes do not lose updates.
+// This relies on the host storing words in the guest's (little endian) order.
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "memory.c assumes a little endian host"
+#endif
+
+void memory_wr_h(struct memory* mem, int addr, int data) {
+  if (addr & 0x1)
+    raise_fault(MEMORY_FAULT_STORE_MISALIGNED, addr);
+  int* page = access_page(mem, addr, MEMORY_PERM_W, MEMORY_FAULT_STORE_ACCESS,
+                          2, data);
+  uint16_t half = data;
+  memcpy((char*)page + (addr & (MEMORY_PAGE_SIZE - 1)), &half, 2);
 }
 
 void memory_wr_b(struct memory* mem, int addr, int data) {
-  int* page  = get_page(mem, addr);
-  int  index = (addr >> 2) & 0x3fff;
-  switch (addr & 0x3) {
-    case 0:
-      page[index] = (page[index] & 0xffffff00) | (data & 0xff);
-      break;
-    case 1:
-      page[index] = (page[index] & 0xffff00ff) | ((data & 0xff) << 8);
-      break;
-    case 2:
-      page[index] = (page[index] & 0xff00ffff) | ((data & 0xff) << 16);
-      break;
-    case 3:
-      page[index] =
-          (page[index] & 0x00ffffff) | (((unsigned)(data & 0xff)) << 24);
-      break;
+  int* page = access_page(mem, addr, MEMORY_PERM_W, MEMORY_FAULT_STORE_ACCESS,
+                          1, data);
+  ((unsigned char*)page)[addr & (MEMORY_PAGE_SIZE - 1)] = data;
+}
+
+// Blocks are copied a page at a time, each page checked and reported like
+// a single access of the part of the block on it
+void memory_wr_block(struct memory* mem, int addr, const void* data,
+                     unsigned int size) {
+  const unsigned char* in = data;
+  while (size > 0) {
+    uint32_t offset = addr & (MEMORY_PAGE_SIZE - 1);
+    uint32_t chunk  = MEMORY_PAGE_SIZE - offset;
+    uint32_t first  = 0;
+    if (chunk > size)
+      chunk = size;
+    memcpy(&first, in, chunk < 4 ? chunk : 4);
+    int* page = access_page(mem, addr, MEMORY_PERM_W, MEMORY_FAULT_STORE_ACCESS,
+                            chunk, first);
+    memcpy((char*)page + offset, in, chunk);
+    addr += chunk;
+    in += chunk;
+    size -= chunk;
   }
 }
 
-int memory_rd_w(struct memory* mem, int addr) {
-  int* page = get_page(mem, addr);
-  if (addr & 0x3) {
-    printf("Unaligned word read from %x\n", addr);
-    exit(-1);
+void memory_rd_block(struct memory* mem, int addr, void* data,
+                     unsigned int size) {
+  unsigned char* out = data;
+  while (size > 0) {
+    uint32_t offset = addr & (MEMORY_PAGE_SIZE - 1);
+    uint32_t chunk  = MEMORY_PAGE_SIZE - offset;
+    if (chunk > size)
+      chunk = size;
+    int* page = access_page(mem, addr, MEMORY_PERM_R, MEMORY_FAULT_LOAD_ACCESS,
+                            chunk, 0);
+    memcpy(out, (char*)page + offset, chunk);
+    addr += chunk;
+    out += chunk;
+    size -= chunk;
   }
-  return page[(addr >> 2) & 0x3fff];
+}
+
+int memory_fetch_w(struct memory* mem, int addr) {
+  if (addr & 0x3)
+    raise_fault(MEMORY_FAULT_FETCH_MISALIGNED, addr);
+  int* page =
+      access_page(mem, addr, MEMORY_PERM_X, MEMORY_FAULT_FETCH_ACCESS, 4, 0);
+  return page[(addr >> 2) & (PAGE_WORDS - 1)];
+}
+
+int memory_fetch_h(struct memory* mem, int addr) {
+  if (addr & 0x1)
+    raise_fault(MEMORY_FAULT_FETCH_MISALIGNED, addr);
+  int* page =
+      access_page(mem, addr, MEMORY_PERM_X, MEMORY_FAULT_FETCH_ACCESS, 2, 0);
+  uint16_t half;
+  memcpy(&half, (char*)page + (addr & (MEMORY_PAGE_SIZE - 1)), 2);
+  return half;
+}
+
+const int* memory_code_page(struct memory* mem, int addr) {
+  return access_page(mem, addr, MEMORY_PERM_X, MEMORY_FAULT_FETCH_ACCESS, 4,
+                     0);
+}
+
+int memory_rd_w(struct memory* mem, int addr) {
+  if (addr & 0x3)
+    raise_fault(MEMORY_FAULT_LOAD_MISALIGNED, addr);
+  int* page =
+      access_page(mem, addr, MEMORY_PERM_R, MEMORY_FAULT_LOAD_ACCESS, 4, 0);
+  return page[(addr >> 2) & (PAGE_WORDS - 1)];
 }
 
 int memory_rd_h(struct memory* mem, int addr) {
-  int* page  = get_page(mem, addr);
-  int  index = (addr >> 2) & 0x3fff;
-  if (addr & 0x1) {
-    printf("Unaligned halfword read from %x\n", addr);
-    exit(-1);
-  }
+  if (addr & 0x1)
+    raise_fault(MEMORY_FAULT_LOAD_MISALIGNED, addr);
+  int* page =
+      access_page(mem, addr, MEMORY_PERM_R, MEMORY_FAULT_LOAD_ACCESS, 2, 0);
+  int index = (addr >> 2) & (PAGE_WORDS - 1);
   if ((addr & 2) == 0)
     return page[index] & 0xffff;
   else
@@ -91,8 +619,9 @@ int memory_rd_h(struct memory* mem, int addr) {
 }
 
 int memory_rd_b(struct memory* mem, int addr) {
-  int* page  = get_page(mem, addr);
-  int  index = (addr >> 2) & 0x3fff;
+  int* page =
+      access_page(mem, addr, MEMORY_PERM_R, MEMORY_FAULT_LOAD_ACCESS, 1, 0);
+  int index = (addr >> 2) & (PAGE_WORDS - 1);
   switch (addr & 0x3) {
     case 0:
       return page[index] & 0xff;
@@ -108,4 +637,303 @@ int memory_rd_b(struct memory* mem, int addr) {
       break;
   }
   return 0; // silence a warning
-}
\ No newline at end of file
+}
+
+static uint32_t amo_result(int op, uint32_t old, uint32_t value) {
+  switch (op) {
+    case MEMORY_AMO_SWAP:
+      return value;
+    case MEMORY_AMO_ADD:
+      return old + value;
+    case MEMORY_AMO_XOR:
+      return old ^ value;
+    case MEMORY_AMO_AND:
+      return old & value;
+    case MEMORY_AMO_OR:
+      return old | value;
+    case MEMORY_AMO_MIN:
+      return (int32_t)old < (int32_t)value ? old : value;
+    case MEMORY_AMO_MAX:
+      return (int32_t)old > (int32_t)value ? old : value;
+    case MEMORY_AMO_MINU:
+      return old < value ? old : value;
+  }
+  return old > value ? old : value; // MEMORY_AMO_MAXU
+}
+
+// Atomics on watched pages are reported after the fact, with what they read
+// and (if anything) wrote. The extra lookup is only paid by atomics.
+static void report_atomic(struct memory* mem, uint32_t addr, uint32_t old,
+                          uint32_t new, int wrote) {
+  uint32_t           page_number = addr >> MEMORY_PAGE_BITS;
+  struct page_table* table       = lookup_table(mem, page_number);
+  int                watch       = table->watch[page_number & L2_MASK];
+  if (watch & MEMORY_WATCH_READ)
+    report_watch(mem, addr, 4, MEMORY_WATCH_READ, old, old);
+  if ((watch & MEMORY_WATCH_WRITE) && wrote)
+    report_watch(mem, addr, 4, MEMORY_WATCH_WRITE, old, new);
+}
+
+uint32_t memory_amo_w(struct memory* mem, int addr, int op, uint32_t value) {
+  if (addr & 0x3)
+    raise_fault(MEMORY_FAULT_STORE_MISALIGNED, addr);
+  int* page = access_page(mem, addr, MEMORY_PERM_R | MEMORY_PERM_W,
+                          MEMORY_FAULT_STORE_ACCESS, 4, 0);
+  uint32_t* word = (uint32_t*)&page[(addr >> 2) & (PAGE_WORDS - 1)];
+  uint32_t  old;
+  switch (op) {
+    case MEMORY_AMO_SWAP:
+      old = __atomic_exchange_n(word, value, __ATOMIC_SEQ_CST);
+      break;
+    case MEMORY_AMO_ADD:
+      old = __atomic_fetch_add(word, value, __ATOMIC_SEQ_CST);
+      break;
+    case MEMORY_AMO_XOR:
+      old = __atomic_fetch_xor(word, value, __ATOMIC_SEQ_CST);
+      break;
+    case MEMORY_AMO_AND:
+      old = __atomic_fetch_and(word, value, __ATOMIC_SEQ_CST);
+      break;
+    case MEMORY_AMO_OR:
+      old = __atomic_fetch_or(word, value, __ATOMIC_SEQ_CST);
+      break;
+    default:
+      // min/max have no host instruction, retry a compare-and-swap instead
+      old = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+      while (!__atomic_compare_exchange_n(word, &old,
+                                          amo_result(op, old, value), 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        ;
+  }
+  report_atomic(mem, addr, old, amo_result(op, old, value), 1);
+  return old;
+}
+
+int memory_cas_w(struct memory* mem, int addr, uint32_t expected,
+                 uint32_t desired) {
+  if (addr & 0x3)
+    raise_fault(MEMORY_FAULT_STORE_MISALIGNED, addr);
+  int* page = access_page(mem, addr, MEMORY_PERM_R | MEMORY_PERM_W,
+                          MEMORY_FAULT_STORE_ACCESS, 4, 0);
+  uint32_t* word = (uint32_t*)&page[(addr >> 2) & (PAGE_WORDS - 1)];
+  uint32_t  old  = expected;
+  int       done = __atomic_compare_exchange_n(
+      word, &old, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  report_atomic(mem, addr, old, desired, done);
+  return done;
+}
+
+int memory_mark(struct memory* mem) {
+  pthread_mutex_lock(&mem->lock);
+  if (!mem->journaling) {
+    // from now on, the first store to every writable page must trap
+    for (int j = 0; j < mem->num_used; ++j) {
+      uint32_t           page_number = mem->used[j];
+      struct page_table* table       = mem->tables[page_number >> L2_BITS];
+      int                index       = page_number & L2_MASK;
+      __atomic_store_n(&table->perms[index], clean_perm(table->perms[index]),
+                       __ATOMIC_RELEASE);
+    }
+    mem->journaling = 1;
+  } else {
+    // only pages written since the last mark can be plain writable
+    int start = mem->mark_start[mem->num_marks - 1];
+    for (int j = start; j < mem->num_journal; ++j) {
+      uint32_t           page_number = mem->journal[j].page_number;
+      struct page_table* table       = mem->tables[page_number >> L2_BITS];
+      int                index       = page_number & L2_MASK;
+      __atomic_store_n(&table->perms[index], clean_perm(table->perms[index]),
+                       __ATOMIC_RELEASE);
+    }
+  }
+  mem->epoch++;
+  if (mem->num_marks == mem->max_marks) {
+    mem->max_marks  = mem->max_marks ? 2 * mem->max_marks : 64;
+    mem->mark_start = realloc(mem->mark_start, mem->max_marks * sizeof(int));
+    if (mem->mark_start == NULL) {
+      printf("Out of memory for simulated page journal\n");
+      exit(-1);
+    }
+  }
+  mem->mark_start[mem->num_marks++] = mem->num_journal;
+  int mark                          = mem->first_mark + mem->num_marks - 1;
+  pthread_mutex_unlock(&mem->lock);
+  return mark;
+}
+
+void memory_rewind(struct memory* mem, int mark) {
+  pthread_mutex_lock(&mem->lock);
+  int index = mark - mem->first_mark;
+  if (index >= 0 && index < mem->num_marks) {
+    // undo newest first, so every page ends up as it was at the mark
+    int start = mem->mark_start[index];
+    for (int j = mem->num_journal - 1; j >= start; --j) {
+      struct journal_entry* entry = &mem->journal[j];
+      struct page_table*    table =
+          mem->tables[entry->page_number >> L2_BITS];
+      int page = entry->page_number & L2_MASK;
+      memcpy(table->pages[page], entry->data, MEMORY_PAGE_SIZE);
+      note_changed(mem, table, entry->page_number);
+      __atomic_store_n(&table->perms[page],
+                       watch_perm(table, page, clean_perm(entry->perm)),
+                       __ATOMIC_RELEASE);
+      pool_put_page(entry->data);
+    }
+    mem->num_journal = start;
+    mem->num_marks   = index + 1;
+    mem->epoch++;
+  }
+  pthread_mutex_unlock(&mem->lock);
+}
+
+void memory_forget_mark(struct memory* mem) {
+  pthread_mutex_lock(&mem->lock);
+  if (mem->num_marks > 1) {
+    int end = mem->mark_start[1];
+    for (int j = 0; j < end; ++j)
+      pool_put_page(mem->journal[j].data);
+    mem->num_journal -= end;
+    memmove(mem->journal, mem->journal + end,
+            mem->num_journal * sizeof(struct journal_entry));
+    for (int j = 1; j < mem->num_marks; ++j)
+      mem->mark_start[j - 1] = mem->mark_start[j] - end;
+    mem->num_marks--;
+    mem->first_mark++;
+  }
+  pthread_mutex_unlock(&mem->lock);
+}
+
+int memory_mark_wrote(struct memory* mem, int mark, unsigned int addr) {
+  uint32_t page_number = addr >> MEMORY_PAGE_BITS;
+  int      wrote       = 0;
+  pthread_mutex_lock(&mem->lock);
+  int index = mark - mem->first_mark;
+  if (index >= 0 && index < mem->num_marks) {
+    int end = index + 1 < mem->num_marks ? mem->mark_start[index + 1]
+                                         : mem->num_journal;
+    for (int j = mem->mark_start[index]; j < end && !wrote; ++j)
+      wrote = mem->journal[j].page_number == page_number;
+  }
+  pthread_mutex_unlock(&mem->lock);
+  return wrote;
+}
+
+int memory_journal_pages(struct memory* mem) {
+  return mem->num_journal;
+}
+
+void memory_set_watch_handler(struct memory* mem, memory_watch_fn fn,
+                              void* arg) {
+  mem->watch_fn  = fn;
+  mem->watch_arg = arg;
+}
+
+// Recompute which kinds of access to the pages of [addr, addr + size) must
+// leave the fast path
+static void update_watch(struct memory* mem, uint32_t addr, uint32_t size) {
+  uint32_t first = addr >> MEMORY_PAGE_BITS;
+  uint32_t last  = (addr + size - 1) >> MEMORY_PAGE_BITS;
+  for (uint32_t page_number = first; page_number <= last; ++page_number) {
+    get_page(mem, page_number << MEMORY_PAGE_BITS);
+    uint32_t page_start = page_number << MEMORY_PAGE_BITS;
+    uint32_t page_end   = page_start + (MEMORY_PAGE_SIZE - 1);
+    int      watch      = 0;
+    for (int j = 0; j < mem->num_watchpoints; ++j) {
+      struct watchpoint* watchpoint = &mem->watchpoints[j];
+      if (watchpoint->kind && watchpoint->addr <= page_end &&
+          page_start <= watchpoint->addr + (watchpoint->size - 1))
+        watch |= watchpoint->kind;
+    }
+    struct page_table* table = mem->tables[page_number >> L2_BITS];
+    int                index = page_number & L2_MASK;
+    pthread_mutex_lock(&mem->lock);
+    table->watch[index] = watch;
+    __atomic_store_n(&table->perms[index],
+                     watch_perm(table, index,
+                                unwatched_perm(table->perms[index])),
+                     __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mem->lock);
+  }
+}
+
+int memory_watch(struct memory* mem, unsigned int addr, unsigned int size,
+                 int kind) {
+  if (size == 0 || addr + (size - 1) < addr)
+    return -1;
+  if (mem->num_watchpoints == mem->max_watchpoints) {
+    mem->max_watchpoints = mem->max_watchpoints ? 2 * mem->max_watchpoints : 8;
+    mem->watchpoints     = realloc(
+        mem->watchpoints, mem->max_watchpoints * sizeof(*mem->watchpoints));
+    if (mem->watchpoints == NULL) {
+      printf("Out of memory for watchpoints\n");
+      exit(-1);
+    }
+  }
+  int watchpoint               = mem->num_watchpoints++;
+  mem->watchpoints[watchpoint] = (struct watchpoint){
+      .addr = addr, .size = size, .kind = kind & MEMORY_WATCH_ACCESS};
+  update_watch(mem, addr, size);
+  return watchpoint;
+}
+
+void memory_unwatch(struct memory* mem, int watchpoint) {
+  if (watchpoint < 0 || watchpoint >= mem->num_watchpoints ||
+      mem->watchpoints[watchpoint].kind == 0)
+    return;
+  mem->watchpoints[watchpoint].kind = 0;
+  update_watch(mem, mem->watchpoints[watchpoint].addr,
+               mem->watchpoints[watchpoint].size);
+}
+
+void memory_track_dirty(struct memory* mem) {
+  pthread_mutex_lock(&mem->lock);
+  if (!mem->tracking_changes) {
+    // from now on, the first store to every writable page must trap
+    for (int j = 0; j < mem->num_used; ++j) {
+      uint32_t           page_number = mem->used[j];
+      struct page_table* table       = mem->tables[page_number >> L2_BITS];
+      int                index       = page_number & L2_MASK;
+      __atomic_store_n(&table->perms[index], clean_perm(table->perms[index]),
+                       __ATOMIC_RELEASE);
+    }
+    mem->tracking_changes = 1;
+  }
+  pthread_mutex_unlock(&mem->lock);
+}
+
+int memory_page_dirty(struct memory* mem, unsigned int addr) {
+  uint32_t           page_number = addr >> MEMORY_PAGE_BITS;
+  struct page_table* table       = lookup_table(mem, page_number);
+  return table && table->changed[page_number & L2_MASK];
+}
+
+int memory_for_each_dirty_page(struct memory* mem, memory_page_fn fn,
+                               void* arg) {
+  pthread_mutex_lock(&mem->lock);
+  qsort(mem->changed, mem->num_changed, sizeof(uint32_t),
+        compare_page_numbers);
+  for (int j = 0; j < mem->num_changed; ++j) {
+    uint32_t           page_number = mem->changed[j];
+    struct page_table* table       = mem->tables[page_number >> L2_BITS];
+    fn(arg, page_number << MEMORY_PAGE_BITS,
+       table->pages[page_number & L2_MASK],
+       public_perm(table->perms[page_number & L2_MASK]));
+  }
+  pthread_mutex_unlock(&mem->lock);
+  return mem->num_changed;
+}
+
+void memory_clear_dirty(struct memory* mem) {
+  pthread_mutex_lock(&mem->lock);
+  // only pages written since the last clear can be plain writable
+  for (int j = 0; j < mem->num_changed; ++j) {
+    uint32_t           page_number = mem->changed[j];
+    struct page_table* table       = mem->tables[page_number >> L2_BITS];
+    int                index       = page_number & L2_MASK;
+    table->changed[index]          = 0;
+    __atomic_store_n(&table->perms[index], clean_perm(table->perms[index]),
+                     __ATOMIC_RELEASE);
+  }
+  mem->num_changed = 0;
+  pthread_mutex_unlock(&mem->lock);
+}
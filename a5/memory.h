@@ -1,8 +1,44 @@
 #ifndef __MEMORY_H__
 #define __MEMORY_H__
 
+#include <setjmp.h>
+#include <stdint.h>
+
 struct memory;
 
+// størrelse af en lagerside: 2^MEMORY_PAGE_BITS bytes, fra 4 KiB (12) op til
+// 64 KiB (16). Kan vælges ved oversættelse med -DMEMORY_PAGE_BITS=n
+#ifndef MEMORY_PAGE_BITS
+#define MEMORY_PAGE_BITS 12
+#endif
+#if MEMORY_PAGE_BITS < 12 || MEMORY_PAGE_BITS > 16
+#error "MEMORY_PAGE_BITS must be between 12 and 16"
+#endif
+#define MEMORY_PAGE_SIZE (1 << MEMORY_PAGE_BITS)
+
+// rettigheder for en side. Nye sider må læses og skrives, men ikke udføres
+#define MEMORY_PERM_R 1
+#define MEMORY_PERM_W 2
+#define MEMORY_PERM_X 4
+#define MEMORY_PERM_DEFAULT (MEMORY_PERM_R | MEMORY_PERM_W)
+
+// fejl ved lageradgang
+enum memory_fault_kind {
+  MEMORY_FAULT_NONE,
+  MEMORY_FAULT_FETCH_MISALIGNED,
+  MEMORY_FAULT_FETCH_ACCESS,
+  MEMORY_FAULT_LOAD_MISALIGNED,
+  MEMORY_FAULT_LOAD_ACCESS,
+  MEMORY_FAULT_STORE_MISALIGNED,
+  MEMORY_FAULT_STORE_ACCESS,
+};
+
+struct memory_fault {
+  int      kind; // enum memory_fault_kind
+  uint32_t addr; // adressen der blev tilgået
+  uint32_t pc;   // instruktionen der fejlede (udfyldes af simulatoren)
+};
+
 // opret/nedlæg lager
 struct memory* memory_create();
 void           memory_delete(struct memory*);
@@ -16,4 +52,121 @@ void memory_wr_b(struct memory* mem, int addr, int data);
 int memory_rd_w(struct memory* mem, int addr);
 int memory_rd_h(struct memory* mem, int addr);
 int memory_rd_b(struct memory* mem, int addr);
+
+// skriv/læs size bytes fra addr og frem, uden krav til justering. Til
+// vektorinstruktioner, der flytter hele registre
+void memory_wr_block(struct memory* mem, int addr, const void* data,
+                     unsigned int size);
+void memory_rd_block(struct memory* mem, int addr, void* data,
+                     unsigned int size);
+
+// atomare operationer (RV32A). memory_amo_w returnerer den gamle værdi,
+// memory_cas_w skriver desired hvis lageret indeholder expected og
+// returnerer 1 hvis det lykkedes
+enum memory_amo_op {
+  MEMORY_AMO_SWAP,
+  MEMORY_AMO_ADD,
+  MEMORY_AMO_XOR,
+  MEMORY_AMO_AND,
+  MEMORY_AMO_OR,
+  MEMORY_AMO_MIN,
+  MEMORY_AMO_MAX,
+  MEMORY_AMO_MINU,
+  MEMORY_AMO_MAXU,
+};
+uint32_t memory_amo_w(struct memory* mem, int addr, int op, uint32_t value);
+int      memory_cas_w(struct memory* mem, int addr, uint32_t expected,
+                      uint32_t desired);
+
+// hent instruktion - siden skal være udførbar. memory_fetch_h henter en
+// halv, til komprimerede instruktioner (RV32C)
+int memory_fetch_w(struct memory* mem, int addr);
+int memory_fetch_h(struct memory* mem, int addr);
+
+// den udførbare side med addr, så instruktioner kan hentes uden et kald
+// hver. Siden flytter sig ikke, men pointeren må kun bruges så længe ingen
+// ændrer sidens rettigheder, f.eks. inden for ét simulate_run
+const int* memory_code_page(struct memory* mem, int addr);
+
+// Fejl rapporteres ved at udfylde *fault og lave longjmp til handler. Hver
+// tråd har sin egen handler. Uden handler udskrives fejlen og programmet
+// afsluttes.
+void memory_set_fault_handler(struct memory* mem, jmp_buf* handler,
+                              struct memory_fault* fault);
+const char* memory_fault_name(int kind);
+
+// sæt/læs rettigheder for siderne der dækker [addr, addr + size)
+void memory_set_perm(struct memory* mem, unsigned int addr, unsigned int size,
+                     int perm);
+int  memory_get_perm(struct memory* mem, unsigned int addr);
+
+// hent siden der indeholder addr (allokeres hvis den ikke findes). Skrivning
+// gennem pointeren registreres ikke af memory_restore
+int* memory_page(struct memory* mem, int addr);
+// som memory_page, men NULL hvis siden ikke findes (intet allokeres)
+int* memory_find_page(struct memory* mem, unsigned int addr);
+
+// besøg alle allokerede sider i stigende adresseorden
+typedef void (*memory_page_fn)(void* arg, unsigned int page_addr, int* data,
+                               int perm);
+void memory_for_each_page(struct memory* mem, memory_page_fn fn, void* arg);
+
+// Øjebliksbillede til hurtig nulstilling af lageret. memory_snapshot gemmer
+// alle sider, og memory_restore kopierer kun de sider tilbage der er skrevet
+// til eller har fået nye rettigheder siden. Sider oprettet efter snapshottet
+// nulstilles. Returnerer antal gendannede sider. Ingen hart må køre imens.
+void memory_snapshot(struct memory* mem);
+int  memory_restore(struct memory* mem);
+
+// Historik til baglæns kørsel. memory_mark sætter et mærke og returnerer dets
+// nummer; første skrivning til en side efter et mærke gemmer sidens indhold
+// fra før i en journal. memory_rewind sætter lageret tilbage til et mærke og
+// fjerner de senere mærker. memory_forget_mark frigiver det ældste mærke.
+// memory_mark_wrote fortæller om siden med addr er skrevet mellem mærket og
+// det næste. Ingen hart må køre imens.
+int  memory_mark(struct memory* mem);
+void memory_rewind(struct memory* mem, int mark);
+void memory_forget_mark(struct memory* mem);
+int  memory_mark_wrote(struct memory* mem, int mark, unsigned int addr);
+int  memory_journal_pages(struct memory* mem); // sider i journalen
+
+// Sporing af beskidte sider, til inkrementelle checkpoints, hurtig
+// nulstilling og opdagelse af selvmodificerende kode. Efter
+// memory_track_dirty er alle sider rene; første skrivning til en ren side
+// (eller nye rettigheder) tager den langsomme vej og gør den beskidt, senere
+// skrivninger koster intet ekstra. Granulariteten er MEMORY_PAGE_SIZE.
+// memory_for_each_dirty_page besøger de beskidte sider i stigende
+// adresseorden og returnerer antallet, memory_clear_dirty gør alle rene igen.
+// Ingen hart må køre under memory_for_each_dirty_page og memory_clear_dirty.
+void memory_track_dirty(struct memory* mem);
+int  memory_page_dirty(struct memory* mem, unsigned int addr);
+int  memory_for_each_dirty_page(struct memory* mem, memory_page_fn fn,
+                                void* arg);
+void memory_clear_dirty(struct memory* mem);
+
+// Overvågning af lageradgang (watchpoints). Sider med et watchpoint tager
+// den langsomme vej for den overvågede slags adgang, så resten af lageret
+// kører med fuld fart. For hver læsning eller skrivning der rammer et
+// watchpoint kaldes fn fra den tråd der laver adgangen; skrivninger inden
+// lageret ændres. memory_watch returnerer watchpointets nummer eller -1.
+// Ingen hart må køre imens watchpoints sættes eller fjernes.
+#define MEMORY_WATCH_READ 1
+#define MEMORY_WATCH_WRITE 2
+#define MEMORY_WATCH_ACCESS (MEMORY_WATCH_READ | MEMORY_WATCH_WRITE)
+
+struct memory_watch_hit {
+  int      watchpoint; // nummer fra memory_watch
+  int      kind;       // MEMORY_WATCH_READ eller MEMORY_WATCH_WRITE
+  uint32_t addr;       // adressen der blev tilgået
+  int      size;       // antal bytes
+  uint32_t old_value;  // indhold før adgangen (højst de første 4 bytes)
+  uint32_t new_value;  // indhold efter adgangen (højst de første 4 bytes)
+};
+
+typedef void (*memory_watch_fn)(void* arg, const struct memory_watch_hit* hit);
+void memory_set_watch_handler(struct memory* mem, memory_watch_fn fn,
+                              void* arg);
+int  memory_watch(struct memory* mem, unsigned int addr, unsigned int size,
+                  int kind);
+void memory_unwatch(struct memory* mem, int watchpoint);
 #endif
\ No newline at end of file
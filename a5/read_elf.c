@@ -6,12 +6,30 @@
 #include <stdlib.h>
 #include <string.h>
 
-int read_elf(struct memory* mem, struct program_info* info,
-             const char* filename, FILE* log_file) {
+// A parsed ELF file: its loadable segments and where the program starts
+struct elf_image {
+  struct program_info info;
+  Elf32_Phdr*         segments;     // PT_LOAD program headers
+  unsigned char**     segment_data; // file contents of each segment
+  int                 num_segments;
+  struct symbols*     symbols;
+};
+
+void elf_image_delete(struct elf_image* image) {
+  for (int i = 0; i < image->num_segments; i++)
+    free(image->segment_data[i]);
+  free(image->segment_data);
+  free(image->segments);
+  if (image->symbols)
+    symbols_delete(image->symbols);
+  free(image);
+}
+
+static struct elf_image* read_segments(const char* filename, FILE* log_file) {
   FILE* file = fopen(filename, "rb");
   if (!file) {
-    fprintf(log_file, "Error opening file");
-    return -1;
+    fprintf(log_file, "Error opening file %s\n", filename);
+    return NULL;
   }
 
   // Read the ELF header
@@ -21,23 +39,34 @@ int read_elf(struct memory* mem, struct program_info* info,
     fprintf(log_file,
             "Elf file error, file shorter than minimal header size.\n");
     fclose(file);
-    return -1;
+    return NULL;
   }
 
   // Check for ELF magic number
   if (memcmp(elf_header.e_ident, ELFMAG, SELFMAG) != 0) {
     fprintf(log_file, "Not a valid ELF file.\n");
     fclose(file);
-    return -1;
+    return NULL;
+  }
+
+  struct elf_image* image = calloc(sizeof(struct elf_image), 1);
+  if (image) {
+    image->segments     = malloc(elf_header.e_phnum * sizeof(Elf32_Phdr));
+    image->segment_data = calloc(elf_header.e_phnum, sizeof(unsigned char*));
+  }
+  if (!image || !image->segments || !image->segment_data) {
+    fprintf(log_file, "Error allocating memory for segment\n");
+    if (image)
+      elf_image_delete(image);
+    fclose(file);
+    return NULL;
   }
 
   // Seek to the program header table and read program headers
-  info->text_start = 0;
-  info->text_end   = 0;
-  info->start      = elf_header.e_entry;
-  // printf("Program headers starting at offset %d\n", elf_header.e_phoff);
-  // printf("Program entry point address: 0x%x\n", info->start);
-  // printf("Text offset 0x%x\n\n", info->text_start);
+  struct program_info* info = &image->info;
+  info->text_start          = 0;
+  info->text_end            = 0;
+  info->start               = elf_header.e_entry;
   Elf32_Phdr program_header;
   for (int i = 0; i < elf_header.e_phnum; i++) {
     fseek(file, elf_header.e_phoff + i * sizeof(Elf32_Phdr), SEEK_SET);
@@ -45,14 +74,13 @@ int read_elf(struct memory* mem, struct program_info* info,
     if (stat != sizeof(Elf32_Phdr)) {
       fprintf(log_file,
               "Elf file error, file shorter than minimal prog header size.\n");
+      elf_image_delete(image);
       fclose(file);
-      return -1;
+      return NULL;
     }
 
     // Check for loadable segments (PT_LOAD)
     if (program_header.p_type == PT_LOAD) {
-      // const char *segment_type = NULL;
-
       // Identify segment type
       if (program_header.p_flags & PF_X) {
         // segment_type = "Executable (.text)";
@@ -61,24 +89,18 @@ int read_elf(struct memory* mem, struct program_info* info,
             (unsigned int)(sizeof(Elf32_Ehdr) +
                            elf_header.e_phnum * sizeof(Elf32_Phdr));
         info->text_end = program_header.p_vaddr + program_header.p_filesz;
-      } else if (program_header.p_flags & PF_W) {
-        // segment_type = "Writable (static data)";
-      } else {
-        // segment_type = "Read-only (e.g., .rodata)";
       }
 
-      // printf("Found %s segment at offset 0x%x, size 0x%x, in-memory address
-      // 0x%x\n",
-      //       segment_type, program_header.p_offset, program_header.p_filesz,
-      //       program_header.p_vaddr);
-
       // Allocate buffer for the segment
       unsigned char* segment_data = malloc(program_header.p_filesz);
       if (!segment_data) {
         fprintf(log_file, "Error allocating memory for segment\n");
+        elf_image_delete(image);
         fclose(file);
-        return -1;
+        return NULL;
       }
+      image->segments[image->num_segments]       = program_header;
+      image->segment_data[image->num_segments++] = segment_data;
 
       // Read the segment data
       fseek(file, program_header.p_offset, SEEK_SET);
@@ -86,30 +108,82 @@ int read_elf(struct memory* mem, struct program_info* info,
       if (stat != program_header.p_filesz) {
         fprintf(log_file, "Error reading segment - failed to read entire "
                           "segment in one go\n");
-        return -1;
+        elf_image_delete(image);
+        fclose(file);
+        return NULL;
       }
+    }
+  }
+  fclose(file);
+  return image;
+}
 
-      // Process the segment data (e.g., print or analyze)
-      // printf("All bytes of %s segment:\n", segment_type);
-      for (unsigned int j = 0; j < program_header.p_filesz; j++) {
-        // printf("%02x ", segment_data[j]);
-        memory_wr_b(mem, program_header.p_vaddr + j, segment_data[j]);
-      }
-      /*
-      printf("\n\nDisassembly\n");
-      for (unsigned int j = info->text_start; j < program_header.p_filesz; j +=
-      4) { unsigned int addr = program_header.p_vaddr + j; int inst =
-      memory_rd_w(mem, addr); const int buf_sz = 64; char buf[buf_sz];
-          decode_rv32i(addr, inst, buf, buf_sz);
-          // printf("%6x %8x   %s\n", j, inst, buf);
+struct elf_image* elf_image_read(const char* file_name, FILE* log_file) {
+  struct elf_image* image = read_segments(file_name, log_file);
+  if (image == NULL)
+    return NULL;
+  image->symbols = symbols_read_from_elf(file_name);
+  if (image->symbols == NULL) {
+    elf_image_delete(image);
+    return NULL;
+  }
+  return image;
+}
+
+struct symbols* elf_image_symbols(const struct elf_image* image) {
+  return image->symbols;
+}
+
+void elf_image_load(const struct elf_image* image, struct memory* mem,
+                    struct program_info* info) {
+  // Copy the segments a page at a time
+  for (int i = 0; i < image->num_segments; i++) {
+    unsigned int addr = image->segments[i].p_vaddr;
+    unsigned int done = 0;
+    while (done < image->segments[i].p_filesz) {
+      unsigned int offset = (addr + done) & (MEMORY_PAGE_SIZE - 1);
+      unsigned int chunk  = MEMORY_PAGE_SIZE - offset;
+      if (chunk > image->segments[i].p_filesz - done)
+        chunk = image->segments[i].p_filesz - done;
+      char* page = (char*)memory_page(mem, addr + done);
+      memcpy(page + offset, image->segment_data[i] + done, chunk);
+      done += chunk;
+    }
+  }
+
+  // Protect the loaded pages as the segments ask for. This is done after all
+  // segments are written, and a page shared by two segments gets the
+  // permissions of both.
+  const Elf32_Phdr* loaded = image->segments;
+  for (int i = 0; i < image->num_segments; i++) {
+    unsigned int first = loaded[i].p_vaddr & ~(MEMORY_PAGE_SIZE - 1);
+    unsigned int end   = loaded[i].p_vaddr + loaded[i].p_memsz;
+    for (unsigned int page = first; page < end; page += MEMORY_PAGE_SIZE) {
+      int perm = 0;
+      for (int j = 0; j < image->num_segments; j++) {
+        unsigned int seg_start = loaded[j].p_vaddr;
+        unsigned int seg_end   = seg_start + loaded[j].p_memsz;
+        if (seg_start < page + MEMORY_PAGE_SIZE && page < seg_end) {
+          perm |= (loaded[j].p_flags & PF_R) ? MEMORY_PERM_R : 0;
+          perm |= (loaded[j].p_flags & PF_W) ? MEMORY_PERM_W : 0;
+          perm |= (loaded[j].p_flags & PF_X) ? MEMORY_PERM_X : 0;
+        }
       }
-      printf("\n");
-      */
-      free(segment_data);
+      memory_set_perm(mem, page, MEMORY_PAGE_SIZE, perm);
+      if (page + MEMORY_PAGE_SIZE < page)
+        break; // segment reaches the top of the address space
     }
   }
-  // adjust program info to virtual addresses instead of file offsets
-  fclose(file);
+  *info = image->info;
+}
+
+int read_elf(struct memory* mem, struct program_info* info,
+             const char* filename, FILE* log_file) {
+  struct elf_image* image = read_segments(filename, log_file);
+  if (image == NULL)
+    return -1;
+  elf_image_load(image, mem, info);
+  elf_image_delete(image);
   return 0;
 }
 
@@ -225,4 +299,78 @@ const char* symbols_value_to_sym(struct symbols* symbols, unsigned int value) {
     }
   }
   return NULL;
-}
\ No newline at end of file
+}
+
+const char* symbols_function_at(struct symbols* symbols, unsigned int value,
+                                unsigned int* offset) {
+  Elf32_Sym* best = NULL;
+  for (int i = 0; i < symbols->num_symbols; i++) {
+    Elf32_Sym* symbol = &symbols->symbols[i];
+    if (ELF32_ST_TYPE(symbol->st_info) != STT_FUNC ||
+        symbol->st_value > value)
+      continue;
+    if (symbol->st_size && value - symbol->st_value >= symbol->st_size)
+      continue;
+    if (best == NULL || symbol->st_value > best->st_value)
+      best = symbol;
+  }
+  if (best == NULL)
+    return NULL;
+  if (offset)
+    *offset = value - best->st_value;
+  return &symbols->strtab[best->st_name];
+}
+
+// the preferred symbol comes first when several have the same value
+static int label_rank(const Elf32_Sym* symbol) {
+  return (ELF32_ST_TYPE(symbol->st_info) != STT_FUNC) * 2 +
+         (ELF32_ST_BIND(symbol->st_info) == STB_LOCAL);
+}
+
+static int compare_labels(const void* a, const void* b) {
+  const Elf32_Sym* x = *(const Elf32_Sym* const*)a;
+  const Elf32_Sym* y = *(const Elf32_Sym* const*)b;
+  if (x->st_value != y->st_value)
+    return x->st_value < y->st_value ? -1 : 1;
+  return label_rank(x) - label_rank(y);
+}
+
+int symbols_labels(struct symbols* symbols, unsigned int start,
+                   unsigned int end, struct symbol_label** labels) {
+  Elf32_Sym** found = malloc((symbols->num_symbols + 1) * sizeof(Elf32_Sym*));
+  int         num_found = 0;
+  *labels               = NULL;
+  if (!found)
+    return 0;
+  for (int i = 0; i < symbols->num_symbols; i++) {
+    Elf32_Sym*  symbol = &symbols->symbols[i];
+    const char* name   = &symbols->strtab[symbol->st_name];
+    int         type   = ELF32_ST_TYPE(symbol->st_info);
+    // leave out the assembler's local labels and RISC-V mapping symbols
+    if (symbol->st_value < start || symbol->st_value >= end ||
+        (type != STT_FUNC && type != STT_NOTYPE) || symbol->st_shndx == 0 ||
+        name[0] == '\0' || name[0] == '$' || !strncmp(name, ".L", 2))
+      continue;
+    found[num_found++] = symbol;
+  }
+  qsort(found, num_found, sizeof(Elf32_Sym*), compare_labels);
+
+  *labels        = malloc((num_found + 1) * sizeof(struct symbol_label));
+  int num_labels = 0;
+  for (int i = 0; *labels && i < num_found; i++) {
+    if (num_labels > 0 && (*labels)[num_labels - 1].value == found[i]->st_value)
+      continue;
+    (*labels)[num_labels].value = found[i]->st_value;
+    (*labels)[num_labels].size  = found[i]->st_size;
+    (*labels)[num_labels].name  = &symbols->strtab[found[i]->st_name];
+    num_labels++;
+  }
+  free(found);
+  return num_labels;
+}
+
+void symbols_delete(struct symbols* symbols) {
+  free(symbols->strtab);
+  free(symbols->symbols);
+  free(symbols);
+}
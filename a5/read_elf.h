@@ -17,6 +17,22 @@ int read_elf(struct memory* mem, struct program_info* info,
 
 struct symbols;
 
+// An ELF file parsed once and loaded into any number of memories. The image
+// is only read while loading, so threads may share it.
+struct elf_image;
+
+// read segments and symbols of an ELF file (NULL on error)
+struct elf_image* elf_image_read(const char* file_name, FILE* log_file);
+
+// copy the image into memory and set page permissions, fill in program info
+void elf_image_load(const struct elf_image* image, struct memory* mem,
+                    struct program_info* info);
+
+// symbol table of the image, owned by the image
+struct symbols* elf_image_symbols(const struct elf_image* image);
+
+void elf_image_delete(struct elf_image* image);
+
 // read symbol table from elf file
 struct symbols* symbols_read_from_elf(const char* file_name);
 
@@ -26,4 +42,23 @@ void symbols_delete(struct symbols* symbols);
 // map a value to a symbol (return NULL if no matching symbol found)
 const char* symbols_value_to_sym(struct symbols* symbols, unsigned int value);
 
+// map a value to the function containing it (or the nearest before it, for
+// functions of unknown size), with value's offset into it in *offset
+// (return NULL if there is no such function)
+const char* symbols_function_at(struct symbols* symbols, unsigned int value,
+                                unsigned int* offset);
+
+// a symbol as a label in a disassembly
+struct symbol_label {
+  unsigned int value;
+  unsigned int size; // 0 if unknown
+  const char*  name;
+};
+
+// the named code symbols in [start, end), sorted by value with one per value
+// (functions before other symbols, globals before locals). Returns the number
+// of labels, the array in *labels is to be freed by the caller
+int symbols_labels(struct symbols* symbols, unsigned int start,
+                   unsigned int end, struct symbol_label** labels);
+
 #endif
\ No newline at end of file
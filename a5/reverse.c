@@ -0,0 +1,253 @@
+#define _DEFAULT_SOURCE // clock_gettime
+#include "reverse.h"
+#include "compressed.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct snapshot {
+  struct cpu_state state;
+  int              mark;      // memory_mark() taken with it
+  long int         input_pos; // inputs consumed by the guest so far
+};
+
+struct reverse {
+  struct sim*      sim;
+  FILE*            in;
+  FILE*            out;
+  double           max_latency;
+  long int         interval;      // instructions between snapshots
+  double           snapshot_time; // host time of the last snapshot
+  struct snapshot* snapshots;     // oldest first
+  int              num_snapshots;
+  int              max_snapshots;
+  int*             inputs; // every getchar result so far, EOF included
+  long int         num_inputs;
+  long int         max_inputs;
+  long int         input_pos;  // next input the guest will consume
+  long int         high_water; // furthest the guest has run, output up to
+                               // here has already been printed
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void take_snapshot(struct reverse* rev) {
+  struct cpu_state* state = sim_state(rev->sim);
+  struct memory*    mem   = sim_memory(rev->sim);
+
+  // re-executing one interval should take about max_latency
+  double current = now();
+  if (rev->num_snapshots > 0) {
+    long int done =
+        state->insns - rev->snapshots[rev->num_snapshots - 1].state.insns;
+    double elapsed = current - rev->snapshot_time;
+    if (done > 0 && elapsed > 0) {
+      rev->interval = done / elapsed * rev->max_latency;
+      if (rev->interval < REVERSE_MIN_INTERVAL)
+        rev->interval = REVERSE_MIN_INTERVAL;
+    }
+  }
+  rev->snapshot_time = current;
+
+  if (rev->num_snapshots == rev->max_snapshots) {
+    rev->max_snapshots = rev->max_snapshots ? 2 * rev->max_snapshots : 64;
+    rev->snapshots     = realloc(rev->snapshots,
+                                 rev->max_snapshots * sizeof(struct snapshot));
+    if (rev->snapshots == NULL) {
+      fprintf(stderr, "Error allocating snapshots\n");
+      exit(-1);
+    }
+  }
+  struct snapshot* snapshot = &rev->snapshots[rev->num_snapshots++];
+  snapshot->state           = *state;
+  snapshot->mark            = memory_mark(mem);
+  snapshot->input_pos       = rev->input_pos;
+
+  // keep the saved pages within bounds by giving up the oldest snapshots
+  while (memory_journal_pages(mem) > REVERSE_MAX_PAGES &&
+         rev->num_snapshots > 1) {
+    memory_forget_mark(mem);
+    rev->num_snapshots--;
+    memmove(rev->snapshots, rev->snapshots + 1,
+            rev->num_snapshots * sizeof(struct snapshot));
+  }
+}
+
+static void restore_snapshot(struct reverse* rev, int index) {
+  struct snapshot* snapshot = &rev->snapshots[index];
+  memory_rewind(sim_memory(rev->sim), snapshot->mark);
+  *sim_state(rev->sim) = snapshot->state;
+  rev->input_pos       = snapshot->input_pos;
+  rev->num_snapshots   = index + 1;
+  rev->snapshot_time   = now();
+}
+
+// getchar and putchar are serviced here so re-executing repeats them
+static int handle_ecall(struct reverse* rev) {
+  struct cpu_state* state     = sim_state(rev->sim);
+  uint32_t*         registers = state->registers;
+  if (registers[17] == 1) { // getchar
+    int c;
+    if (rev->input_pos < rev->num_inputs) {
+      c = rev->inputs[rev->input_pos];
+    } else {
+      c = fgetc(rev->in);
+      if (rev->num_inputs == rev->max_inputs) {
+        rev->max_inputs = rev->max_inputs ? 2 * rev->max_inputs : 256;
+        rev->inputs = realloc(rev->inputs, rev->max_inputs * sizeof(int));
+        if (rev->inputs == NULL) {
+          fprintf(stderr, "Error allocating input log\n");
+          exit(-1);
+        }
+      }
+      rev->inputs[rev->num_inputs++] = c;
+    }
+    rev->input_pos++;
+    if (c == EOF)
+      registers[17] = 93; // 93 == exit
+    else
+      registers[10] = c;
+  } else if (registers[17] == 2) { // putchar
+    if (state->insns >= rev->high_water) {
+      fputc((char)registers[10], rev->out);
+      fflush(rev->out);
+    }
+  } else {
+    return sim_handle_ecall(rev->sim);
+  }
+  state->pc += 4;
+  state->insns++;
+  return SIM_STOPPED;
+}
+
+// Run until stop_at instructions (<= 0: no limit), the guest exits or faults
+static int forward(struct reverse* rev, long int stop_at, int snapshots) {
+  struct cpu_state* state = sim_state(rev->sim);
+  while (stop_at <= 0 || state->insns < stop_at) {
+    long int until = stop_at;
+    if (snapshots) {
+      long int next =
+          rev->snapshots[rev->num_snapshots - 1].state.insns + rev->interval;
+      if (state->insns >= next) {
+        take_snapshot(rev);
+        next = state->insns + rev->interval;
+      }
+      if (until <= 0 || next < until)
+        until = next;
+    }
+    int result = sim_run(rev->sim, until > 0 ? until - state->insns : 0);
+    if (state->insns > rev->high_water)
+      rev->high_water = state->insns;
+    if (result == SIM_ECALL)
+      result = handle_ecall(rev);
+    if (state->insns > rev->high_water)
+      rev->high_water = state->insns;
+    if (result != SIM_STOPPED)
+      return result;
+  }
+  return SIM_STOPPED;
+}
+
+// Can the halfword at addr be read as code without faulting?
+static int fetchable(struct memory* mem, uint32_t addr) {
+  int perm = memory_get_perm(mem, addr);
+  return (addr & 1) == 0 && (perm & MEMORY_PERM_R) && (perm & MEMORY_PERM_X);
+}
+
+// did the interval after mark write any page overlapping [addr, addr + size)
+static int range_written(struct memory* mem, int mark, uint32_t addr,
+                         uint32_t size) {
+  uint32_t last = (addr + size - 1) >> MEMORY_PAGE_BITS;
+  for (uint32_t page = addr >> MEMORY_PAGE_BITS; page <= last; ++page) {
+    if (memory_mark_wrote(mem, mark, page << MEMORY_PAGE_BITS))
+      return 1;
+  }
+  return 0;
+}
+
+struct reverse* reverse_create(struct sim* sim, FILE* in, FILE* out,
+                               double max_latency) {
+  struct reverse* rev = calloc(sizeof(struct reverse), 1);
+  if (rev == NULL)
+    return NULL;
+  rev->sim         = sim;
+  rev->in          = in;
+  rev->out         = out;
+  rev->max_latency = max_latency;
+  rev->interval    = REVERSE_MIN_INTERVAL;
+  rev->high_water  = sim_state(sim)->insns;
+  take_snapshot(rev);
+  return rev;
+}
+
+void reverse_delete(struct reverse* rev) {
+  free(rev->snapshots);
+  free(rev->inputs);
+  free(rev);
+}
+
+int reverse_run(struct reverse* rev, long int max_insns) {
+  long int insns = sim_state(rev->sim)->insns;
+  return forward(rev, max_insns > 0 ? insns + max_insns : 0, 1);
+}
+
+int reverse_goto(struct reverse* rev, long int insns) {
+  struct cpu_state* state = sim_state(rev->sim);
+  if (insns < state->insns) {
+    int index = rev->num_snapshots - 1;
+    while (index > 0 && rev->snapshots[index].state.insns > insns)
+      index--;
+    if (rev->snapshots[index].state.insns > insns)
+      return -1; // older than we remember
+    restore_snapshot(rev, index);
+  }
+  if (insns == state->insns)
+    return SIM_STOPPED;
+  return forward(rev, insns, 1);
+}
+
+long int reverse_last_write(struct reverse* rev, uint32_t addr,
+                            uint32_t size) {
+  struct cpu_state* state = sim_state(rev->sim);
+  struct memory*    mem   = sim_memory(rev->sim);
+  long int          start = state->insns;
+  long int          end   = start;
+  for (int index = rev->num_snapshots - 1; index >= 0; --index) {
+    struct snapshot* snapshot = &rev->snapshots[index];
+    long int         begin    = snapshot->state.insns;
+    // the journal tells which intervals wrote the page(s) at all, only those
+    // are single stepped looking for the store
+    if (range_written(mem, snapshot->mark, addr, size)) {
+      restore_snapshot(rev, index);
+      long int found = -1;
+      while (state->insns < end) {
+        uint32_t store_addr;
+        int      store_size = 0;
+        if (fetchable(mem, state->pc)) {
+          uint32_t instruction = memory_rd_h(mem, state->pc);
+          if (instruction_length(instruction) == 4 &&
+              fetchable(mem, state->pc + 2))
+            instruction |= (uint32_t)memory_rd_h(mem, state->pc + 2) << 16;
+          store_size = simulate_store_size(state, instruction, &store_addr);
+        }
+        if (store_size && store_addr < addr + size &&
+            addr < store_addr + store_size)
+          found = state->insns;
+        if (forward(rev, state->insns + 1, 0) != SIM_STOPPED)
+          break;
+      }
+      if (found >= 0) {
+        reverse_goto(rev, found);
+        return found;
+      }
+    }
+    end = begin;
+  }
+  reverse_goto(rev, start);
+  return -1;
+}
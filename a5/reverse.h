@@ -0,0 +1,46 @@
+#ifndef __REVERSE_H__
+#define __REVERSE_H__
+
+#include "sim.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Reverse execution of a single hart guest. While running forward, the guest
+// is snapshotted every so often: registers, plus a memory mark so only pages
+// written since are saved (see memory_mark). Going back restores the nearest
+// earlier snapshot and re-executes forward to the wanted point. Getchar
+// results are remembered, and fed back when re-executing, and output already
+// produced is not printed again, so the guest sees exactly the same run.
+//
+// The snapshot interval adapts to the measured simulation speed, so going
+// back never re-executes for much longer than max_latency seconds. Old
+// snapshots are dropped once their saved pages exceed REVERSE_MAX_PAGES.
+#define REVERSE_LATENCY 0.1
+#define REVERSE_MAX_PAGES 16384
+#define REVERSE_MIN_INTERVAL 10000
+
+struct reverse;
+
+// start recording the guest from its current state, with in/out as terminal
+struct reverse* reverse_create(struct sim* sim, FILE* in, FILE* out,
+                               double max_latency);
+void            reverse_delete(struct reverse* rev);
+
+// Run forward like sim_run_program, until the guest exits, faults or
+// max_insns more instructions have executed (<= 0: no limit)
+int reverse_run(struct reverse* rev, long int max_insns);
+
+// Move the guest to the point where insns instructions have executed, back
+// or forward. Returns SIM_STOPPED when it got there, -1 if that is before
+// the oldest snapshot, else why the guest stopped on the way.
+int reverse_goto(struct reverse* rev, long int insns);
+
+// Move back to the last instruction before the current point that wrote to
+// any byte of [addr, addr + size), stopped before executing it. Returns its
+// instruction count, or -1 (leaving the guest where it was) if there is none
+// as far back as snapshots go. size must be positive and the range must not
+// wrap.
+long int reverse_last_write(struct reverse* rev, uint32_t addr, uint32_t size);
+
+#endif
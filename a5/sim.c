@@ -0,0 +1,424 @@
+#include "sim.h"
+#include "checkpoint.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HART_STACK_SIZE 0x100000
+#define HART_SLICE 0x100000 // instructions between checks for a stop request
+#define INPUT_LOG_HEADER "rvsim-input-log 1"
+
+// Harts of one sim_run_harts() call
+struct hart_group {
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  int             num_harts;
+  int             running;    // harts that have not stopped yet
+  int             waiting;    // harts waiting at the barrier
+  unsigned int    generation; // bumped every time the barrier opens
+  int             stop;       // set when a hart faults
+};
+
+struct sim {
+  struct memory*      mem;
+  struct cpu_state    state;
+  struct cpu_state    snapshot; // state saved by sim_snapshot
+  struct symbols*     symbols;
+  struct program_info info;
+  FILE*               in;
+  FILE*               out;
+  FILE*               log_file;
+  struct hart_group*  group;      // NULL unless running on several harts
+  FILE*               record_log; // log of guest input being recorded
+  FILE*               replay_log; // log of guest input being replayed
+  int                 owns_symbols;
+  FILE*               watch_out; // where watchpoint hits are reported
+};
+
+struct sim* sim_create(void) {
+  struct sim* sim = calloc(sizeof(struct sim), 1);
+  if (sim == NULL)
+    return NULL;
+  sim->mem = memory_create();
+  sim->in  = stdin;
+  sim->out = stdout;
+  simulate_init(); // outside the caller's timing of the first run
+  return sim;
+}
+
+void sim_delete(struct sim* sim) {
+  if (sim->owns_symbols)
+    symbols_delete(sim->symbols);
+  memory_delete(sim->mem);
+  free(sim);
+}
+
+int sim_load_elf(struct sim* sim, const char* file_name) {
+  FILE* errors = sim->log_file ? sim->log_file : stderr;
+  if (read_elf(sim->mem, &sim->info, file_name, errors))
+    return -1;
+  sim->symbols = symbols_read_from_elf(file_name);
+  if (sim->symbols == NULL)
+    return -1;
+  sim->owns_symbols = 1;
+  sim->state.pc     = sim->info.start;
+  return 0;
+}
+
+void sim_load_image(struct sim* sim, const struct elf_image* image) {
+  elf_image_load(image, sim->mem, &sim->info);
+  sim->symbols  = elf_image_symbols(image);
+  sim->state.pc = sim->info.start;
+}
+
+void sim_set_args(struct sim* sim, int argc, char* argv[]) {
+  unsigned count_addr = 0x1000000;
+  unsigned argv_addr  = 0x1000004;
+  unsigned str_addr   = argv_addr + 4 * argc;
+  memory_wr_w(sim->mem, count_addr, argc);
+  for (int index = 0; index < argc; ++index) {
+    memory_wr_w(sim->mem, argv_addr + 4 * index, str_addr);
+    char* cp = argv[index];
+    int   c;
+    do {
+      c = *cp++;
+      memory_wr_b(sim->mem, str_addr++, c);
+    } while (c);
+  }
+}
+
+void sim_set_io(struct sim* sim, FILE* in, FILE* out) {
+  sim->in  = in;
+  sim->out = out;
+}
+
+void sim_set_log(struct sim* sim, FILE* log_file) {
+  sim->log_file = log_file;
+}
+
+int sim_run(struct sim* sim, long int max_insns) {
+  long int stop_at = max_insns > 0 ? sim->state.insns + max_insns : 0;
+  return simulate_run(sim->mem, &sim->state, stop_at, sim->log_file,
+                      sim->symbols);
+}
+
+int sim_step(struct sim* sim) {
+  return sim_run(sim, 1);
+}
+
+static void hart_barrier(struct hart_group* group) {
+  pthread_mutex_lock(&group->lock);
+  unsigned int generation = group->generation;
+  if (++group->waiting == group->running) {
+    group->generation++;
+    group->waiting = 0;
+    pthread_cond_broadcast(&group->cond);
+  } else {
+    while (generation == group->generation && !group->stop)
+      pthread_cond_wait(&group->cond, &group->lock);
+  }
+  pthread_mutex_unlock(&group->lock);
+}
+
+static void hart_leave(struct hart_group* group, int result) {
+  pthread_mutex_lock(&group->lock);
+  group->running--;
+  if (result == SIM_FAULT)
+    __atomic_store_n(&group->stop, 1, __ATOMIC_RELAXED);
+  // the barrier may now be complete without us
+  if (group->waiting > 0 && group->waiting == group->running) {
+    group->generation++;
+    group->waiting = 0;
+  }
+  pthread_cond_broadcast(&group->cond);
+  pthread_mutex_unlock(&group->lock);
+}
+
+int sim_record_input(struct sim* sim, FILE* log) {
+  if (fprintf(log, "%s\n", INPUT_LOG_HEADER) < 0)
+    return -1;
+  sim->record_log = log;
+  return 0;
+}
+
+int sim_replay_input(struct sim* sim, FILE* log) {
+  char header[64];
+  if (!fgets(header, sizeof(header), log) ||
+      strcmp(header, INPUT_LOG_HEADER "\n") != 0)
+    return -1;
+  sim->replay_log = log;
+  return 0;
+}
+
+// Next input from the replay log, which must be a getchar at the current
+// instruction count. Events before it belong to the run up to a restored
+// checkpoint and are skipped.
+static int replay_getchar(struct sim* sim, int* c) {
+  long int at;
+  char     kind[16];
+  do {
+    if (fscanf(sim->replay_log, "%ld %15s %d", &at, kind, c) != 3)
+      return -1;
+  } while (at < sim->state.insns);
+  if (at != sim->state.insns || strcmp(kind, "getchar") != 0)
+    return -1;
+  return 0;
+}
+
+// getchar while recording or replaying, as simulate_ecall does it otherwise
+static int logged_getchar(struct sim* sim) {
+  uint32_t* registers = sim->state.registers;
+  int       c;
+  if (sim->replay_log) {
+    if (replay_getchar(sim, &c)) {
+      fprintf(stderr, "Input log does not match the run at %ld instructions\n",
+              sim->state.insns);
+      return SIM_DIVERGED;
+    }
+  } else {
+    c = fgetc(sim->in);
+  }
+  if (sim->record_log)
+    fprintf(sim->record_log, "%ld getchar %d\n", sim->state.insns,
+            c == EOF ? -1 : c);
+  if (c == EOF)
+    registers[17] = 93; // 93 == exit
+  else
+    registers[10] = c;
+  return SIM_STOPPED;
+}
+
+int sim_handle_ecall(struct sim* sim) {
+  uint32_t* registers = sim->state.registers;
+  switch (registers[17]) {
+    case 1: // getchar
+      if (!sim->record_log && !sim->replay_log)
+        return simulate_ecall(&sim->state, sim->in, sim->out);
+      if (logged_getchar(sim) == SIM_DIVERGED)
+        return SIM_DIVERGED;
+      break;
+    case SIM_ECALL_HARTID:
+      registers[10] = sim->state.hartid;
+      break;
+    case SIM_ECALL_NUM_HARTS:
+      registers[10] = sim->group ? sim->group->num_harts : 1;
+      break;
+    case SIM_ECALL_BARRIER:
+      if (sim->group)
+        hart_barrier(sim->group);
+      break;
+    default:
+      return simulate_ecall(&sim->state, sim->in, sim->out);
+  }
+  sim->state.pc += 4;
+  sim->state.insns++;
+  return SIM_STOPPED;
+}
+
+int sim_run_program(struct sim* sim, long int max_insns) {
+  long int stop_at = max_insns > 0 ? sim->state.insns + max_insns : 0;
+  while (1) {
+    long int budget = 0;
+    if (stop_at > 0) {
+      budget = stop_at - sim->state.insns;
+      if (budget <= 0)
+        return SIM_STOPPED;
+    }
+    int result = sim_run(sim, budget);
+    if (result == SIM_ECALL)
+      result = sim_handle_ecall(sim);
+    if (result != SIM_STOPPED || (stop_at > 0 && sim->state.insns >= stop_at))
+      return result;
+  }
+}
+
+struct hart_thread {
+  pthread_t   thread;
+  struct sim* hart;
+  int         result;
+};
+
+static void* hart_main(void* arg) {
+  struct hart_thread* thread = arg;
+  struct sim*         hart   = thread->hart;
+  int                 result = SIM_STOPPED;
+  while (!__atomic_load_n(&hart->group->stop, __ATOMIC_RELAXED)) {
+    result = sim_run(hart, HART_SLICE);
+    if (result == SIM_ECALL)
+      result = sim_handle_ecall(hart);
+    if (result != SIM_STOPPED)
+      break;
+  }
+  thread->result = result;
+  hart_leave(hart->group, result);
+  return NULL;
+}
+
+int sim_run_harts(struct sim* sim, int num_harts, long int* hart_insns) {
+  struct hart_group group = {.num_harts = num_harts, .running = num_harts};
+  pthread_mutex_init(&group.lock, NULL);
+  pthread_cond_init(&group.cond, NULL);
+  struct hart_thread* threads = calloc(num_harts, sizeof(struct hart_thread));
+  if (threads == NULL) {
+    fprintf(stderr, "Error allocating harts\n");
+    return SIM_FAULT;
+  }
+
+  // hart 0 is the guest itself, the others share its memory and program
+  for (int i = 0; i < num_harts; ++i) {
+    struct sim* hart = sim;
+    if (i > 0) {
+      hart = malloc(sizeof(struct sim));
+      if (hart == NULL) {
+        fprintf(stderr, "Error allocating harts\n");
+        exit(-1);
+      }
+      *hart              = *sim;
+      hart->owns_symbols = 0;
+      memset(&hart->state, 0, sizeof(hart->state));
+      hart->state.pc           = sim->state.pc;
+      hart->state.registers[2] = -(uint32_t)(i * HART_STACK_SIZE);
+      hart->state.cycle_costs  = sim->state.cycle_costs;
+    }
+    hart->group              = &group;
+    hart->state.hartid       = i;
+    hart->state.registers[4] = i;
+    threads[i].hart          = hart;
+  }
+  for (int i = 0; i < num_harts; ++i) {
+    if (pthread_create(&threads[i].thread, NULL, hart_main, &threads[i])) {
+      fprintf(stderr, "Error starting thread for hart %d\n", i);
+      exit(-1);
+    }
+  }
+
+  int result = SIM_EXITED;
+  for (int i = 0; i < num_harts; ++i) {
+    pthread_join(threads[i].thread, NULL);
+    if (threads[i].result == SIM_FAULT && result != SIM_FAULT) {
+      result           = SIM_FAULT;
+      sim->state.fault = threads[i].hart->state.fault;
+    }
+    if (hart_insns)
+      hart_insns[i] = threads[i].hart->state.insns;
+    if (i > 0)
+      free(threads[i].hart);
+  }
+  sim->group = NULL;
+  free(threads);
+  pthread_cond_destroy(&group.cond);
+  pthread_mutex_destroy(&group.lock);
+  return result;
+}
+
+uint32_t sim_get_reg(struct sim* sim, int reg) {
+  return sim->state.registers[reg];
+}
+
+void sim_set_reg(struct sim* sim, int reg, uint32_t val) {
+  if (reg != 0)
+    sim->state.registers[reg] = val;
+}
+
+uint32_t sim_get_pc(struct sim* sim) {
+  return sim->state.pc;
+}
+
+void sim_set_pc(struct sim* sim, uint32_t pc) {
+  sim->state.pc = pc;
+}
+
+long int sim_insns(struct sim* sim) {
+  return sim->state.insns;
+}
+
+struct Stat sim_stat(struct sim* sim) {
+  return (struct Stat){.insns     = sim->state.insns,
+                       .exit_code = sim->state.registers[10]};
+}
+
+const struct memory_fault* sim_fault(struct sim* sim) {
+  return &sim->state.fault;
+}
+
+struct memory* sim_memory(struct sim* sim) {
+  return sim->mem;
+}
+
+struct symbols* sim_symbols(struct sim* sim) {
+  return sim->symbols;
+}
+
+const struct program_info* sim_program_info(struct sim* sim) {
+  return &sim->info;
+}
+
+struct cpu_state* sim_state(struct sim* sim) {
+  return &sim->state;
+}
+
+void sim_set_coverage(struct sim* sim, uint8_t* coverage) {
+  sim->state.coverage      = coverage;
+  sim->state.coverage_prev = 0;
+}
+
+void sim_set_cycle_costs(struct sim* sim, struct cycle_costs* costs) {
+  sim->state.cycle_costs = costs;
+}
+
+uint64_t sim_cycles(struct sim* sim) {
+  return simulate_cycles(&sim->state);
+}
+
+static void report_watch(void* arg, const struct memory_watch_hit* hit) {
+  struct sim*  sim = arg;
+  uint32_t     pc  = sim->state.pc;
+  unsigned int offset;
+  const char*  function =
+      sim->symbols ? symbols_function_at(sim->symbols, pc, &offset) : NULL;
+  fprintf(sim->watch_out, "Watchpoint %d: %s of %d byte%s at 0x%x by "
+                          "instruction at 0x%x",
+          hit->watchpoint,
+          hit->kind == MEMORY_WATCH_WRITE ? "write" : "read", hit->size,
+          hit->size > 1 ? "s" : "", hit->addr, pc);
+  if (function)
+    fprintf(sim->watch_out, " (%s+0x%x)", function, offset);
+  if (hit->kind == MEMORY_WATCH_WRITE)
+    fprintf(sim->watch_out, ": 0x%x -> 0x%x", hit->old_value,
+            hit->new_value);
+  else
+    fprintf(sim->watch_out, ": 0x%x", hit->old_value);
+  fprintf(sim->watch_out, ", after %ld instructions\n", sim->state.insns);
+}
+
+int sim_watch(struct sim* sim, uint32_t addr, uint32_t size, int kind,
+              FILE* out) {
+  sim->watch_out = out;
+  memory_set_watch_handler(sim->mem, report_watch, sim);
+  return memory_watch(sim->mem, addr, size, kind);
+}
+
+void sim_snapshot(struct sim* sim) {
+  memory_snapshot(sim->mem);
+  sim->snapshot = sim->state;
+}
+
+void sim_restore(struct sim* sim) {
+  memory_restore(sim->mem);
+  uint8_t* coverage        = sim->state.coverage;
+  sim->state               = sim->snapshot;
+  sim->state.coverage      = coverage;
+  sim->state.coverage_prev = 0;
+}
+
+int sim_checkpoint_save(struct sim* sim, const char* file_name) {
+  return checkpoint_save(file_name, sim->mem, &sim->state);
+}
+
+int sim_checkpoint_load(struct sim* sim, const char* file_name) {
+  // the checkpoint holds the entire memory image, including program args
+  memory_delete(sim->mem);
+  sim->mem = memory_create();
+  return checkpoint_load(file_name, sim->mem, &sim->state);
+}
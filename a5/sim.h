@@ -0,0 +1,120 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+// Embeddable simulator API (libsim.a). A struct sim holds one guest: its
+// registers, pc, memory and program. Guests are independent, so a host can
+// keep many of them and time-slice between them with sim_run().
+
+#include "memory.h"
+#include "read_elf.h"
+#include "simulate.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct sim;
+
+// create/delete a guest with empty memory
+struct sim* sim_create(void);
+void        sim_delete(struct sim* sim);
+
+// load an ELF file and its symbols, and set pc to its entry point
+int sim_load_elf(struct sim* sim, const char* file_name);
+
+// load an already parsed ELF file, which must outlive the guest
+void sim_load_image(struct sim* sim, const struct elf_image* image);
+
+// place program arguments in guest memory (argc at 0x1000000, argv after)
+void sim_set_args(struct sim* sim, int argc, char* argv[]);
+
+// terminal used by sim_handle_ecall (default stdin/stdout) and the
+// instruction trace (default none)
+void sim_set_io(struct sim* sim, FILE* in, FILE* out);
+void sim_set_log(struct sim* sim, FILE* log_file);
+
+// Run at most max_insns instructions (max_insns <= 0: no limit). Returns
+// SIM_STOPPED when the budget is used up, SIM_ECALL when the guest makes a
+// system call and SIM_BREAK at an ebreak (pc is left at the instruction in
+// both cases), and SIM_FAULT on a memory fault. A guest stopped for any of
+// these reasons can be resumed with sim_run().
+int sim_run(struct sim* sim, long int max_insns);
+
+// execute a single instruction, same results as sim_run
+int sim_step(struct sim* sim);
+
+// Perform the pending system call with the default services (getchar,
+// putchar, exit). Returns SIM_EXITED if the guest exited, SIM_DIVERGED if a
+// replayed input does not match, else SIM_STOPPED.
+int sim_handle_ecall(struct sim* sim);
+
+// Record guest input to log, or feed it from a log made by an earlier run
+// instead of reading the terminal. The log is text, one line per input
+// (currently only getchar) giving the instruction count it happened at, so
+// a replayed run reproduces the recorded one exactly. A replay may start
+// from a checkpoint of the recorded run; earlier inputs are skipped. If the
+// run asks for input the log does not have at that point,
+// sim_handle_ecall returns SIM_DIVERGED.
+int sim_record_input(struct sim* sim, FILE* log);
+int sim_replay_input(struct sim* sim, FILE* log);
+
+// Run servicing system calls with sim_handle_ecall until the guest exits,
+// faults or max_insns more instructions have executed (<= 0: no limit)
+int sim_run_program(struct sim* sim, long int max_insns);
+
+// System calls (number in a7) for programs running on several harts. With a
+// single hart they behave as if it was the only one.
+#define SIM_ECALL_HARTID 10    // a0 = id of the calling hart
+#define SIM_ECALL_NUM_HARTS 11 // a0 = number of harts
+#define SIM_ECALL_BARRIER 12   // wait until all running harts get here
+
+// Run the loaded program on num_harts harts sharing the guest's memory, each
+// on its own host thread. All harts start at the entry point with tp (x4)
+// holding the hart id; hart i gets its stack 1 MiB * i below the top of
+// memory. A hart stops when it calls exit, and the run ends when all have
+// stopped, or as soon as one of them faults (the fault is then available
+// through sim_fault). hart_insns, if not NULL, receives the instruction count
+// of each hart.
+int sim_run_harts(struct sim* sim, int num_harts, long int* hart_insns);
+
+// instruction count and exit code (a0) of a guest that has exited
+struct Stat sim_stat(struct sim* sim);
+
+// guest state
+uint32_t                   sim_get_reg(struct sim* sim, int reg);
+void                       sim_set_reg(struct sim* sim, int reg, uint32_t val);
+uint32_t                   sim_get_pc(struct sim* sim);
+void                       sim_set_pc(struct sim* sim, uint32_t pc);
+long int                   sim_insns(struct sim* sim);
+const struct memory_fault* sim_fault(struct sim* sim);
+struct memory*             sim_memory(struct sim* sim);
+struct symbols*            sim_symbols(struct sim* sim);
+const struct program_info* sim_program_info(struct sim* sim);
+struct cpu_state*          sim_state(struct sim* sim);
+
+// Record edge coverage in a SIMULATE_COVERAGE_SIZE byte bitmap (NULL: off)
+void sim_set_coverage(struct sim* sim, uint8_t* coverage);
+
+// Count cycles with the given timing model (NULL: one per instruction), as
+// seen by the guest through the cycle and time CSRs. sim_cycles gives the
+// count so far.
+void     sim_set_cycle_costs(struct sim* sim, struct cycle_costs* costs);
+uint64_t sim_cycles(struct sim* sim);
+
+// Report every access of the given kind (MEMORY_WATCH_*) to [addr, addr +
+// size) on out, with the instruction and function making it and the old and
+// new contents. Only accesses to the watched pages are slowed down. Single
+// hart only. Returns the watchpoint number, or -1 for an invalid range.
+int sim_watch(struct sim* sim, uint32_t addr, uint32_t size, int kind,
+              FILE* out);
+
+// Remember the current guest state in memory. sim_restore goes back to it,
+// copying back only the pages written since, so it is cheap enough to call
+// before every run of a fuzzer. The coverage bitmap is not part of the state.
+void sim_snapshot(struct sim* sim);
+void sim_restore(struct sim* sim);
+
+// save/restore registers, pc, instruction count and memory
+int sim_checkpoint_save(struct sim* sim, const char* file_name);
+int sim_checkpoint_load(struct sim* sim, const char* file_name);
+
+#endif
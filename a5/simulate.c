@@ -1,407 +1,811 @@
 #include "simulate.h"
+#include "compressed.h"
+#include "decode.h"
+#include "fpu.h"
 #include "tools.h"
+#include "vector.h"
 
+#include <pthread.h>
+#include <setjmp.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// sign_extend32 & extractBits in "tools.h"
-
 struct Stat simulate(struct memory* mem, int start_addr, FILE* log_file,
                      struct symbols* symbols) {
+  struct cpu_state state = {.pc = start_addr};
+  if (simulate_state(mem, &state, 0, log_file, symbols) == SIM_FAULT) {
+    printf("%s at %x (pc %x)\n", memory_fault_name(state.fault.kind),
+           state.fault.addr, state.fault.pc);
+    exit(-1);
+  }
+  // return number of instructions executed and the exit code
+  return (struct Stat){.insns     = state.insns,
+                       .exit_code = state.registers[10]};
+}
+
+// Every 16-bit instruction expanded once, up front, so compressed code runs
+// as fast as plain 32-bit code
+static uint32_t       expanded[1 << 16];
+static pthread_once_t expanded_once = PTHREAD_ONCE_INIT;
+
+static void expand_all(void) {
+  for (uint32_t instruction = 0; instruction < (1 << 16); ++instruction) {
+    if (instruction_length(instruction) == 2)
+      expanded[instruction] = compressed_expand(instruction);
+  }
+}
+
+// Compiles to a single host rotate
+static inline uint32_t rotate_left(uint32_t value, uint32_t amount) {
+  amount &= 31;
+  return (value << amount) | (value >> (-amount & 31));
+}
+
+struct cycle_costs simulate_default_costs = {
+    .load = 1, .mul = 2, .div = 33, .jump = 2, .fp = 3};
+
+// CSRs
+#define CSR_FFLAGS 0x001
+#define CSR_FRM 0x002
+#define CSR_FCSR 0x003
+#define CSR_CYCLE 0xc00
+#define CSR_TIME 0xc01
+#define CSR_INSTRET 0xc02
+#define CSR_CYCLEH 0xc80
+#define CSR_TIMEH 0xc81
+#define CSR_INSTRETH 0xc82
+
+// read a CSR into *value, 0 if there is no such CSR
+static int csr_read(const struct cpu_state* state, uint32_t csr,
+                    uint32_t* value) {
+  switch (csr) {
+    case CSR_FFLAGS:
+      *value = state->fcsr & FPU_FFLAGS_MASK;
+      return 1;
+    case CSR_FRM:
+      *value = state->fcsr >> FPU_FRM_SHIFT;
+      return 1;
+    case CSR_FCSR:
+      *value = state->fcsr;
+      return 1;
+    case CSR_CYCLE:
+    case CSR_TIME:
+      *value = simulate_cycles(state);
+      return 1;
+    case CSR_CYCLEH:
+    case CSR_TIMEH:
+      *value = simulate_cycles(state) >> 32;
+      return 1;
+    case CSR_INSTRET:
+      *value = state->insns;
+      return 1;
+    case CSR_INSTRETH:
+      *value = (uint64_t)state->insns >> 32;
+      return 1;
+  }
+  return 0;
+}
 
-  (void)symbols;                       // remove warning
-  uint32_t registers[32] = {0};        // registers
-  uint32_t program_count = start_addr; // Start simulation from entry point
-  uint32_t instruction;                // Current instruction
-  uint32_t insns = 0;                  // Number of instructions executed
-
-  while (1) {
-    // fetch instruction
-    instruction = memory_rd_w(mem, program_count);
-
-    uint32_t opcode, rd, funct3, rs1, rs2, funct7, funct12;
-    int32_t  i_imm, s_imm, u_imm, jal_imm, b_imm;
-
-    opcode  = extractBits(instruction, 6, 0);
-    rd      = extractBits(instruction, 11, 7);
-    funct3  = extractBits(instruction, 14, 12);
-    rs1     = extractBits(instruction, 19, 15);
-    rs2     = extractBits(instruction, 24, 20);
-    funct7  = extractBits(instruction, 31, 25);
-    funct12 = extractBits(instruction, 31, 20);
-
-    // Immediate fields
-    i_imm = extractBits(instruction, 31, 20);
-    i_imm = sign_extend32(i_imm, 12);
-
-    s_imm = (extractBits(instruction, 11, 7) |
-             (extractBits(instruction, 31, 25) << 5));
-    s_imm = sign_extend32(s_imm, 12);
-
-    u_imm = extractBits(instruction, 31, 12);
-    u_imm = sign_extend32(u_imm, 20);
-
-    jal_imm = (extractBits(instruction, 19, 12) << 12) |
-              (extractBits(instruction, 20, 20) << 11) |
-              (extractBits(instruction, 30, 21) << 1) |
-              (extractBits(instruction, 31, 31) << 20);
-    jal_imm = sign_extend32(jal_imm, 21);
-
-    b_imm = (extractBits(instruction, 31, 31) << 12) |
-            (extractBits(instruction, 7, 7) << 11) |
-            (extractBits(instruction, 30, 25) << 5) |
-            (extractBits(instruction, 11, 8) << 1);
-    b_imm = sign_extend32(b_imm, 13);
+// CSRs whose two top address bits are set are read-only
+static int csr_writable(uint32_t csr) {
+  return (csr >> 10) != 0b11;
+}
+
+// write a CSR that csr_read knows and that is writable
+static void csr_write(struct cpu_state* state, uint32_t csr, uint32_t value) {
+  switch (csr) {
+    case CSR_FFLAGS:
+      state->fcsr = (state->fcsr & ~FPU_FFLAGS_MASK) |
+                    (value & FPU_FFLAGS_MASK);
+      break;
+    case CSR_FRM:
+      state->fcsr = (state->fcsr & FPU_FFLAGS_MASK) |
+                    ((value << FPU_FRM_SHIFT) & FPU_FCSR_MASK);
+      break;
+    case CSR_FCSR:
+      state->fcsr = value & FPU_FCSR_MASK;
+      break;
+  }
+}
+
+// the memory_amo_w operation of each AMO
+static const int amo_ops[INSN_COUNT] = {
+    [INSN_AMOSWAP_W] = MEMORY_AMO_SWAP, [INSN_AMOADD_W] = MEMORY_AMO_ADD,
+    [INSN_AMOXOR_W] = MEMORY_AMO_XOR,   [INSN_AMOAND_W] = MEMORY_AMO_AND,
+    [INSN_AMOOR_W] = MEMORY_AMO_OR,     [INSN_AMOMIN_W] = MEMORY_AMO_MIN,
+    [INSN_AMOMAX_W] = MEMORY_AMO_MAX,   [INSN_AMOMINU_W] = MEMORY_AMO_MINU,
+    [INSN_AMOMAXU_W] = MEMORY_AMO_MAXU,
+};
+
+// whether the branch instruction is taken with the given operands
+static inline int branch_taken(uint32_t instruction, uint32_t a, uint32_t b) {
+  switch (insn_funct3(instruction)) {
+    case 0b000: // BEQ
+      return a == b;
+    case 0b001: // BNE
+      return a != b;
+    case 0b100: // BLT
+      return (int32_t)a < (int32_t)b;
+    case 0b101: // BGE
+      return (int32_t)a >= (int32_t)b;
+    case 0b110: // BLTU
+      return a < b;
+    default: // BGEU
+      return a >= b;
+  }
+}
+
+// Superinstructions: pairs compilers emit often, lui + addi (li), auipc +
+// jalr (call), slli + add (indexing) and addi or add + a branch (compare and
+// branch), run in one go. The first sets what it can be fused with, and if
+// the next instruction is that, the loop executes it right away instead of
+// going round to fetch, decode and dispatch it. The second is executed
+// exactly as it would be on its own, so the two need not be dependent.
+enum fusion { FUSE_NONE, FUSE_ADDI, FUSE_ADD, FUSE_JALR, FUSE_BRANCH };
+
+static inline int matches(uint32_t instruction, enum insn insn) {
+  return (instruction & decode_info[insn].mask) == decode_info[insn].match;
+}
+
+// BEQ, BNE, BLT, BGE, BLTU or BGEU
+static inline int is_branch(uint32_t instruction) {
+  return (instruction & 0x7f) == 0b1100011 &&
+         (instruction & 0x6000) != 0x2000;
+}
+
+// The 4 bytes at offset in a page from memory_code_page: an instruction,
+// or a compressed one and half the next
+static inline uint32_t read_code(const int* code, uint32_t offset) {
+  uint32_t word;
+  memcpy(&word, (const char*)code + offset, 4);
+  return word;
+}
+
+// Count the edge from the previous jump target to this one
+static inline void cover_edge(struct cpu_state* state, uint32_t target) {
+  uint32_t location = ((target >> 1) * 0x9e3779b1u) >>
+                      (32 - SIMULATE_COVERAGE_BITS);
+  state->coverage[location ^ state->coverage_prev]++;
+  state->coverage_prev = location >> 1;
+}
+
+static int run(struct memory* mem, struct cpu_state* state, long int stop_at,
+               FILE* log_file, struct symbols* symbols) {
+
+  (void)symbols;                              // remove warning
+  uint32_t* registers     = state->registers; // registers
+  uint32_t  program_count = state->pc;        // Resume from saved pc
+  uint32_t  instruction;                      // Current instruction
+  long int  insns  = state->insns;            // Instructions executed so far
+  int       result = SIM_STOPPED;
+
+  // the optional timing model, see simulate.h
+  struct cycle_costs* costs = state->cycle_costs;
+
+  // the page instructions are read from directly, see read_code. 1 as its
+  // address means none
+  const int* code      = NULL;
+  uint32_t   code_base = 1;
+
+  while (stop_at <= 0 || insns < stop_at) {
+    state->pc    = program_count;
+    state->insns = insns;
+
+    // fetch instruction. A compressed one is expanded by table lookup and
+    // from then on runs like its 32-bit equivalent, only its length differs.
+    // Only instructions that are misaligned or cross into the next page go
+    // through memory_fetch_*
+    uint32_t length = 4;
+    uint32_t offset = program_count & (MEMORY_PAGE_SIZE - 1);
+    if (!(program_count & 1) && offset <= MEMORY_PAGE_SIZE - 4) {
+      if (program_count - offset != code_base) {
+        code      = memory_code_page(mem, program_count);
+        code_base = program_count - offset;
+      }
+      instruction = read_code(code, offset);
+    } else if (program_count & 2) {
+      instruction = memory_fetch_h(mem, program_count);
+      if (instruction_length(instruction) == 4)
+        instruction |= (uint32_t)memory_fetch_h(mem, program_count + 2) << 16;
+    } else {
+      instruction = memory_fetch_w(mem, program_count);
+    }
+    uint32_t encoding = instruction;
+    if (instruction_length(instruction) == 2) {
+      instruction = expanded[instruction & 0xffff];
+      length      = 2;
+    }
 
     // writes each excuted instruction to log file
     if (log_file) {
       fprintf(log_file, "PC: 0x%08x: Instruction:  0x%08x\n", program_count,
-              instruction);
+              encoding);
     }
 
-    // check for R-type
-    if (opcode == 0b0110011) {
-      // ADD
-      if (funct3 == 0b000 && funct7 == 0b0000000) {
+    // the immediates are decoded by the instructions that have them
+    uint32_t rd  = insn_rd(instruction);
+    uint32_t rs1 = insn_rs1(instruction);
+    uint32_t rs2 = insn_rs2(instruction);
+
+    // Instructions that do not simply go on to the next one continue the
+    // loop themselves, the others break out of the switch
+    enum insn   insn   = decode(instruction);
+    enum fusion fusion = FUSE_NONE;
+    switch (insn) {
+      // RV32I
+      case INSN_LUI:
+        if (rd != 0) {
+          registers[rd] = insn_u_imm(instruction);
+        }
+        fusion = FUSE_ADDI;
+        break;
+      case INSN_AUIPC:
+        if (rd != 0) { // Avoid writing to x0
+          registers[rd] = program_count + insn_u_imm(instruction);
+        }
+        fusion = FUSE_JALR;
+        break;
+      case INSN_JAL:
+        if (rd != 0) {
+          registers[rd] = program_count + length;
+        }
+        program_count += insn_j_imm(instruction);
+        insns++;
+        if (costs)
+          state->stall_cycles += costs->jump;
+        if (state->coverage)
+          cover_edge(state, program_count);
+        continue;
+      case INSN_JALR: {
+        uint32_t target = (registers[rs1] + insn_i_imm(instruction)) & ~1;
+        if (rd != 0) {
+          registers[rd] = program_count + length;
+        }
+        program_count = target;
+        insns++;
+        if (costs)
+          state->stall_cycles += costs->jump;
+        if (state->coverage)
+          cover_edge(state, program_count);
+        continue;
+      }
+      case INSN_BEQ:
+      case INSN_BNE:
+      case INSN_BLT:
+      case INSN_BGE:
+      case INSN_BLTU:
+      case INSN_BGEU: {
+        int taken = branch_taken(instruction, registers[rs1], registers[rs2]);
+        program_count += taken ? insn_b_imm(instruction) : (int32_t)length;
+        insns++;
+        if (costs && taken)
+          state->stall_cycles += costs->jump;
+        if (state->coverage)
+          cover_edge(state, program_count);
+        continue;
+      }
+      case INSN_LB:
+        registers[rd] = (int8_t)memory_rd_b(
+            mem, registers[rs1] + insn_i_imm(instruction));
+        if (costs)
+          state->stall_cycles += costs->load;
+        break;
+      case INSN_LH:
+        registers[rd] = (int16_t)memory_rd_h(
+            mem, registers[rs1] + insn_i_imm(instruction));
+        if (costs)
+          state->stall_cycles += costs->load;
+        break;
+      case INSN_LW:
+        registers[rd] =
+            memory_rd_w(mem, registers[rs1] + insn_i_imm(instruction));
+        if (costs)
+          state->stall_cycles += costs->load;
+        break;
+      case INSN_LBU:
+        registers[rd] = (uint8_t)memory_rd_b(
+            mem, registers[rs1] + insn_i_imm(instruction));
+        if (costs)
+          state->stall_cycles += costs->load;
+        break;
+      case INSN_LHU:
+        registers[rd] = (uint16_t)memory_rd_h(
+            mem, registers[rs1] + insn_i_imm(instruction));
+        if (costs)
+          state->stall_cycles += costs->load;
+        break;
+      case INSN_SB:
+        memory_wr_b(mem, registers[rs1] + insn_s_imm(instruction),
+                    registers[rs2] & 0xFF);
+        break;
+      case INSN_SH:
+        memory_wr_h(mem, registers[rs1] + insn_s_imm(instruction),
+                    registers[rs2] & 0xFFFF);
+        break;
+      case INSN_SW:
+        memory_wr_w(mem, registers[rs1] + insn_s_imm(instruction),
+                    registers[rs2]);
+        break;
+      case INSN_ADDI:
+        registers[rd] = registers[rs1] + insn_i_imm(instruction);
+        fusion        = FUSE_BRANCH;
+        break;
+      case INSN_SLTI:
+        registers[rd] = (int32_t)registers[rs1] < insn_i_imm(instruction);
+        break;
+      case INSN_SLTIU:
+        registers[rd] = registers[rs1] < (uint32_t)insn_i_imm(instruction);
+        break;
+      case INSN_XORI:
+        registers[rd] = registers[rs1] ^ insn_i_imm(instruction);
+        break;
+      case INSN_ORI:
+        registers[rd] = registers[rs1] | insn_i_imm(instruction);
+        break;
+      case INSN_ANDI:
+        registers[rd] = registers[rs1] & insn_i_imm(instruction);
+        break;
+      case INSN_SLLI:
+        registers[rd] = registers[rs1] << (rs2 & 00011111);
+        fusion        = FUSE_ADD;
+        break;
+      case INSN_SRLI:
+        registers[rd] = registers[rs1] >> (rs2 & 00011111);
+        break;
+      case INSN_SRAI:
+        registers[rd] = (int32_t)registers[rs1] >> (rs2 & 00011111);
+        break;
+      case INSN_ADD:
         registers[rd] = registers[rs1] + registers[rs2];
-      }
-      // SUB
-      else if (funct3 == 0b000 && funct7 == 0b0100000) {
+        fusion        = FUSE_BRANCH;
+        break;
+      case INSN_SUB:
         registers[rd] = registers[rs1] - registers[rs2];
-      }
-      // SLL
-      else if (funct3 == 0b001 && funct7 == 0b0000000) {
+        break;
+      case INSN_SLL:
         registers[rd] = registers[rs1] << registers[rs2];
-      }
-      // SLT
-      else if (funct3 == 0b010 && funct7 == 0b0000000) {
-        if (registers[rs1] < registers[rs2]) {
-          registers[rd] = 1;
-        } else {
-          registers[rd] = 0;
-        }
-      }
-      // SLTU
-      else if (funct3 == 0b011 && funct7 == 0b0000000) {
-        if ((uint32_t)registers[rs1] < (uint32_t)registers[rs2]) {
-          registers[rd] = 1;
-        } else {
-          registers[rd] = 0;
-        }
-      }
-      // XOR
-      else if (funct3 == 0b100 && funct7 == 0b0000000) {
+        break;
+      case INSN_SLT:
+        registers[rd] = registers[rs1] < registers[rs2];
+        break;
+      case INSN_SLTU:
+        registers[rd] = registers[rs1] < registers[rs2];
+        break;
+      case INSN_XOR:
         registers[rd] = registers[rs1] ^ registers[rs2];
-      }
-      // SRL
-      else if (funct3 == 0b101 && funct7 == 0b0000000) {
-        registers[rd] =
-            (uint32_t)registers[rs1] >> (registers[rs2] & 0b000111111);
-      }
-      // SRA
-      else if (funct3 == 0b101 && funct7 == 0b0100000) {
+        break;
+      case INSN_SRL:
+        registers[rd] = registers[rs1] >> (registers[rs2] & 0b000111111);
+        break;
+      case INSN_SRA:
         registers[rd] = (int32_t)registers[rs1] >> registers[rs2];
-      }
-      // OR
-      else if (funct3 == 0b110 && funct7 == 0b0000000) {
+        break;
+      case INSN_OR:
         registers[rd] = registers[rs1] | registers[rs2];
-      }
-      // AND
-      else if (funct3 == 0b111 && funct7 == 0b0000000) {
+        break;
+      case INSN_AND:
         registers[rd] = registers[rs1] & registers[rs2];
-      } else if (funct7 == 0b0000001) {
-        // MUL
-        if (funct3 == 0b000) {
-          registers[rd] = registers[rs1] * registers[rs2];
-        }
-        // MULH
-        else if (funct3 == 0b001) {
-          int64_t result = (int64_t)(int32_t)registers[rs1] *
-                           (int64_t)(int32_t)registers[rs2];
-          registers[rd] = (int32_t)(result >> 32);
+        break;
+
+      // system calls are serviced by the caller
+      case INSN_ECALL:
+        result = SIM_ECALL;
+        goto stop;
+      // EBREAK, also used by debuggers to plant breakpoints
+      case INSN_EBREAK:
+        result = SIM_BREAK;
+        goto stop;
+
+      // Zicsr: CSRRW, CSRRS, CSRRC and their immediate forms. Set and clear
+      // with x0 (or 0) do not write, so they can read the counters.
+      case INSN_CSRRW:
+      case INSN_CSRRS:
+      case INSN_CSRRC:
+      case INSN_CSRRWI:
+      case INSN_CSRRSI:
+      case INSN_CSRRCI: {
+        uint32_t funct3  = insn_funct3(instruction);
+        uint32_t csr     = extractBits(instruction, 31, 20);
+        uint32_t operand = (funct3 & 0b100) ? rs1 : registers[rs1];
+        int      writes  = (funct3 & 0b011) == 0b001 || rs1 != 0;
+        uint32_t value;
+        if (!csr_read(state, csr, &value)) {
+          fprintf(stderr, "ERROR: Unknown CSR 0x%x\n", csr);
+        } else if (writes && !csr_writable(csr)) {
+          fprintf(stderr, "ERROR: CSR 0x%x is read-only\n", csr);
+        } else {
+          if ((funct3 & 0b011) == 0b001)
+            csr_write(state, csr, operand);
+          else if (writes && (funct3 & 0b011) == 0b010)
+            csr_write(state, csr, value | operand);
+          else if (writes)
+            csr_write(state, csr, value & ~operand);
+          if (rd != 0) {
+            registers[rd] = value;
+          }
         }
-        // MULHSU
-        else if (funct3 == 0b010) {
-          int64_t result =
-              (int64_t)(int32_t)registers[rs1] * (uint64_t)registers[rs2];
-          registers[rd] = (int32_t)(result >> 32);
+        break;
+      }
+
+      // RV32M
+      case INSN_MUL:
+        registers[rd] = registers[rs1] * registers[rs2];
+        if (costs)
+          state->stall_cycles += costs->mul;
+        break;
+      case INSN_MULH:
+        registers[rd] = ((int64_t)(int32_t)registers[rs1] *
+                         (int64_t)(int32_t)registers[rs2]) >>
+                        32;
+        if (costs)
+          state->stall_cycles += costs->mul;
+        break;
+      case INSN_MULHSU:
+        registers[rd] =
+            ((int64_t)(int32_t)registers[rs1] * (uint64_t)registers[rs2]) >>
+            32;
+        if (costs)
+          state->stall_cycles += costs->mul;
+        break;
+      case INSN_MULHU:
+        registers[rd] = ((uint64_t)registers[rs1] * registers[rs2]) >> 32;
+        if (costs)
+          state->stall_cycles += costs->mul;
+        break;
+      case INSN_DIV:
+        if (registers[rs2] == 0) { // Division by zero
+          registers[rd] = -1;      // Quotient for signed division by zero
+        } else if ((int32_t)registers[rs1] == INT32_MIN &&
+                   (int32_t)registers[rs2] == -1) {
+          registers[rd] = registers[rs1]; // Quotient equals the dividend
+        } else {
+          registers[rd] = (int32_t)registers[rs1] / (int32_t)registers[rs2];
         }
-        // MULHU
-        else if (funct3 == 0b011) {
-          uint64_t result = (uint64_t)registers[rs1] * (uint64_t)registers[rs2];
-          registers[rd]   = (uint32_t)(result >> 32);
+        if (costs)
+          state->stall_cycles += costs->div;
+        break;
+      case INSN_DIVU:
+        if (registers[rs2] == 0) {
+          registers[rd] = UINT32_MAX;
+        } else {
+          registers[rd] = registers[rs1] / registers[rs2];
         }
-        // DIV
-        else if (funct3 == 0b100) {
-          if (registers[rs2] == 0) { // Division by zero
-            registers[rd] = -1;      // Quotient for signed division by zero
-          } else if ((int32_t)registers[rs1] == INT32_MIN &&
-                     (int32_t)registers[rs2] == -1) {
-            registers[rd] = registers[rs1]; // Quotient equals the dividend
-          } else {
-            registers[rd] = (int32_t)registers[rs1] / (int32_t)registers[rs2];
-          }
+        if (costs)
+          state->stall_cycles += costs->div;
+        break;
+      case INSN_REM:
+        if (registers[rs2] == 0) {
+          registers[rd] = registers[rs1];
+        } else if ((int32_t)registers[rs1] == INT32_MIN &&
+                   (int32_t)registers[rs2] == -1) {
+          registers[rd] = 0;
+        } else {
+          registers[rd] = (int32_t)registers[rs1] % (int32_t)registers[rs2];
         }
-        // DIVU
-        else if (funct3 == 0b101) {
-          if (registers[rs2] == 0) {
-            registers[rd] = UINT32_MAX;
-          } else {
-            registers[rd] = (uint32_t)registers[rs1] / (uint32_t)registers[rs2];
-          }
+        if (costs)
+          state->stall_cycles += costs->div;
+        break;
+      case INSN_REMU:
+        if (registers[rs2] == 0) {
+          registers[rd] = registers[rs1];
+        } else {
+          registers[rd] = registers[rs1] % registers[rs2];
         }
-        // REM
-        else if (funct3 == 0b110) {
-          if (registers[rs2] == 0) {
-            registers[rd] = registers[rs1];
-          } else if ((int32_t)registers[rs1] == INT32_MIN &&
-                     (int32_t)registers[rs2] == -1) {
-            registers[rd] = 0;
-          } else {
-            registers[rd] = (int32_t)registers[rs1] % (int32_t)registers[rs2];
-          }
+        if (costs)
+          state->stall_cycles += costs->div;
+        break;
+
+      // RV32A, always sequentially consistent on the host
+      case INSN_LR_W: {
+        uint32_t address         = registers[rs1];
+        uint32_t value           = memory_rd_w(mem, address);
+        state->reservation       = address;
+        state->reservation_value = value;
+        state->reservation_valid = 1;
+        if (rd != 0) {
+          registers[rd] = value;
         }
-        // REMU
-        else if (funct3 == 0b111) {
-          if (registers[rs2] == 0) {
-            registers[rd] = registers[rs1];
-          } else {
-            registers[rd] = (uint32_t)registers[rs1] % (uint32_t)registers[rs2];
-          }
-        } else {
-          fprintf(stderr,
-                  "unknown R-type: (opcode=0xx%d, funct3=%d, funct7=%d)\n",
-                  opcode, funct3, funct7);
+        if (costs)
+          state->stall_cycles += costs->load;
+        break;
+      }
+      // SC.W - succeeds if the reserved word still holds the loaded value
+      case INSN_SC_W: {
+        uint32_t address = registers[rs1];
+        uint32_t failed  = 1;
+        if (state->reservation_valid && state->reservation == address &&
+            memory_cas_w(mem, address, state->reservation_value,
+                         registers[rs2]))
+          failed = 0;
+        state->reservation_valid = 0;
+        if (rd != 0) {
+          registers[rd] = failed;
         }
-      } else {
-        fprintf(stderr, "unknown extension R-type\n");
+        if (costs)
+          state->stall_cycles += costs->load;
+        break;
       }
-      program_count += 4;
-      insns++;
-    }
-
-    // check for I-type
-    // JALR
-    else if (opcode == 0b1100111) {
-      uint32_t target = (registers[rs1] + i_imm) & ~1;
-      if (rd != 0) {
-        registers[rd] = program_count + 4;
+      case INSN_AMOSWAP_W:
+      case INSN_AMOADD_W:
+      case INSN_AMOXOR_W:
+      case INSN_AMOAND_W:
+      case INSN_AMOOR_W:
+      case INSN_AMOMIN_W:
+      case INSN_AMOMAX_W:
+      case INSN_AMOMINU_W:
+      case INSN_AMOMAXU_W: {
+        uint32_t value =
+            memory_amo_w(mem, registers[rs1], amo_ops[insn], registers[rs2]);
+        if (rd != 0) {
+          registers[rd] = value;
+        }
+        if (costs)
+          state->stall_cycles += costs->load;
+        break;
       }
-      program_count = target;
-      insns++;
-      continue;
 
-    } else if (opcode == 0b0000011) {
-      uint32_t address = registers[rs1] + i_imm;
+      // Zba
+      case INSN_SH1ADD:
+        registers[rd] = (registers[rs1] << 1) + registers[rs2];
+        break;
+      case INSN_SH2ADD:
+        registers[rd] = (registers[rs1] << 2) + registers[rs2];
+        break;
+      case INSN_SH3ADD:
+        registers[rd] = (registers[rs1] << 3) + registers[rs2];
+        break;
 
-      // LB
-      if (funct3 == 0b000) {
-        registers[rd] = (int8_t)memory_rd_b(mem, address);
-      }
-      // LH
-      else if (funct3 == 0b001) {
-        registers[rd] = (int16_t)memory_rd_h(mem, address);
-      }
-      // LW
-      else if (funct3 == 0b010) {
-        registers[rd] = memory_rd_w(mem, address);
-      }
-      // LBU
-      else if (funct3 == 0b100) {
-        registers[rd] = (uint8_t)memory_rd_b(mem, address);
-      }
-      // LHU
-      else if (funct3 == 0b101) {
-        registers[rd] = (uint16_t)memory_rd_h(mem, address);
-      } else {
-        fprintf(stderr,
-                "ERROR: Unknown I-Type Load instruction (funct3=0x%x)\n",
-                funct3);
+      // Zbb
+      case INSN_ANDN:
+        registers[rd] = registers[rs1] & ~registers[rs2];
+        break;
+      case INSN_ORN:
+        registers[rd] = registers[rs1] | ~registers[rs2];
+        break;
+      case INSN_XNOR:
+        registers[rd] = ~(registers[rs1] ^ registers[rs2]);
+        break;
+      case INSN_MIN:
+        registers[rd] = (int32_t)registers[rs1] < (int32_t)registers[rs2]
+                            ? registers[rs1]
+                            : registers[rs2];
+        break;
+      case INSN_MINU:
+        registers[rd] = registers[rs1] < registers[rs2] ? registers[rs1]
+                                                        : registers[rs2];
+        break;
+      case INSN_MAX:
+        registers[rd] = (int32_t)registers[rs1] > (int32_t)registers[rs2]
+                            ? registers[rs1]
+                            : registers[rs2];
+        break;
+      case INSN_MAXU:
+        registers[rd] = registers[rs1] > registers[rs2] ? registers[rs1]
+                                                        : registers[rs2];
+        break;
+      case INSN_ROL:
+        registers[rd] = rotate_left(registers[rs1], registers[rs2]);
+        break;
+      case INSN_ROR:
+        registers[rd] = rotate_left(registers[rs1], -registers[rs2]);
+        break;
+      case INSN_RORI:
+        registers[rd] = rotate_left(registers[rs1], -rs2);
+        break;
+      case INSN_ZEXT_H:
+        registers[rd] = registers[rs1] & 0xffff;
+        break;
+      case INSN_CLZ:
+        registers[rd] = registers[rs1] ? __builtin_clz(registers[rs1]) : 32;
+        break;
+      case INSN_CTZ:
+        registers[rd] = registers[rs1] ? __builtin_ctz(registers[rs1]) : 32;
+        break;
+      case INSN_CPOP:
+        registers[rd] = __builtin_popcount(registers[rs1]);
+        break;
+      case INSN_SEXT_B:
+        registers[rd] = (int8_t)registers[rs1];
+        break;
+      case INSN_SEXT_H:
+        registers[rd] = (int16_t)registers[rs1];
+        break;
+      // ORC.B: every non-zero byte becomes 0xff
+      case INSN_ORC_B: {
+        uint32_t value = registers[rs1];
+        uint32_t high  = (((value & 0x7f7f7f7f) + 0x7f7f7f7f) | value) &
+                        0x80808080;
+        registers[rd] = (high >> 7) * 0xff;
+        break;
       }
-      program_count += 4;
-      insns++;
-    }
+      case INSN_REV8:
+        registers[rd] = __builtin_bswap32(registers[rs1]);
+        break;
 
-    else if (opcode == 0b0010011) {
-      // ADDI
-      if (funct3 == 0b000) {
-        registers[rd] = registers[rs1] + i_imm;
-      }
-      // SLTI
-      else if (funct3 == 0b010) {
-        if ((int32_t)registers[rs1] < i_imm) {
-          registers[rd] = 1; // Set rd to 1 if true
-        } else {
-          registers[rd] = 0; // Set rd to 0 otherwise
+      // RVV, see vector.c
+      case INSN_OP_V:
+      case INSN_VLOAD8:
+      case INSN_VLOAD16:
+      case INSN_VLOAD32:
+      case INSN_VLOAD64:
+      case INSN_VSTORE8:
+      case INSN_VSTORE16:
+      case INSN_VSTORE32:
+      case INSN_VSTORE64:
+        if (!vector_execute(mem, state, instruction)) {
+          fprintf(stderr, "ERROR: Unknown vector instruction\n");
         }
-      }
-      // SLTIU
-      else if (funct3 == 0b011) {
-        if ((uint32_t)registers[rs1] < (uint32_t)i_imm) {
-          registers[rd] = 1; // Set rd to 1 if true
-        } else {
-          registers[rd] = 0; // Set rd to 0 otherwise
+        break;
+
+      // RV32F and RV32D, see fpu.c
+      case INSN_FLW:
+      case INSN_FLD:
+      case INSN_FSW:
+      case INSN_FSD:
+      case INSN_FMADD:
+      case INSN_FMSUB:
+      case INSN_FNMSUB:
+      case INSN_FNMADD:
+      case INSN_OP_FP:
+        if (!fpu_execute(mem, state, instruction)) {
+          fprintf(stderr, "ERROR: Unknown floating point instruction\n");
         }
-      }
-      // XORI
-      else if (funct3 == 0b100) {
-        registers[rd] = registers[rs1] ^ i_imm;
-      }
-      // ORI
-      else if (funct3 == 0b110) {
-        registers[rd] = registers[rs1] | i_imm;
-      }
-      // ANDI
-      else if (funct3 == 0b111) {
-        registers[rd] = registers[rs1] & i_imm;
-      }
-      // SLLI
-      else if (funct3 == 0b001 && funct7 == 0b0000000) {
-        registers[rd] = registers[rs1] << (i_imm & 00011111);
-      }
-      // SRLI
-      else if (funct3 == 0b101 && funct7 == 0b0000000) {
-        registers[rd] = (uint32_t)registers[rs1] >> (i_imm & 00011111);
-      }
-      // SRAI
-      else if (funct3 == 0b101 && funct7 == 0b0100000) {
-        registers[rd] = (int32_t)registers[rs1] >> (i_imm & 00011111);
+        if (costs)
+          state->stall_cycles += costs->fp;
+        break;
 
-      } else {
-        fprintf(stderr, "ERROR: Unknown I-Type instruction\n");
-      }
-      program_count += 4;
-      insns++;
+      default:
+        fprintf(stderr, "ERROR: Unknown instruction 0x%08x at 0x%08x\n",
+                encoding, program_count);
+        break;
     }
+    program_count += length;
+    insns++;
 
-    // S-Type
-    else if (opcode == 0b0100011) {
-      uint32_t address = registers[rs1] + s_imm;
-
-      // SB
-      if (funct3 == 0b000) {
-        memory_wr_b(mem, address, registers[rs2] & 0xFF);
-      }
-      // SH
-      else if (funct3 == 0b001) {
-        memory_wr_h(mem, address, registers[rs2] & 0xFFFF);
-      }
-      // SW
-      else if (funct3 == 0b010) {
-        memory_wr_w(mem, address, registers[rs2]);
-      } else {
-        fprintf(stderr, "ERROR: Unknown S-Type instruction (funct3=0x%x)\n",
-                funct3);
-      }
-      program_count += 4;
+    // the second instruction of a superinstruction, if it is in the code
+    // page. Never when tracing, which shows each instruction, or past stop_at
+    uint32_t next_offset = program_count - code_base;
+    if (fusion == FUSE_NONE || log_file || (stop_at > 0 && insns >= stop_at) ||
+        (program_count & 1) || next_offset > MEMORY_PAGE_SIZE - 4)
+      continue;
+    uint32_t raw         = read_code(code, next_offset);
+    uint32_t next_length = instruction_length(raw);
+    uint32_t next        = next_length == 2 ? expanded[raw & 0xffff] : raw;
+    uint32_t next_rd  = insn_rd(next);
+    uint32_t next_rs1 = insn_rs1(next);
+    uint32_t next_rs2 = insn_rs2(next);
+    if (fusion == FUSE_ADDI && matches(next, INSN_ADDI)) {
+      registers[next_rd] = registers[next_rs1] + insn_i_imm(next);
+      program_count += next_length;
       insns++;
-    }
-
-    // check for U-type
-    // LUI
-    else if (opcode == 0b0110111) {
-      if (rd != 0) {
-        registers[rd] = u_imm << 12;
-      }
-      program_count += 4;
+    } else if (fusion == FUSE_ADD && matches(next, INSN_ADD)) {
+      registers[next_rd] = registers[next_rs1] + registers[next_rs2];
+      program_count += next_length;
       insns++;
-      // AUIPC
-    } else if (opcode == 0b0010111) {
-      if (rd != 0) { // Avoid writing to x0
-        registers[rd] =
-            program_count + (u_imm << 12); // Immediate shifted left by 12 bits
+    } else if (fusion == FUSE_JALR && matches(next, INSN_JALR)) {
+      uint32_t target = (registers[next_rs1] + insn_i_imm(next)) & ~1;
+      if (next_rd != 0) {
+        registers[next_rd] = program_count + next_length;
       }
-      program_count += 4; // Move to the next instruction
+      program_count = target;
       insns++;
-    }
-
-    // check for J-type
-    // JAL
-    else if (opcode == 0b1101111) {
-      if (rd != 0) {
-        registers[rd] = program_count + 4;
-      }
-      program_count += jal_imm;
+      if (costs)
+        state->stall_cycles += costs->jump;
+      if (state->coverage)
+        cover_edge(state, program_count);
+    } else if (fusion == FUSE_BRANCH && is_branch(next)) {
+      int taken = branch_taken(next, registers[next_rs1], registers[next_rs2]);
+      program_count += taken ? insn_b_imm(next) : (int32_t)next_length;
       insns++;
+      if (costs && taken)
+        state->stall_cycles += costs->jump;
+      if (state->coverage)
+        cover_edge(state, program_count);
     }
+  }
+stop:
+  state->pc    = program_count;
+  state->insns = insns;
+  return result;
+}
 
-    // check for B-type
-    else if (opcode == 0b1100011) {
-      // BEQ
-      if (funct3 == 0b000) {
-        if (registers[rs1] == registers[rs2])
-          program_count += b_imm;
-        else
-          program_count += 4;
-        // BNE
-      } else if (funct3 == 0b001) {
-        if (registers[rs1] != registers[rs2])
-          program_count += b_imm;
-        else
-          program_count += 4;
-        // BLT
-      } else if (funct3 == 0b100) {
-        if ((int32_t)registers[rs1] < (int32_t)registers[rs2])
-          program_count += b_imm;
-        else
-          program_count += 4;
-        // BGE
-      } else if (funct3 == 0b101) {
-        if ((int32_t)registers[rs1] >= (int32_t)registers[rs2])
-          program_count += b_imm;
-        else
-          program_count += 4;
-        // BLTU
-      } else if (funct3 == 0b110) {
-        if ((uint32_t)registers[rs1] < (uint32_t)registers[rs2])
-          program_count += b_imm;
-        else
-          program_count += 4;
-        // BGEU
-      } else if (funct3 == 0b111) {
-        if ((uint32_t)registers[rs1] >= (uint32_t)registers[rs2])
-          program_count += b_imm;
-        else
-          program_count += 4;
-      } else {
-        fprintf(stderr, "unknown B-type\n");
-        program_count += 4;
-      }
-      insns++;
+int simulate_ecall(struct cpu_state* state, FILE* in, FILE* out) {
+  uint32_t* registers = state->registers;
+
+  // Call 1: Return getchar() in A0
+  if (registers[17] == 1) {
+    int input_char = fgetc(in);
+
+    if (input_char == EOF) {
+      registers[17] = 93; // 93 == exit
+    } else {
+      registers[10] = input_char;
     }
 
-    // system calls
-    else if (opcode == 0b1110011 && funct3 == 0b000 &&
-             funct12 == 0b000000000000) {
+    // Call 2: Perform putchar(c), where c is in A0
+  } else if (registers[17] == 2) {
+    fputc((char)registers[10], out);
+    fflush(out);
 
-      // Call 1: Return getchar() in A0
-      if (registers[17] == 1) {
-        int input_char = getchar();
+    // Call 3 or 93: Exit the simulation
+  } else if (registers[17] == 3 || registers[17] == 93) {
+    return SIM_EXITED;
+  } else {
+    fprintf(stderr, "Unknown system call: %u\n", registers[17]);
+  }
+  state->pc += 4;
+  state->insns++;
+  return SIM_STOPPED;
+}
 
-        if (input_char == EOF) {
-          registers[17] = 93; // 93 == exit
-        } else {
-          registers[10] = input_char;
-        }
+int simulate_store_size(const struct cpu_state* state, uint32_t instruction,
+                        uint32_t* addr) {
+  if (instruction_length(instruction) == 2)
+    instruction = compressed_expand(instruction);
+  uint32_t base = state->registers[insn_rs1(instruction)];
+  switch (decode(instruction)) {
+    case INSN_SB:
+    case INSN_SH:
+    case INSN_SW:
+    case INSN_FSW:
+    case INSN_FSD:
+      *addr = base + insn_s_imm(instruction);
+      return 1 << insn_funct3(instruction);
+    // SC.W and the AMOs, but not LR.W
+    case INSN_SC_W:
+    case INSN_AMOSWAP_W:
+    case INSN_AMOADD_W:
+    case INSN_AMOXOR_W:
+    case INSN_AMOAND_W:
+    case INSN_AMOOR_W:
+    case INSN_AMOMIN_W:
+    case INSN_AMOMAX_W:
+    case INSN_AMOMINU_W:
+    case INSN_AMOMAXU_W:
+      *addr = base;
+      return 4;
+    case INSN_VSTORE8:
+    case INSN_VSTORE16:
+    case INSN_VSTORE32:
+    case INSN_VSTORE64:
+      return vector_store_size(state, instruction, addr);
+    default:
+      return 0;
+  }
+}
 
-        // Call 2: Perform putchar(c), where c is in A0
-      } else if (registers[17] == 2) {
-        putchar((char)registers[10]);
-        fflush(stdout);
+void simulate_init(void) {
+  pthread_once(&expanded_once, expand_all);
+}
 
-        // Call 3 or 93: Exit the simulation
-      } else if (registers[17] == 3 || registers[17] == 93) {
-        break;
-      } else {
-        fprintf(stderr, "Unknown system call: %u\n", registers[17]);
-      }
-      program_count += 4;
-      insns++;
-    }
+int simulate_run(struct memory* mem, struct cpu_state* state,
+                 long int stop_at, FILE* log_file, struct symbols* symbols) {
+  // Memory faults longjmp back here. The interpreter keeps state->pc and
+  // state->insns up to date before each instruction, so they identify the
+  // faulting instruction.
+  simulate_init();
+  jmp_buf fault_handler;
+  if (setjmp(fault_handler)) {
+    memory_set_fault_handler(mem, NULL, NULL);
+    state->fault.pc = state->pc;
+    return SIM_FAULT;
   }
-  // return number of instructions executed
-  return (struct Stat){.insns = insns};
+  memory_set_fault_handler(mem, &fault_handler, &state->fault);
+  int result = run(mem, state, stop_at, log_file, symbols);
+  memory_set_fault_handler(mem, NULL, NULL);
+  return result;
+}
+
+int simulate_state(struct memory* mem, struct cpu_state* state,
+                   long int stop_at, FILE* log_file, struct symbols* symbols) {
+  int result;
+  do {
+    result = simulate_run(mem, state, stop_at, log_file, symbols);
+    if (result == SIM_ECALL)
+      result = simulate_ecall(state, stdin, stdout);
+  } while (result == SIM_STOPPED && (stop_at <= 0 || state->insns < stop_at));
+  return result;
 }
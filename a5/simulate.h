@@ -3,14 +3,104 @@
 
 #include "memory.h"
 #include "read_elf.h"
+#include <stdint.h>
 #include <stdio.h>
 
 // Simuler RISC-V program i givet lager og fra given start adresse
 struct Stat {
   long int insns;
+  int      exit_code; // a0 ved exit
 };
 
 struct Stat simulate(struct memory* mem, int start_addr, FILE* log_file,
                      struct symbols* symbols);
 
+// vektorregistrenes længde i bit (RVV VLEN), en potens af 2 fra 64 til 1024.
+// Kan vælges ved oversættelse med -DSIMULATE_VLEN=n
+#ifndef SIMULATE_VLEN
+#define SIMULATE_VLEN 128
+#endif
+#if SIMULATE_VLEN < 64 || SIMULATE_VLEN > 1024 ||                              \
+    (SIMULATE_VLEN & (SIMULATE_VLEN - 1))
+#error "SIMULATE_VLEN must be a power of 2 between 64 and 1024"
+#endif
+#define SIMULATE_VLENB (SIMULATE_VLEN / 8)
+
+// Valgfri tidsmodel: de ekstra cyklusser ud over én som hver slags
+// instruktion tager. Uden model er cyklustallet lig instruktionstallet.
+struct cycle_costs {
+  uint32_t load; // læsning fra lageret, også LR.W og AMO
+  uint32_t mul;  // MUL, MULH, MULHSU, MULHU
+  uint32_t div;  // DIV, DIVU, REM, REMU
+  uint32_t jump; // taget branch, JAL og JALR
+  uint32_t fp;   // F- og D-instruktioner
+};
+extern struct cycle_costs simulate_default_costs; // en simpel in-order kerne
+
+// Processorens tilstand - registre, pc og antal udførte instruktioner
+struct cpu_state {
+  uint32_t            registers[32];
+  uint32_t            pc;
+  long int            insns;
+  struct memory_fault fault; // udfyldt når simuleringen stopper med SIM_FAULT
+  uint32_t            hartid;
+  uint32_t            reservation; // adresse reserveret af LR.W
+  uint32_t            reservation_value;
+  int                 reservation_valid;
+  uint8_t*            coverage;      // kant-bitmap eller NULL, se nedenfor
+  uint32_t            coverage_prev; // forrige hop, til kant-hashen
+  uint64_t            fregs[32];     // F/D registre, float NaN-bokset
+  uint32_t            fcsr;          // frm og fflags, se fpu.h
+  uint32_t            vl;            // antal vektorelementer, se vector.h
+  uint32_t            vtype;         // elementbredde og LMUL
+  uint8_t             vregs[32 * SIMULATE_VLENB]; // v0-v31 efter hinanden
+  struct cycle_costs* cycle_costs;  // tidsmodel eller NULL
+  uint64_t            stall_cycles; // cyklusser ud over én per instruktion
+};
+
+// antal cyklusser, som tælleren cycle (Zicsr) viser. time viser det samme,
+// så kørsler kan gentages præcist, og instret viser insns.
+static inline uint64_t simulate_cycles(const struct cpu_state* state) {
+  return state->insns + state->stall_cycles;
+}
+
+// Dækning af kanter i AFL-stil: hver taget eller ikke-taget branch og hvert
+// JAL/JALR hop tæller en byte op i coverage, valgt ud fra hash af forrige og
+// nuværende hop-mål.
+#define SIMULATE_COVERAGE_BITS 16
+#define SIMULATE_COVERAGE_SIZE (1 << SIMULATE_COVERAGE_BITS)
+
+// Hvorfor simuleringen stoppede
+enum sim_result {
+  SIM_STOPPED,  // state->insns nåede stop_at
+  SIM_EXITED,   // programmet kaldte exit
+  SIM_FAULT,    // fejl ved lageradgang, se state->fault
+  SIM_ECALL,    // systemkald ved state->pc venter på at blive udført
+  SIM_DIVERGED, // afspillet input passer ikke med kørslen
+  SIM_BREAK,    // ebreak ved state->pc
+};
+
+// Forbered simulatoren (bl.a. tabellen over komprimerede instruktioner). Sker
+// ellers ved første simulate_run, så kald den før en tidsmåling begynder.
+// Må kaldes flere gange og fra flere tråde.
+void simulate_init(void);
+
+// Simuler fra given tilstand indtil stop_at instruktioner er udført, en fejl,
+// et systemkald eller ebreak. stop_at <= 0 betyder ingen grænse.
+int simulate_run(struct memory* mem, struct cpu_state* state,
+                 long int stop_at, FILE* log_file, struct symbols* symbols);
+
+// Udfør systemkaldet ved state->pc med in/out som terminal. Returnerer
+// SIM_EXITED hvis programmet afsluttede, ellers SIM_STOPPED.
+int simulate_ecall(struct cpu_state* state, FILE* in, FILE* out);
+
+// Antal bytes instruktionen vil skrive i lageret fra given tilstand, og
+// adressen i *addr. 0 hvis den ikke skriver. Må være komprimeret.
+int simulate_store_size(const struct cpu_state* state, uint32_t instruction,
+                        uint32_t* addr);
+
+// Som simulate_run, men udfører selv systemkald på stdin/stdout.
+int simulate_state(struct memory* mem, struct cpu_state* state,
+                   long int stop_at, FILE* log_file, struct symbols* symbols);
+
 #endif
\ No newline at end of file
@@ -3,7 +3,64 @@
 
 #include <stdint.h>
 
-uint32_t extractBits(uint32_t value, int end_bit, int start_bit);
-int32_t sign_extend32(int32_t value, int bits);
+// Bit fields. These are inline so that each use with constant bit numbers
+// compiles to a shift and a mask.
+
+// bits end_bit down to start_bit of value, end_bit >= start_bit
+static inline uint32_t extractBits(uint32_t value, int end_bit,
+                                   int start_bit) {
+  uint32_t mask = (uint32_t)(((uint64_t)1 << (end_bit - start_bit + 1)) - 1);
+  return (value >> start_bit) & mask;
+}
+
+// the low 'bits' bits of value as a signed number
+static inline int32_t sign_extend32(int32_t value, int bits) {
+  int shift = 32 - bits;
+  return (int32_t)((uint32_t)value << shift) >> shift;
+}
+
+// The operand fields of a 32-bit instruction
+static inline uint32_t insn_rd(uint32_t instruction) {
+  return (instruction >> 7) & 0x1f;
+}
+
+static inline uint32_t insn_funct3(uint32_t instruction) {
+  return (instruction >> 12) & 7;
+}
+
+static inline uint32_t insn_rs1(uint32_t instruction) {
+  return (instruction >> 15) & 0x1f;
+}
+
+static inline uint32_t insn_rs2(uint32_t instruction) {
+  return (instruction >> 20) & 0x1f;
+}
+
+// and its immediates, sign extended. The sign is always bit 31
+static inline int32_t insn_i_imm(uint32_t instruction) {
+  return (int32_t)instruction >> 20;
+}
+
+static inline int32_t insn_s_imm(uint32_t instruction) {
+  return ((int32_t)(instruction & 0xfe000000) >> 20) |
+         ((instruction >> 7) & 0x1f);
+}
+
+static inline int32_t insn_b_imm(uint32_t instruction) {
+  return ((int32_t)(instruction & 0x80000000) >> 19) |
+         ((instruction << 4) & 0x800) | ((instruction >> 20) & 0x7e0) |
+         ((instruction >> 7) & 0x1e);
+}
+
+// already shifted into place, unlike the other immediates
+static inline int32_t insn_u_imm(uint32_t instruction) {
+  return instruction & 0xfffff000;
+}
+
+static inline int32_t insn_j_imm(uint32_t instruction) {
+  return ((int32_t)(instruction & 0x80000000) >> 11) |
+         (instruction & 0xff000) | ((instruction >> 9) & 0x800) |
+         ((instruction >> 20) & 0x7fe);
+}
 
 #endif
@@ -0,0 +1,433 @@
+#include "vector.h"
+#include "tools.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define VLENB SIMULATE_VLENB
+
+// element-wise operations
+enum vector_op {
+  OP_ADD,
+  OP_SUB,
+  OP_RSUB,
+  OP_AND,
+  OP_OR,
+  OP_XOR,
+  OP_MUL,
+  OP_MACC,
+  OP_MOVE,
+};
+
+// Host SIMD registers of 16 bytes. The compiler turns arithmetic on these
+// into SSE instructions (AVX2 when it may use them) whatever the
+// optimisation level.
+typedef uint8_t  vec8 __attribute__((vector_size(16)));
+typedef uint16_t vec16 __attribute__((vector_size(16)));
+typedef uint32_t vec32 __attribute__((vector_size(16)));
+
+// d = a op b (vd = vs2 op vs1) on scalars or host vectors alike
+#define APPLY(op, d, a, b)                                                     \
+  switch (op) {                                                                \
+    case OP_ADD:                                                               \
+      d = a + b;                                                               \
+      break;                                                                   \
+    case OP_SUB:                                                               \
+      d = a - b;                                                               \
+      break;                                                                   \
+    case OP_RSUB:                                                              \
+      d = b - a;                                                               \
+      break;                                                                   \
+    case OP_AND:                                                               \
+      d = a & b;                                                               \
+      break;                                                                   \
+    case OP_OR:                                                                \
+      d = a | b;                                                               \
+      break;                                                                   \
+    case OP_XOR:                                                               \
+      d = a ^ b;                                                               \
+      break;                                                                   \
+    case OP_MUL:                                                               \
+      d = a * b;                                                               \
+      break;                                                                   \
+    case OP_MACC:                                                              \
+      d = a * b + d;                                                           \
+      break;                                                                   \
+    case OP_MOVE:                                                              \
+      d = b;                                                                   \
+      break;                                                                   \
+  }
+
+// vd = vs2 op vs1 over the first bytes bytes of the register groups, 16
+// bytes at a time and then the elements left over one by one. Operands may
+// be the same register group.
+#define ELEMENTWISE(name, vector_type, element_type)                           \
+  static void name(int op, uint8_t* vd, const uint8_t* vs2,                    \
+                   const uint8_t* vs1, uint32_t bytes) {                       \
+    uint32_t i = 0;                                                            \
+    for (; i + sizeof(vector_type) <= bytes; i += sizeof(vector_type)) {       \
+      vector_type d, a, b;                                                     \
+      memcpy(&d, vd + i, sizeof(d));                                           \
+      memcpy(&a, vs2 + i, sizeof(a));                                          \
+      memcpy(&b, vs1 + i, sizeof(b));                                          \
+      APPLY(op, d, a, b);                                                      \
+      memcpy(vd + i, &d, sizeof(d));                                           \
+    }                                                                          \
+    for (; i < bytes; i += sizeof(element_type)) {                             \
+      element_type d, a, b;                                                    \
+      memcpy(&d, vd + i, sizeof(d));                                           \
+      memcpy(&a, vs2 + i, sizeof(a));                                          \
+      memcpy(&b, vs1 + i, sizeof(b));                                          \
+      APPLY(op, d, a, b);                                                      \
+      memcpy(vd + i, &d, sizeof(d));                                           \
+    }                                                                          \
+  }
+
+ELEMENTWISE(elementwise8, vec8, uint8_t)
+ELEMENTWISE(elementwise16, vec16, uint16_t)
+ELEMENTWISE(elementwise32, vec32, uint32_t)
+
+static void elementwise(int op, int sew, uint8_t* vd, const uint8_t* vs2,
+                        const uint8_t* vs1, uint32_t bytes) {
+  switch (sew) {
+    case 1:
+      elementwise8(op, vd, vs2, vs1, bytes);
+      break;
+    case 2:
+      elementwise16(op, vd, vs2, vs1, bytes);
+      break;
+    default:
+      elementwise32(op, vd, vs2, vs1, bytes);
+  }
+}
+
+// element i of sew bytes, zero extended
+static uint32_t get_element(const uint8_t* reg, uint32_t i, int sew) {
+  uint32_t value = 0;
+  memcpy(&value, reg + i * sew, sew);
+  return value;
+}
+
+static void set_element(uint8_t* reg, uint32_t i, int sew, uint32_t value) {
+  memcpy(reg + i * sew, &value, sew);
+}
+
+// mask bit i in v0
+static int active(const struct cpu_state* state, uint32_t i) {
+  return (state->vregs[i / 8] >> (i % 8)) & 1;
+}
+
+// a register group of bytes bytes starting at reg fits in v0-v31
+static int fits(uint32_t reg, uint32_t bytes) {
+  return reg * VLENB + bytes <= 32 * VLENB;
+}
+
+// elements per register group for vtype, 0 if it is not supported: SEW
+// above ELEN (32), reserved fields, or a fraction of a register too small
+// for one element of ELEN
+static uint32_t vlmax(uint32_t vtype) {
+  uint32_t vsew  = VECTOR_VSEW(vtype);
+  uint32_t vlmul = VECTOR_VLMUL(vtype);
+  if ((vtype & ~0xffu) || vsew > 2 || vlmul == 4)
+    return 0;
+  uint32_t elements = VLENB >> vsew; // in one register
+  if (vlmul < 4)
+    return elements << vlmul;
+  uint32_t shift = 8 - vlmul; // LMUL 1/2, 1/4, 1/8
+  if ((8u << vsew) > (32u >> shift))
+    return 0;
+  return elements >> shift;
+}
+
+// vsetvli, vsetivli, vsetvl
+static int configure(struct cpu_state* state, uint32_t instruction) {
+  uint32_t* registers = state->registers;
+  uint32_t  rd        = insn_rd(instruction);
+  uint32_t  rs1       = insn_rs1(instruction);
+  uint32_t  vtype, avl;
+  if ((instruction >> 31) == 0) { // vsetvli
+    vtype = extractBits(instruction, 30, 20);
+  } else if ((instruction >> 30) == 0b11) { // vsetivli
+    vtype = extractBits(instruction, 29, 20);
+  } else if ((instruction >> 25) == 0b1000000) { // vsetvl
+    vtype = registers[insn_rs2(instruction)];
+  } else {
+    return 0;
+  }
+
+  // the application vector length: rs1, all of it if rs1 is x0 but rd is
+  // not, and the current vl if both are x0
+  if ((instruction >> 30) == 0b11)
+    avl = rs1;
+  else if (rs1 != 0)
+    avl = registers[rs1];
+  else if (rd != 0)
+    avl = UINT32_MAX;
+  else
+    avl = state->vl;
+
+  uint32_t max = vlmax(vtype);
+  if (max == 0) {
+    state->vtype = VECTOR_VILL;
+    state->vl    = 0;
+  } else {
+    state->vtype = vtype;
+    state->vl    = avl < max ? avl : max;
+  }
+  if (rd != 0)
+    registers[rd] = state->vl;
+  return 1;
+}
+
+// Unit-stride and strided loads and stores. Unmasked unit-stride accesses
+// copy the whole register group from and to the memory pages at once.
+static int transfer(struct memory* mem, struct cpu_state* state,
+                    uint32_t instruction) {
+  uint32_t opcode = extractBits(instruction, 6, 0);
+  uint32_t vd     = insn_rd(instruction); // vs3 for stores
+  uint32_t width  = insn_funct3(instruction);
+  uint32_t rs1    = insn_rs1(instruction);
+  uint32_t rs2    = insn_rs2(instruction); // stride, or lumop
+  uint32_t vm     = extractBits(instruction, 25, 25);
+  uint32_t mop    = extractBits(instruction, 27, 26);
+  uint32_t nf     = extractBits(instruction, 31, 28); // and mew
+  int      eew    = width == 0b000 ? 1 : 1 << (width - 0b100);
+  int      store  = opcode == 0b0100111;
+  uint32_t vl     = state->vl;
+  uint32_t bytes  = vl * eew;
+  // segments, indexed accesses, the special unit-stride forms and EEW 64
+  // are not supported
+  if ((state->vtype & VECTOR_VILL) || nf != 0 || eew > 4 ||
+      (mop != 0b00 && mop != 0b10) || (mop == 0b00 && rs2 != 0) ||
+      !fits(vd, bytes))
+    return 0;
+
+  uint8_t* reg  = &state->vregs[vd * VLENB];
+  uint32_t base = state->registers[rs1];
+  if (mop == 0b00 && vm) {
+    if (store)
+      memory_wr_block(mem, base, reg, bytes);
+    else
+      memory_rd_block(mem, base, reg, bytes);
+    return 1;
+  }
+
+  int32_t stride = mop == 0b10 ? (int32_t)state->registers[rs2] : eew;
+  for (uint32_t i = 0; i < vl; ++i) {
+    if (!vm && !active(state, i))
+      continue;
+    uint32_t address = base + i * stride;
+    if (store) {
+      uint32_t value = get_element(reg, i, eew);
+      if (eew == 1)
+        memory_wr_b(mem, address, value);
+      else if (eew == 2)
+        memory_wr_h(mem, address, value);
+      else
+        memory_wr_w(mem, address, value);
+    } else {
+      uint32_t value;
+      if (eew == 1)
+        value = memory_rd_b(mem, address);
+      else if (eew == 2)
+        value = memory_rd_h(mem, address);
+      else
+        value = memory_rd_w(mem, address);
+      set_element(reg, i, eew, value);
+    }
+  }
+  return 1;
+}
+
+// vredsum and friends: vd[0] = vs1[0] op vs2[0..vl-1]
+static int reduce(struct cpu_state* state, uint32_t funct6, uint32_t vm,
+                  uint32_t vd, uint32_t vs2, uint32_t vs1, int sew) {
+  uint32_t vl = state->vl;
+  if (funct6 > 0b000111 || !fits(vs2, vl * sew))
+    return 0;
+  uint8_t* group = &state->vregs[vs2 * VLENB];
+  int      bits  = 8 * sew;
+  uint32_t acc   = get_element(&state->vregs[vs1 * VLENB], 0, sew);
+  for (uint32_t i = 0; i < vl; ++i) {
+    if (!vm && !active(state, i))
+      continue;
+    uint32_t value = get_element(group, i, sew);
+    switch (funct6) {
+      case 0b000000: // vredsum
+        acc += value;
+        break;
+      case 0b000001: // vredand
+        acc &= value;
+        break;
+      case 0b000010: // vredor
+        acc |= value;
+        break;
+      case 0b000011: // vredxor
+        acc ^= value;
+        break;
+      case 0b000100: // vredminu
+        acc = value < acc ? value : acc;
+        break;
+      case 0b000101: // vredmin
+        if (sign_extend32(value, bits) < sign_extend32(acc, bits))
+          acc = value;
+        break;
+      case 0b000110: // vredmaxu
+        acc = value > acc ? value : acc;
+        break;
+      case 0b000111: // vredmax
+        if (sign_extend32(value, bits) > sign_extend32(acc, bits))
+          acc = value;
+        break;
+    }
+  }
+  if (vl > 0)
+    set_element(&state->vregs[vd * VLENB], 0, sew, acc);
+  return 1;
+}
+
+// OP-V arithmetic: the .vv, .vx and .vi forms of the integer operations,
+// reductions and the moves between scalar and vector registers
+static int arithmetic(struct cpu_state* state, uint32_t instruction) {
+  uint32_t* registers = state->registers;
+  uint32_t  vd        = insn_rd(instruction);
+  uint32_t  funct3    = insn_funct3(instruction);
+  uint32_t  vs1       = insn_rs1(instruction); // rs1, imm
+  uint32_t  vs2       = insn_rs2(instruction);
+  uint32_t  vm        = extractBits(instruction, 25, 25);
+  uint32_t  funct6    = extractBits(instruction, 31, 26);
+  int       sew       = 1 << VECTOR_VSEW(state->vtype);
+  uint32_t  vl        = state->vl;
+  uint32_t  bytes     = vl * sew;
+  int       is_vector = funct3 == 0b000 || funct3 == 0b010; // OPIVV, OPMVV
+  int       is_m      = funct3 == 0b010 || funct3 == 0b110; // OPMVV, OPMVX
+  int       op        = -1;
+  if (state->vtype & VECTOR_VILL)
+    return 0;
+
+  if (is_m && funct6 == 0b010000) {
+    if (funct3 == 0b010 && vs1 == 0) { // vmv.x.s
+      uint32_t value = get_element(&state->vregs[vs2 * VLENB], 0, sew);
+      if (vd != 0)
+        registers[vd] = sign_extend32(value, 8 * sew);
+      return 1;
+    }
+    if (funct3 == 0b110 && vs2 == 0) { // vmv.s.x
+      if (vl > 0)
+        set_element(&state->vregs[vd * VLENB], 0, sew, registers[vs1]);
+      return 1;
+    }
+    return 0;
+  }
+  if (funct3 == 0b010 && funct6 <= 0b000111)
+    return reduce(state, funct6, vm, vd, vs2, vs1, sew);
+
+  if (is_m) {
+    if (funct6 == 0b100101)
+      op = OP_MUL;
+    else if (funct6 == 0b101101)
+      op = OP_MACC; // vd = vs1 * vs2 + vd
+  } else if (funct3 == 0b000 || funct3 == 0b011 || funct3 == 0b100) {
+    switch (funct6) {
+      case 0b000000:
+        op = OP_ADD;
+        break;
+      case 0b000010:
+        op = funct3 == 0b011 ? -1 : OP_SUB;
+        break;
+      case 0b000011:
+        op = funct3 == 0b000 ? -1 : OP_RSUB;
+        break;
+      case 0b001001:
+        op = OP_AND;
+        break;
+      case 0b001010:
+        op = OP_OR;
+        break;
+      case 0b001011:
+        op = OP_XOR;
+        break;
+      case 0b010111: // vmv.v (vm set, vs2 v0) and vmerge
+        if (vm && vs2 != 0)
+          return 0;
+        op = OP_MOVE;
+        break;
+    }
+  }
+  if (op < 0 || !fits(vd, bytes) || !fits(vs2, bytes) ||
+      (is_vector && !fits(vs1, bytes)))
+    return 0;
+
+  // the scalar operand of .vx and .vi, repeated over a register group
+  uint8_t        scalar[8 * VLENB];
+  const uint8_t* operand = &state->vregs[vs1 * VLENB];
+  if (!is_vector) {
+    uint32_t value = funct3 == 0b011 ? (uint32_t)sign_extend32(vs1, 5)
+                                     : registers[vs1];
+    for (uint32_t i = 0; i < vl; ++i)
+      set_element(scalar, i, sew, value);
+    operand = scalar;
+  }
+
+  uint8_t* dest = &state->vregs[vd * VLENB];
+  uint8_t* src  = &state->vregs[vs2 * VLENB];
+  if (vm) {
+    elementwise(op, sew, dest, src, operand, bytes);
+    return 1;
+  }
+  uint8_t result[8 * VLENB];
+  if (op == OP_MOVE) {
+    // vmerge: vs2 where the mask is clear, the operand where it is set. Built
+    // in result, since vd may be vs1 or vs2
+    memcpy(result, src, bytes);
+    for (uint32_t i = 0; i < vl; ++i) {
+      if (active(state, i))
+        memcpy(result + i * sew, operand + i * sew, sew);
+    }
+    memcpy(dest, result, bytes);
+    return 1;
+  }
+  // masked: the whole operation into a copy, then the active elements back
+  memcpy(result, dest, bytes);
+  elementwise(op, sew, result, src, operand, bytes);
+  for (uint32_t i = 0; i < vl; ++i) {
+    if (active(state, i))
+      memcpy(dest + i * sew, result + i * sew, sew);
+  }
+  return 1;
+}
+
+int vector_execute(struct memory* mem, struct cpu_state* state,
+                   uint32_t instruction) {
+  uint32_t opcode = extractBits(instruction, 6, 0);
+  uint32_t funct3 = insn_funct3(instruction);
+  if (opcode != 0b1010111)
+    return transfer(mem, state, instruction);
+  if (funct3 == 0b111)
+    return configure(state, instruction);
+  return arithmetic(state, instruction);
+}
+
+int vector_store_size(const struct cpu_state* state, uint32_t instruction,
+                      uint32_t* addr) {
+  uint32_t width = insn_funct3(instruction);
+  uint32_t rs1   = insn_rs1(instruction);
+  uint32_t rs2   = insn_rs2(instruction);
+  uint32_t mop   = extractBits(instruction, 27, 26);
+  int      eew   = width == 0b000 ? 1 : 1 << (width - 0b100);
+  uint32_t vl    = state->vl;
+  if (extractBits(instruction, 6, 0) != 0b0100111 || vl == 0 ||
+      (state->vtype & VECTOR_VILL))
+    return 0;
+  *addr = state->registers[rs1];
+  if (mop == 0b00)
+    return vl * eew;
+  if (mop != 0b10)
+    return 0;
+  int64_t span = (int64_t)(int32_t)state->registers[rs2] * (vl - 1);
+  if (span < 0) {
+    *addr += span;
+    span = -span;
+  }
+  return span + eew < INT32_MAX ? span + eew : INT32_MAX;
+}
@@ -0,0 +1,39 @@
+#ifndef __VECTOR_H__
+#define __VECTOR_H__
+
+#include "memory.h"
+#include "simulate.h"
+
+#include <stdint.h>
+
+// A subset of RVV 1.0 with ELEN 32 and VLEN SIMULATE_VLEN:
+//   vsetvli, vsetivli, vsetvl
+//   vle8/16/32.v, vse8/16/32.v, vlse8/16/32.v, vsse8/16/32.v
+//   vadd, vsub, vrsub, vand, vor, vxor, vmul, vmacc, vmv.v, vmerge
+//   vredsum, vredand, vredor, vredxor, vredmin[u], vredmax[u]
+//   vmv.x.s, vmv.s.x
+// all with masking. Tails and inactive elements are left undisturbed. The
+// vector registers lie one after the other in cpu_state.vregs, so a
+// register group is a contiguous byte array and element-wise operations run
+// as host SIMD loops over it.
+
+// vtype fields
+#define VECTOR_VLMUL(vtype) ((vtype) & 7)
+#define VECTOR_VSEW(vtype) (((vtype) >> 3) & 7) // SEW = 8 << vsew
+#define VECTOR_VTA 0x40
+#define VECTOR_VMA 0x80
+#define VECTOR_VILL 0x80000000u // unsupported vtype, vector instructions fail
+
+// Execute one vector instruction. Returns 0 if it is not one of the
+// supported ones or not valid with the current vtype, which leaves the
+// state untouched.
+int vector_execute(struct memory* mem, struct cpu_state* state,
+                   uint32_t instruction);
+
+// Like simulate_store_size for a vector store: the bytes from *addr the
+// store may write, 0 if it is not one. A strided store covers the range
+// between its first and last element.
+int vector_store_size(const struct cpu_state* state, uint32_t instruction,
+                      uint32_t* addr);
+
+#endif